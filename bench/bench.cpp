@@ -0,0 +1,561 @@
+// Benchmarks for crefile. Run `benchmarks <name> [args...]`,
+// without arguments every benchmark runs with its default size.
+#include <crefile.hpp>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#if defined(__linux__)
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#endif
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+
+} // namespace
+
+
+// Allocations are counted by replacing every form of the global operator
+// new. Deletes stay out of line: GCC takes free() inlined into a caller of
+// operator new for a mismatched pair.
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+namespace {
+
+void* counted_new(size_t size, size_t alignment = alignof(std::max_align_t)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = nullptr;
+    if (alignment <= alignof(std::max_align_t)) {
+        ptr = std::malloc(size ? size : 1);
+    } else if (::posix_memalign(&ptr, alignment, size ? size : 1) != 0) {
+        ptr = nullptr;
+    }
+    if (!ptr) {
+        throw std::bad_alloc{};
+    }
+    return ptr;
+}
+
+void* counted_new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return counted_new(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+} // namespace
+
+void* operator new(size_t size) { return counted_new(size); }
+void* operator new[](size_t size) { return counted_new(size); }
+void* operator new(size_t size, const std::nothrow_t& tag) noexcept { return counted_new(size, tag); }
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return counted_new(size, tag); }
+BENCH_NOINLINE void operator delete(void* ptr) noexcept { std::free(ptr); }
+BENCH_NOINLINE void operator delete[](void* ptr) noexcept { std::free(ptr); }
+BENCH_NOINLINE void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+BENCH_NOINLINE void operator delete[](void* ptr, size_t) noexcept { std::free(ptr); }
+BENCH_NOINLINE void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+BENCH_NOINLINE void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+
+#if defined(__cpp_aligned_new)
+void* operator new(size_t size, std::align_val_t alignment) { return counted_new(size, size_t(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return counted_new(size, size_t(alignment)); }
+BENCH_NOINLINE void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+BENCH_NOINLINE void operator delete[](void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+BENCH_NOINLINE void operator delete(void* ptr, size_t, std::align_val_t) noexcept { std::free(ptr); }
+BENCH_NOINLINE void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { std::free(ptr); }
+#endif
+
+namespace {
+
+typedef std::function<void(const std::vector<std::string>&)> Benchmark;
+
+class Timer {
+public:
+    Timer() : start_(std::chrono::steady_clock::now()) {}
+
+    double seconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+size_t arg(const std::vector<std::string>& args, size_t index, size_t default_value) {
+    return index < args.size()? std::stoul(args[index]) : default_value;
+}
+
+#if defined(__linux__)
+// Syscall stops of a child process running fn n_rounds times under
+// ptrace, two per syscall. The parent calls prepare() before every round
+// while the child waits in raise(SIGSTOP), so only the child is counted.
+size_t traced_syscall_stops(size_t n_rounds, const std::function<void()>& prepare, const std::function<void()>& fn) {
+    const pid_t child = ::fork();
+    if (child == 0) {
+        ::ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        for (size_t round = 0; round < n_rounds; ++round) {
+            ::raise(SIGSTOP);
+            fn();
+        }
+        ::_exit(0);
+    }
+    int status = 0;
+    ::waitpid(child, &status, 0);
+    ::ptrace(PTRACE_SETOPTIONS, child, nullptr, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+    size_t stops = 0;
+    while (WIFSTOPPED(status)) {
+        if (WSTOPSIG(status) == SIGSTOP) {
+            prepare();
+        } else if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            ++stops;
+        }
+        ::ptrace(PTRACE_SYSCALL, child, nullptr, nullptr);
+        ::waitpid(child, &status, 0);
+    }
+    return stops;
+}
+
+// Syscalls per call of fn, without the ones of raise() and _exit()
+double count_syscalls(size_t n_rounds, const std::function<void()>& prepare, const std::function<void()>& fn) {
+    const size_t stops = traced_syscall_stops(n_rounds, prepare, fn);
+    const size_t overhead = traced_syscall_stops(n_rounds, prepare, []{});
+    return (double(stops) - double(overhead)) / 2 / n_rounds;
+}
+#endif
+
+crefile::Path bench_dir(const char* name) {
+    const auto dir = crefile::Path{crefile::tmp_dir(), "crefile_bench", name};
+    dir.rmrf_if_exists();
+    return dir.mkdir_parents();
+}
+
+// n_files files spread over directories of files_per_dir files, two levels deep
+void make_tree(const crefile::Path& root, size_t n_files, size_t files_per_dir = 1000) {
+    const size_t n_dirs = (n_files + files_per_dir - 1) / files_per_dir;
+    size_t made = 0;
+    for (size_t d = 0; d < n_dirs; ++d) {
+        const auto dir = crefile::Path{root, std::to_string(d % 32), std::to_string(d)}.mkdir_parents();
+        for (size_t f = 0; f < files_per_dir && made < n_files; ++f, ++made) {
+            std::ofstream{crefile::Path{dir, std::to_string(f)}.c_str()};
+        }
+    }
+}
+
+void bench_lexical(const std::vector<std::string>& args) {
+    const size_t n_paths = arg(args, 0, 10000000);
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < 1024; ++i) {
+        paths.push_back("/srv/data/customers/" + std::to_string(i) + "/reports/2016/12/quarterly_summary_" + std::to_string(i) + ".csv");
+    }
+
+    size_t total = 0;
+    Timer timer;
+    for (size_t i = 0; i < n_paths; ++i) {
+        const crefile::PathView path{paths[i % paths.size()]};
+        for (const auto component : path) {
+            total += component.size();
+        }
+        total += path.parent().size() + path.extension().size();
+    }
+    const auto seconds = timer.seconds();
+    std::cout << "components + parent + extension x" << n_paths << ": " << seconds << " s, "
+        << n_paths / seconds / 1e6 << " M paths/s" << std::endl;
+
+    // Paths nobody queries, e.g. made by a listing, are never indexed
+    Timer make_timer;
+    for (size_t i = 0; i < n_paths; ++i) {
+        const crefile::Path path{paths[i % paths.size()]};
+        total += path.size();
+    }
+    const auto make_seconds = make_timer.seconds();
+    std::cout << "Path from string x" << n_paths << ": " << make_seconds << " s, "
+        << n_paths / make_seconds / 1e6 << " M paths/s" << std::endl;
+
+    std::vector<crefile::Path> indexed(paths.begin(), paths.end());
+    Timer index_timer;
+    for (size_t i = 0; i < n_paths; ++i) {
+        const auto& path = indexed[i % indexed.size()];
+        total += path.depth() + path.parent().size() + path.basename().size() + path.component(2).size();
+    }
+    const auto index_seconds = index_timer.seconds();
+    std::cout << "indexed Path depth + parent + basename + component x" << n_paths << ": " << index_seconds << " s, "
+        << n_paths / index_seconds / 1e6 << " M paths/s" << std::endl;
+
+    if (total == 0) {
+        std::cout << std::endl;
+    }
+}
+
+// rmrf as it was before the openat rewrite: a recursive listing with one
+// remove() per entry by its full path
+void path_rmrf(const crefile::Path& path) {
+    for (crefile::FileIter iter{path.str()}; !iter.is_end(); ++iter) {
+        const crefile::Path child{iter.path().c_str()};
+        if (iter.is_directory()) {
+            path_rmrf(child);
+        } else {
+            crefile::check_error(::remove(child.c_str()));
+        }
+    }
+    crefile::check_error(::remove(path.c_str()));
+}
+
+void bench_rmrf(const std::vector<std::string>& args) {
+    const size_t n_files = arg(args, 0, 1000000);
+    const size_t max_threads = arg(args, 1, std::thread::hardware_concurrency());
+
+    const auto root = bench_dir("rmrf");
+    make_tree(root, n_files);
+    Timer path_timer;
+    path_rmrf(root);
+    std::cout << "recursive remove() by path, " << n_files << " files: " << path_timer.seconds() << " s" << std::endl;
+
+    root.mkdir();
+    make_tree(root, n_files);
+    Timer rmrf_timer;
+    root.rmrf();
+    std::cout << "rmrf, " << n_files << " files: " << rmrf_timer.seconds() << " s" << std::endl;
+
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        root.mkdir();
+        make_tree(root, n_files);
+        Timer timer;
+        root.rmrf_parallel(n_threads);
+        std::cout << "rmrf_parallel(" << n_threads << "), " << n_files << " files: "
+            << timer.seconds() << " s" << std::endl;
+    }
+}
+
+void bench_walk(const std::vector<std::string>& args) {
+    const size_t n_files = arg(args, 0, 1000000);
+    const size_t max_threads = arg(args, 1, std::thread::hardware_concurrency());
+
+    const auto root = bench_dir("walk");
+    make_tree(root, n_files, 100);
+
+    Timer walk_timer;
+    size_t walked = 0;
+    for (const auto& entry : crefile::walk(root)) {
+        walked += entry.is_directory()? 0 : 1;
+    }
+    std::cout << "walk, " << walked << " files: " << walk_timer.seconds() << " s" << std::endl;
+
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        crefile::ParallelWalkOptions options;
+        options.n_threads = n_threads;
+        std::atomic<size_t> visited{0};
+        Timer timer;
+        crefile::parallel_walk(root, [&visited](const crefile::WalkEntry& entry) {
+            if (!entry.is_directory()) {
+                visited.fetch_add(1, std::memory_order_relaxed);
+            }
+        }, options);
+        std::cout << "parallel_walk(" << n_threads << "), " << visited << " files: "
+            << timer.seconds() << " s" << std::endl;
+    }
+    root.rmrf_parallel();
+}
+
+// Paths joined the way crefile did with plain std::string storage
+std::string string_join(const std::string& a, const char* b) {
+    std::string res = a;
+    if (!res.empty() && res.back() != '/') {
+        res += '/';
+    }
+    res += b;
+    return res;
+}
+
+void bench_join(const std::vector<std::string>& args) {
+    const size_t n_joins = arg(args, 0, 1000000);
+    const std::string base = "/var/spool/incoming/queue_0042/batch_000017";
+    const crefile::PosixPath base_path{base};
+    size_t total = 0;
+
+    size_t before = allocations;
+    Timer string_timer;
+    for (size_t i = 0; i < n_joins; ++i) {
+        const auto dir = string_join(base, "partition_with_a_long_name");
+        total += string_join(dir, "message_0000000001.eml").size();
+    }
+    std::cout << "std::string join x" << n_joins << ": " << string_timer.seconds() << " s, "
+        << allocations - before << " allocations" << std::endl;
+
+    before = allocations;
+    Timer path_timer;
+    for (size_t i = 0; i < n_joins; ++i) {
+        const crefile::PosixPath dir{base_path, "partition_with_a_long_name"};
+        total += crefile::PosixPath{dir, "message_0000000001.eml"}.size();
+    }
+    std::cout << "PosixPath join x" << n_joins << ": " << path_timer.seconds() << " s, "
+        << allocations - before << " allocations" << std::endl;
+
+    const crefile::Path long_base{base + "/" + std::string(250, 'x')};
+    before = allocations;
+    Timer chain_timer;
+    for (size_t i = 0; i < n_joins; ++i) {
+        const crefile::Path path = long_base / "partition_with_a_long_name" / "2016" / "message_0000000001.eml";
+        total += path.size();
+    }
+    std::cout << "Path / x3 over 250 characters x" << n_joins << ": " << chain_timer.seconds() << " s, "
+        << allocations - before << " allocations" << std::endl;
+
+    if (total == 0) {
+        std::cout << std::endl;
+    }
+}
+
+void bench_table(const std::vector<std::string>& args) {
+    const size_t n_paths = arg(args, 0, 1000000);
+    std::vector<std::string> paths;
+    paths.reserve(n_paths);
+    for (size_t i = 0; i < n_paths; ++i) {
+        paths.push_back("/srv/data/customers/customer_" + std::to_string(i / 10000) + "/reports_" +
+            std::to_string(i / 100 % 100) + "/summary_" + std::to_string(i % 100) + ".csv");
+    }
+    size_t string_bytes = paths.capacity() * sizeof(std::string);
+    for (const auto& path : paths) {
+        string_bytes += path.capacity() >= sizeof(std::string) ? path.capacity() + 1 : 0;
+    }
+    std::cout << "std::string x" << n_paths << ": " << string_bytes / 1e6 << " MB, "
+        << "Path x" << n_paths << ": " << n_paths * sizeof(crefile::Path) / 1e6 << " MB" << std::endl;
+
+    crefile::PathTable table{n_paths};
+    Timer timer;
+    for (const auto& path : paths) {
+        table.insert(crefile::PathView{path});
+    }
+    const auto seconds = timer.seconds();
+    std::cout << "PathTable x" << n_paths << ": " << table.memory_usage() / 1e6 << " MB, "
+        << "insert " << n_paths / seconds / 1e6 << " M paths/s" << std::endl;
+}
+
+// mkdir_parents against a per-prefix exists() + mkdir() loop on a path
+// of depth components with missing of them to create
+void bench_mkdir_parents(const std::vector<std::string>& args) {
+    const size_t n_rounds = arg(args, 0, 10000);
+    const size_t depth = arg(args, 1, 10);
+    const auto root = bench_dir("mkdir_parents");
+    crefile::Path leaf = root;
+    for (size_t i = 0; i < depth; ++i) {
+        leaf = crefile::Path{leaf, "level_" + std::to_string(i)};
+    }
+
+    const auto per_prefix = [](const crefile::Path& path) {
+        for (size_t i = 1; i <= path.depth(); ++i) {
+            crefile::Path{path.prefix(i).str()}.mkdir_if_not_exists();
+        }
+    };
+    const auto reverse = [](const crefile::Path& path) {
+        path.mkdir_parents();
+    };
+    const std::vector<std::pair<const char*, std::function<void(const crefile::Path&)>>> strategies = {
+        {"exists + mkdir per prefix", per_prefix},
+        {"mkdir_parents", reverse},
+    };
+
+    for (const size_t missing : {size_t(0), size_t(1), depth / 2}) {
+        const auto remove_missing = [&] {
+            for (size_t i = 0; i < missing; ++i) {
+                ::rmdir(leaf.prefix(leaf.depth() - i).str().c_str());
+            }
+        };
+        for (const auto& strategy : strategies) {
+            crefile::Path{leaf}.mkdir_parents();
+            double seconds = 0;
+            for (size_t round = 0; round < n_rounds; ++round) {
+                remove_missing();
+                Timer timer;
+                strategy.second(leaf);
+                seconds += timer.seconds();
+            }
+            std::cout << strategy.first << ", depth " << leaf.depth() << ", " << missing << " missing: ";
+#if defined(__linux__)
+            // Tracing is slow, a few rounds give exact counts
+            const size_t n_traced = std::min<size_t>(n_rounds, 100);
+            std::cout << count_syscalls(n_traced, remove_missing, [&] { strategy.second(leaf); }) << " syscalls, ";
+#endif
+            std::cout << seconds / n_rounds * 1e6 << " us" << std::endl;
+        }
+    }
+}
+
+void bench_stat_many(const std::vector<std::string>& args) {
+    const size_t n_files = arg(args, 0, 100000);
+    const size_t max_threads = arg(args, 1, std::thread::hardware_concurrency());
+
+    const auto root = bench_dir("stat_many");
+    make_tree(root, n_files);
+    std::vector<crefile::Path> paths;
+    for (const auto& entry : crefile::walk(root)) {
+        if (!entry.is_directory()) {
+            paths.emplace_back(entry.path());
+        }
+    }
+
+    Timer status_timer;
+    uint64_t size = 0;
+    for (const auto& path : paths) {
+        size += path.status(crefile::StatFields::Size).size;
+    }
+    std::cout << "Path::status, " << paths.size() << " paths: " << status_timer.seconds() << " s" << std::endl;
+
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        crefile::StatManyOptions options;
+        options.fields = crefile::StatFields::Size;
+        options.n_threads = n_threads;
+        Timer timer;
+        const auto results = crefile::stat_many(paths, options);
+        std::cout << "stat_many(" << n_threads << "), " << results.size() << " paths: "
+            << timer.seconds() << " s" << std::endl;
+    }
+    root.rmrf_parallel();
+}
+
+void bench_batch(const std::vector<std::string>& args) {
+    const size_t n_files = arg(args, 0, 100000);
+    const unsigned queue_depth = static_cast<unsigned>(arg(args, 1, 64));
+    crefile::BatchOptions options;
+    options.queue_depth = queue_depth;
+    crefile::BatchEngine engine{options};
+    std::cout << (engine.uses_io_uring()? "io_uring" : "plain syscalls") << ", queue depth " << engine.queue_depth() << std::endl;
+
+    const auto root = bench_dir("batch");
+    make_tree(root, n_files);
+    std::vector<crefile::Path> paths;
+    for (const auto& entry : crefile::walk(root)) {
+        if (!entry.is_directory()) {
+            paths.emplace_back(entry.path());
+        }
+    }
+
+    Timer status_timer;
+    for (const auto& path : paths) {
+        path.status(crefile::StatFields::Size);
+    }
+    std::cout << "Path::status, " << paths.size() << " paths: " << status_timer.seconds() << " s" << std::endl;
+
+    Timer stat_timer;
+    engine.stat(paths, crefile::StatFields::Size);
+    std::cout << "BatchEngine::stat, " << paths.size() << " paths: " << stat_timer.seconds() << " s" << std::endl;
+
+    Timer rmrf_timer;
+    root.rmrf();
+    std::cout << "rmrf, " << n_files << " files: " << rmrf_timer.seconds() << " s" << std::endl;
+
+    root.mkdir();
+    make_tree(root, n_files);
+    Timer batched_timer;
+    root.rmrf(engine);
+    std::cout << "rmrf(engine), " << n_files << " files: " << batched_timer.seconds() << " s" << std::endl;
+}
+
+void bench_poll_watcher(const std::vector<std::string>& args) {
+    const size_t n_files = arg(args, 0, 1000000);
+    const size_t n_changes = arg(args, 1, 100);
+
+    const auto root = bench_dir("poll_watcher");
+    make_tree(root, n_files);
+    Timer snapshot_timer;
+    crefile::PollWatcher watcher{root};
+    std::cout << "snapshot, " << watcher.size() << " entries: " << snapshot_timer.seconds() << " s, "
+        << watcher.memory_usage() / 1e6 << " MB" << std::endl;
+    // Let directory mtimes age past the racy window
+    std::this_thread::sleep_for(std::chrono::seconds{2});
+    watcher.poll();
+
+    for (const bool changes : {false, true}) {
+        if (changes) {
+            for (size_t i = 0; i < n_changes; ++i) {
+                std::ofstream{crefile::Path{root, std::to_string(i % 32), std::to_string(i), "new"}.c_str()};
+            }
+        }
+        Timer timer;
+        const auto events = watcher.poll();
+        std::cout << "poll, " << (changes? n_changes : 0) << " changed directories: " << timer.seconds() * 1e3
+            << " ms, " << events.size() << " events" << std::endl;
+    }
+
+    crefile::PollWatcherOptions options;
+    options.check_files = true;
+    crefile::PollWatcher file_watcher{root, options};
+    std::this_thread::sleep_for(std::chrono::seconds{2});
+    file_watcher.poll();
+    Timer files_timer;
+    file_watcher.poll();
+    std::cout << "poll with check_files: " << files_timer.seconds() * 1e3 << " ms" << std::endl;
+    root.rmrf_parallel();
+}
+
+void bench_snapshot(const std::vector<std::string>& args) {
+    const size_t n_files = arg(args, 0, 1000000);
+    const size_t max_threads = arg(args, 1, std::thread::hardware_concurrency());
+    const size_t n_changes = 1000;
+
+    const auto root = bench_dir("snapshot");
+    make_tree(root, n_files);
+    crefile::Snapshot before;
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        crefile::SnapshotOptions options;
+        options.n_threads = n_threads;
+        Timer timer;
+        before = crefile::Snapshot::capture(root, options);
+        std::cout << "capture(" << n_threads << "), " << before.size() << " entries: " << timer.seconds() << " s, "
+            << before.memory_usage() / 1e6 << " MB" << std::endl;
+    }
+
+    for (size_t i = 0; i < n_changes; ++i) {
+        std::ofstream{crefile::Path{root, std::to_string(i % 32), std::to_string(i), "new"}.c_str()};
+    }
+    const auto after = crefile::Snapshot::capture(root);
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        crefile::SnapshotOptions options;
+        options.n_threads = n_threads;
+        Timer timer;
+        const auto changes = crefile::diff(before, after, options);
+        std::cout << "diff(" << n_threads << "), " << changes.size() << " changes: " << timer.seconds() * 1e3 << " ms" << std::endl;
+    }
+    root.rmrf_parallel();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const std::map<std::string, Benchmark> benchmarks = {
+        {"batch", bench_batch},
+        {"join", bench_join},
+        {"lexical", bench_lexical},
+        {"mkdir_parents", bench_mkdir_parents},
+        {"poll_watcher", bench_poll_watcher},
+        {"rmrf", bench_rmrf},
+        {"snapshot", bench_snapshot},
+        {"stat_many", bench_stat_many},
+        {"table", bench_table},
+        {"walk", bench_walk},
+    };
+
+    if (argc < 2) {
+        for (const auto& bench : benchmarks) {
+            bench.second({});
+        }
+        return 0;
+    }
+
+    const auto found = benchmarks.find(argv[1]);
+    if (found == benchmarks.end()) {
+        std::cerr << "Unknown benchmark: " << argv[1] << std::endl;
+        return 1;
+    }
+    found->second(std::vector<std::string>(argv + 2, argv + argc));
+    return 0;
+}
@@ -2,10 +2,40 @@
 #pragma once
 
 #include <string>
+#include <cstring>
 #include <vector>
+#include <memory>
 #include <sstream>
 #include <iostream>
 #include <exception>
+#include <functional>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <set>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+#include <algorithm>
+#include <limits>
+#include <iterator>
+
+// Paths up to this size (with the terminating zero) are stored without heap allocations
+#ifndef CREFILE_PATH_INLINE_CAPACITY
+#   define CREFILE_PATH_INLINE_CAPACITY 256
+#endif
+
+// Paths keep offsets of this many leading components inline
+#ifndef CREFILE_PATH_INDEX_CAPACITY
+#   define CREFILE_PATH_INDEX_CAPACITY 16
+#endif
 
 #define CREFILE_PLATFORM_DARWIN 8
 #define CREFILE_PLATFORM_UNIX 16
@@ -31,11 +61,74 @@
 #   include <CoreServices/CoreServices.h>
 #endif
 
+// Vectorized separator scanning, define CREFILE_NO_SIMD to use plain loops
+#if !defined(CREFILE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#   define CREFILE_SIMD_SSE2 1
+#   include <emmintrin.h>
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#   endif
+#else
+#   define CREFILE_SIMD_SSE2 0
+#endif
+
+#if CREFILE_SIMD_SSE2 && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define CREFILE_SIMD_AVX2 1
+#   include <immintrin.h>
+#else
+#   define CREFILE_SIMD_AVX2 0
+#endif
+
 #if CREFILE_PLATFORM == CREFILE_PLATFORM_UNIX || CREFILE_PLATFORM == CREFILE_PLATFORM_DARWIN
 #   include <sys/types.h>
 #   include <dirent.h>
 #   include <sys/stat.h>
 #   include <unistd.h>
+#   include <fcntl.h>
+#   include <errno.h>
+#   include <stdint.h>
+#endif
+
+#if defined(__linux__)
+#   include <sys/syscall.h>
+#   include <sys/sysmacros.h>
+#   include <sys/inotify.h>
+#   include <sys/eventfd.h>
+#   include <poll.h>
+#endif
+
+// linux/io_uring.h of 5.17 and later declares every opcode BatchEngine uses
+#if defined(__linux__) && !defined(CREFILE_NO_IO_URING) && defined(__has_include)
+#   if __has_include(<linux/io_uring.h>)
+#       include <linux/io_uring.h>
+#       include <sys/mman.h>
+#   endif
+#endif
+
+#if defined(IORING_FEAT_CQE_SKIP)
+#   define CREFILE_HAVE_IO_URING 1
+#else
+#   define CREFILE_HAVE_IO_URING 0
+#endif
+
+// co_await versions of blocking calls when compiled as C++20 with coroutines
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#   if __has_include(<coroutine>)
+#       include <coroutine>
+#       include <optional>
+#       define CREFILE_HAVE_COROUTINES 1
+#   endif
+#endif
+
+#ifndef CREFILE_HAVE_COROUTINES
+#   define CREFILE_HAVE_COROUTINES 0
+#endif
+
+// statx(2) is declared by glibc 2.28 and later
+#if defined(__linux__) && defined(STATX_BASIC_STATS) && !defined(CREFILE_NO_STATX)
+#   define CREFILE_HAVE_STATX 1
+#else
+#   define CREFILE_HAVE_STATX 0
 #endif
 
 #if CREFILE_PLATFORM == CREFILE_PLATFORM_WIN32
@@ -100,960 +193,6415 @@ class UnknownErrorException : public Exception  {
 
 namespace priv {
 
-static bool is_slash(const char c) {
+constexpr bool is_slash(const char c) {
     return c == '/' || c == '\\';
 }
 
-class WinPolicy {
-public:
-    static const char Separator = '\\';
-};
+// Separator test of a policy: both slashes, or only '/' for POSIX paths
+template <bool Backslash>
+constexpr bool is_separator(const char c) {
+    return c == '/' || (Backslash && c == '\\');
+}
 
-class PosixPolicy {
-public:
-    static const char Separator = '/';
-};
+// Separator scanning kernels. A kernel marks every separator of a block of
+// up to 64 characters in one pass, bit i of the mask is set for a separator
+// at data[i]. The widest kernel the CPU supports is picked on first use.
+// Without SSE2 the lexical operations use plain loops instead. Kernels
+// with Backslash = false look for '/' only.
+typedef uint64_t (*SlashMaskFn)(const char* data, size_t size);
 
-std::vector<String> split_impl(const char* base, size_t size) {
-    std::vector<String> res;
-    size_t start_pos = 0;
+static const size_t SlashBlockSize = 64;
+
+template <bool Backslash = true>
+uint64_t slash_mask_scalar(const char* data, size_t size) {
+    uint64_t mask = 0;
     for (size_t i = 0; i < size; ++i) {
-        if (priv::is_slash(base[i])) {
-            res.push_back(String{base + start_pos, base + i + 1});
-            start_pos = i + 1;
-        }
+        mask |= static_cast<uint64_t>(is_separator<Backslash>(data[i])) << i;
     }
+    return mask;
+}
 
-    if (size - start_pos > 0) {
-        res.push_back(String{base + start_pos, base + size});
+#if CREFILE_SIMD_SSE2
+template <bool Backslash = true>
+uint64_t slash_mask_sse2(const char* data, size_t size) {
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    uint64_t mask = 0;
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i match = _mm_cmpeq_epi8(chunk, slash);
+        if (Backslash) {
+            match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, backslash));
+        }
+        const unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(match));
+        mask |= static_cast<uint64_t>(bits) << i;
     }
+    // A full block leaves no tail, and shifting by 64 is undefined
+    return mask | (i < size? slash_mask_scalar<Backslash>(data + i, size - i) << i : 0);
+}
+#endif
 
-    return res;
+#if CREFILE_SIMD_AVX2
+template <bool Backslash = true>
+__attribute__((target("avx2")))
+uint64_t slash_mask_avx2(const char* data, size_t size) {
+    if (size < SlashBlockSize) {
+        return slash_mask_sse2<Backslash>(data, size);
+    }
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+    __m256i low_match = _mm256_cmpeq_epi8(low, slash);
+    __m256i high_match = _mm256_cmpeq_epi8(high, slash);
+    if (Backslash) {
+        low_match = _mm256_or_si256(low_match, _mm256_cmpeq_epi8(low, backslash));
+        high_match = _mm256_or_si256(high_match, _mm256_cmpeq_epi8(high, backslash));
+    }
+    const uint32_t low_bits = static_cast<uint32_t>(_mm256_movemask_epi8(low_match));
+    const uint32_t high_bits = static_cast<uint32_t>(_mm256_movemask_epi8(high_match));
+    return low_bits | (static_cast<uint64_t>(high_bits) << 32);
 }
 
-} // namespace priv {
+bool cpu_has_avx2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+#endif
 
-String dirname(const String& filename) {
-    auto last_slash = filename.find_last_of('/');
-    if (last_slash == String::npos) {
-        last_slash = filename.find_last_of("\\\\");
-        if (last_slash == String::npos) {
-            return filename;
-        }
-    }
-    return filename.substr(0, last_slash);
+template <bool Backslash>
+SlashMaskFn select_slash_mask() {
+#if CREFILE_SIMD_AVX2
+    return cpu_has_avx2()? slash_mask_avx2<Backslash> : slash_mask_sse2<Backslash>;
+#elif CREFILE_SIMD_SSE2
+    return slash_mask_sse2<Backslash>;
+#else
+    return slash_mask_scalar<Backslash>;
+#endif
 }
 
-String extension(const String& filename) {
-    const auto last_dot = filename.find_last_of('.');
-    if (last_dot == String::npos) {
-        return String{};
-    } else {
-        return filename.substr(last_dot + 1);
-    }
+template <bool Backslash = true>
+uint64_t slash_mask(const char* data, size_t size) {
+    static const SlashMaskFn fn = select_slash_mask<Backslash>();
+    return fn(data, size);
 }
 
-std::vector<String> split(const String& path) {
-    return priv::split_impl(path.c_str(), path.size());
+unsigned lowest_bit(uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return index;
+#else
+    return __builtin_ctzll(mask);
+#endif
 }
 
-std::vector<String> split(const char* base, size_t size) {
-    return priv::split_impl(base, size);
+unsigned highest_bit(uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, mask);
+    return index;
+#else
+    return 63 - __builtin_clzll(mask);
+#endif
 }
 
-class PosixPath {
-private:
-    using Policy = priv::PosixPolicy;
-    static void path_join_append_one(String& to, const char* append) {
-        if (!to.empty() && !priv::is_slash(to[to.size() - 1])) {
-            to += Policy::Separator;
+// Position of the first separator or size
+template <bool Backslash = true>
+size_t find_slash(const char* data, size_t size) {
+#if !CREFILE_SIMD_SSE2
+    for (size_t i = 0; i < size; ++i) {
+        if (is_separator<Backslash>(data[i])) {
+            return i;
+        }
+    }
+    return size;
+#else
+    for (size_t i = 0; i < size; i += SlashBlockSize) {
+        const size_t block = size - i < SlashBlockSize? size - i : SlashBlockSize;
+        const uint64_t mask = slash_mask<Backslash>(data + i, block);
+        if (mask) {
+            return i + lowest_bit(mask);
         }
-        to += append;
     }
+    return size;
+#endif
+}
 
-    static void path_join_append_one(String& to, const PosixPath& append) {
-        if (!to.empty() && !priv::is_slash(to[to.size() - 1])) {
-            to += Policy::Separator;
+// Position of the last separator or size
+template <bool Backslash = true>
+size_t rfind_slash(const char* data, size_t size) {
+#if !CREFILE_SIMD_SSE2
+    for (size_t i = size; i > 0; --i) {
+        if (is_separator<Backslash>(data[i - 1])) {
+            return i - 1;
+        }
+    }
+    return size;
+#else
+    for (size_t end = size; end > 0;) {
+        const size_t block = end < SlashBlockSize? end : SlashBlockSize;
+        end -= block;
+        const uint64_t mask = slash_mask<Backslash>(data + end, block);
+        if (mask) {
+            return end + highest_bit(mask);
         }
-        to += append.str();
     }
+    return size;
+#endif
+}
 
-    template<typename First>
-    static void path_join_impl(String& buf, First first) {
-        path_join_append_one(buf, first);
+int compare(const char* a, size_t a_size, const char* b, size_t b_size) {
+    const int res = std::memcmp(a, b, a_size < b_size? a_size : b_size);
+    if (res != 0) {
+        return res;
     }
+    return a_size < b_size? -1 : (a_size > b_size? 1 : 0);
+}
 
-    template<typename First, typename... Types>
-    static void path_join_impl(String& buf, First first, Types... tail) {
-        path_join_append_one(buf, first);
-        path_join_impl(buf, tail...);
+// Same as compare() with ASCII letters in lower case
+int compare_icase(const char* a, size_t a_size, const char* b, size_t b_size) {
+    const size_t size = a_size < b_size? a_size : b_size;
+    for (size_t i = 0; i < size; ++i) {
+        const int ac = (a[i] >= 'A' && a[i] <= 'Z')? a[i] - 'A' + 'a' : static_cast<unsigned char>(a[i]);
+        const int bc = (b[i] >= 'A' && b[i] <= 'Z')? b[i] - 'A' + 'a' : static_cast<unsigned char>(b[i]);
+        if (ac != bc) {
+            return ac < bc? -1 : 1;
+        }
     }
+    return a_size < b_size? -1 : (a_size > b_size? 1 : 0);
+}
+
+// Path rules of a platform, resolved at compile time: which characters
+// separate components and which scanning kernels find them, what makes
+// a path absolute and whether names compare case-sensitively.
+class WinPolicy {
 public:
-    PosixPath() {}
-    PosixPath(const char* path) : path_(path) {}
-    PosixPath(String path) : path_(std::move(path)) {}
+    static const char Separator = '\\';
+    static const bool Backslash = true; // Both '\\' and '/' separate
+    static const bool CaseSensitive = false;
 
-    template<typename ... Types>
-    PosixPath(Types... args) {
-        path_join_impl(path_, args...);
+    static constexpr bool is_separator(char c) {
+        return priv::is_separator<Backslash>(c);
     }
 
-    const String& str() const { return path_; }
-    const char* c_str() const { return path_.c_str(); }
+    static size_t find_separator(const char* path, size_t size) {
+        return find_slash<Backslash>(path, size);
+    }
 
-    template<typename ... Types>
-    static PosixPath join(Types... args) {
-        String buf;
-        path_join_impl(buf, args...);
-        return PosixPath{buf};
+    static size_t rfind_separator(const char* path, size_t size) {
+        return rfind_slash<Backslash>(path, size);
     }
 
-    String dirname() const {
-        return crefile::dirname(path_);
+    static constexpr bool is_abspath(const char* path, size_t size) {
+        return size >= 3 && path[1] == ':' && is_separator(path[2]);
     }
 
-    String extension() const {
-        return crefile::extension(path_);
+    static int compare(const char* a, size_t a_size, const char* b, size_t b_size) {
+        return compare_icase(a, a_size, b, b_size);
     }
+};
 
-    std::vector<String> split() const {
-        return crefile::split(path_);
+class PosixPolicy {
+public:
+    static const char Separator = '/';
+    static const bool Backslash = false;
+    static const bool CaseSensitive = true;
+
+    static constexpr bool is_separator(char c) {
+        return priv::is_separator<Backslash>(c);
     }
 
-    bool is_abspath() const {
-        return PosixPath::is_abspath(path_);
+    static size_t find_separator(const char* path, size_t size) {
+        return find_slash<Backslash>(path, size);
     }
 
-    static bool is_abspath(const String& path) {
-        if (path.empty()) {
-            return false;
-        }
-        return path[0] == Policy::Separator;
+    static size_t rfind_separator(const char* path, size_t size) {
+        return rfind_slash<Backslash>(path, size);
     }
 
+    static constexpr bool is_abspath(const char* path, size_t size) {
+        return size > 0 && path[0] == Separator;
+    }
 
-protected:
-    String str_move() {
-        return std::move(path_);
+    static int compare(const char* a, size_t a_size, const char* b, size_t b_size) {
+        return priv::compare(a, a_size, b, b_size);
     }
+};
 
-private:
-    String path_;
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_WIN32
+typedef WinPolicy NativePolicy;
+#else
+typedef PosixPolicy NativePolicy;
+#endif
+
+// Piece of a path as split() cuts it: a component with its trailing
+// separator, only the last piece may have none
+struct SplitPiece {
+    size_t offset;
+    size_t length;
 };
 
-bool operator == (const PosixPath& a, const PosixPath& b) {
-    return a.str() == b.str();
-}
+// Lazily walks split() pieces of a path without allocating
+template <bool Backslash = true>
+class SplitIterator {
+public:
+    SplitIterator() = default;
 
-bool operator != (const PosixPath& a, const PosixPath& b) {
-    return a.str() != b.str();
-}
+    SplitIterator(const char* base, size_t size)
+    :   base_(base),
+        size_(size) {
+        find_end();
+    }
 
-bool operator < (const PosixPath& a, const PosixPath& b) {
-    return a.str() < b.str();
-}
+    SplitPiece operator *() const {
+        return SplitPiece{pos_, len_};
+    }
 
-class WinPath {
-private:
-    using Policy = priv::WinPolicy;
+    SplitIterator& operator ++() {
+        pos_ += len_;
+        find_end();
+        return *this;
+    }
 
-    static void path_join_append_one(String& to, const char* append) {
-        if (!to.empty() && !priv::is_slash(to.back())) {
-            to += Policy::Separator;
-        }
-        to += append;
+    bool operator == (const SplitIterator& other) const {
+        return is_end() == other.is_end() && (is_end() || pos_ == other.pos_);
     }
 
-    static void path_join_append_one(String& to, const WinPath& append) {
-        if (!to.empty() && !priv::is_slash(to.back())) {
-            to += Policy::Separator;
-        }
-        to += append.str();
+    bool operator != (const SplitIterator& other) const {
+        return !(*this == other);
     }
 
-    template<typename First>
-    static void path_join_impl(String& buf, First first) {
-        path_join_append_one(buf, first);
+    bool is_end() const {
+        return pos_ >= size_;
     }
 
-    template<typename First, typename... Types>
-    static void path_join_impl(String& buf, First first, Types... tail) {
-        path_join_append_one(buf, first);
-        path_join_impl(buf, tail...);
+private:
+    // Separators are taken from a mask of the current 64 character block,
+    // so every character is scanned once however short the pieces are
+    void find_end() {
+        len_ = 0;
+#if !CREFILE_SIMD_SSE2
+        while (pos_ + len_ < size_) {
+            if (is_separator<Backslash>(base_[pos_ + len_++])) {
+                return;
+            }
+        }
+#else
+        while (pos_ + len_ < size_) {
+            const size_t at = pos_ + len_;
+            if (at >= block_end_) {
+                block_start_ = at;
+                block_end_ = size_ - at < SlashBlockSize? size_ : at + SlashBlockSize;
+                mask_ = slash_mask<Backslash>(base_ + block_start_, block_end_ - block_start_);
+            }
+            const uint64_t rest = mask_ >> (at - block_start_);
+            if (rest) {
+                len_ += lowest_bit(rest) + 1;
+                return;
+            }
+            len_ = block_end_ - pos_;
+        }
+#endif
     }
+
+    const char* base_ = nullptr;
+    size_t size_ = 0;
+    size_t pos_ = 0;
+    size_t len_ = 0;
+    size_t block_start_ = 0;
+    size_t block_end_ = 0;
+    uint64_t mask_ = 0;
+};
+
+template <bool Backslash = true>
+class SplitRange {
 public:
-    WinPath() {}
-    WinPath(const char* path) : path_(path) {}
-    WinPath(String path) : path_(std::move(path)) {}
+    SplitRange(const char* base, size_t size)
+    :   base_(base),
+        size_(size) {
+    }
 
-    template<typename ... Types>
-    WinPath(Types... args) {
-        path_join_impl(path_, args...);
+    SplitIterator<Backslash> begin() const { return SplitIterator<Backslash>{base_, size_}; }
+    SplitIterator<Backslash> end() const { return SplitIterator<Backslash>{}; }
+
+private:
+    const char* base_;
+    size_t size_;
+};
+
+template <bool Backslash = true>
+std::vector<String> split_impl(const char* base, size_t size) {
+    std::vector<String> res;
+    for (const auto piece : SplitRange<Backslash>{base, size}) {
+        res.emplace_back(base + piece.offset, piece.length);
     }
+    return res;
+}
 
-    const String& str() const { return path_; }
-    const char* c_str() const { return path_.c_str(); }
+// Path characters with a small inline buffer. Only paths longer than
+// InlineCapacity - 1 characters take memory from the allocator. Always
+// zero-terminated.
+template <size_t InlineCapacity, typename Allocator = std::allocator<char>>
+class PathStorage : private Allocator {
+    static_assert(InlineCapacity > 0, "PathStorage needs room for the terminating zero");
 
-    template<typename ... Types>
-    static WinPath join(Types... args) {
-        String buf;
-        path_join_impl(buf, args...);
-        return WinPath{buf};
+public:
+    PathStorage(const Allocator& allocator = Allocator())
+    :   Allocator(allocator) {
+        inline_[0] = '\0';
     }
 
-    String dirname() const {
-        return crefile::dirname(path_);
+    PathStorage(const char* str, const Allocator& allocator = Allocator())
+    :   PathStorage(str, std::strlen(str), allocator) {
     }
 
-    String extension() const {
-        return crefile::extension(path_);
+    PathStorage(const char* str, size_t size, const Allocator& allocator = Allocator())
+    :   PathStorage(allocator) {
+        append(str, size);
     }
 
-    std::vector<String> split() const {
-        return crefile::split(path_);
+    PathStorage(const String& str, const Allocator& allocator = Allocator())
+    :   PathStorage(str.data(), str.size(), allocator) {
     }
 
-    bool is_abspath() const {
-        return WinPath::is_abspath(path_);
+    PathStorage(const PathStorage& other)
+    :   PathStorage(other.data_, other.size_, other.allocator()) {
     }
 
-    static bool is_abspath(const String& path) {
-        if (path.size() < 3) {
-            return false;
-        }
-        return path[1] == ':' && priv::is_slash(path[2]);
+    PathStorage(PathStorage&& other) noexcept
+    :   PathStorage(other.allocator()) {
+        steal(other);
     }
 
-private:
-    String path_;
-};
+    ~PathStorage() {
+        release();
+    }
 
-bool operator == (const WinPath& a, const WinPath& b) {
-    return a.str() == b.str();
-}
+    PathStorage& operator = (const PathStorage& other) {
+        if (this != &other) {
+            assign(other.data_, other.size_);
+        }
+        return *this;
+    }
 
-bool operator != (const WinPath& a, const WinPath& b) {
-    return a.str() != b.str();
-}
+    PathStorage& operator = (PathStorage&& other) noexcept {
+        if (this == &other) {
+            return *this;
+        }
+        if (allocator() == other.allocator()) {
+            release();
+            steal(other);
+        } else {
+            assign(other.data_, other.size_);
+        }
+        return *this;
+    }
 
-bool operator < (const WinPath& a, const WinPath& b) {
-    return a.str() < b.str();
-}
+    const Allocator& allocator() const { return *this; }
 
-#if CREFILE_PLATFORM == CREFILE_PLATFORM_WIN32
+    const char* data() const { return data_; }
+    const char* c_str() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    size_t capacity() const { return capacity_; }
+    bool is_inline() const { return data_ == inline_; }
+    char operator [](size_t index) const { return data_[index]; }
+    char back() const { return data_[size_ - 1]; }
 
-class FileInfoImplWin32 {
-public:
+    String str() const {
+        return String{data_, size_};
+    }
 
-    WIN32_FIND_DATA* native_ptr() { return &find_data_; }
-    const WIN32_FIND_DATA* native_ptr() const { return &find_data_; }
+    void reserve(size_t capacity) {
+        if (capacity > capacity_) {
+            grow(capacity, nullptr, 0);
+        }
+    }
 
-    String name() const {
-        // TODO: Support long names
-        // TODO: Make lazy
-        return String{find_data_.cFileName};
+    void assign(const char* str, size_t size) {
+        size_ = 0;
+        append(str, size);
     }
 
-    bool is_directory() const {
-        return find_data_.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+    void append(const char* str, size_t size) {
+        if (size_ + size > capacity_) {
+            grow(size_ + size, str, size);
+            return;
+        }
+        std::memmove(data_ + size_, str, size);
+        size_ += size;
+        data_[size_] = '\0';
     }
 
-private:
-    WIN32_FIND_DATA find_data_;
-};
+    void append(const char* str) {
+        append(str, std::strlen(str));
+    }
 
-namespace priv {
-String translate_error_code2string(DWORD win_error_code) {
-    if (win_error_code == 0)
-        return String{};
-    LPSTR messageBuffer = nullptr;
-    size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-        NULL, win_error_code, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&messageBuffer, 0, NULL);
-    String message{messageBuffer, size};
-    LocalFree(messageBuffer);
-    return message;
-}
+    void push_back(char c) {
+        append(&c, 1);
+    }
 
+    // Shrinks to the first size characters
+    void truncate(size_t size) {
+        if (size < size_) {
+            size_ = size;
+            data_[size_] = '\0';
+        }
+    }
 
-template <typename Exc>
-void winerror(int error_code, String&& win_error, const char* file, int line) {
-    if (error_code != 0) {
-        std::ostringstream err;
-        err << win_error << " (win error: " << error_code << ", str: " << translate_error_code2string(error_code) << ") at file " << file << ":" << line;
-        throw Exc(err.str());
+    void clear() {
+        truncate(0);
     }
-}
 
+private:
+    // Moves to a bigger buffer and appends str there. str may point into
+    // the old buffer, so it is released only after the copy.
+    void grow(size_t capacity, const char* str, size_t size) {
+        if (capacity < capacity_ * 2) {
+            capacity = capacity_ * 2;
+        }
+        char* data = Allocator::allocate(capacity + 1);
+        std::memcpy(data, data_, size_);
+        if (size > 0) {
+            std::memcpy(data + size_, str, size);
+        }
+        const size_t new_size = size_ + size;
+        release();
+        data_ = data;
+        size_ = new_size;
+        capacity_ = capacity;
+        data_[size_] = '\0';
+    }
 
-#define WINERROR(error, exc, win_error) { priv::winerror<exc>(error, (win_error), __FILE__, __LINE__); }
+    void release() {
+        if (!is_inline()) {
+            Allocator::deallocate(data_, capacity_ + 1);
+        }
+        data_ = inline_;
+        capacity_ = InlineCapacity - 1;
+        size_ = 0;
+        inline_[0] = '\0';
+    }
 
-#define WINCHECK(ret_code, exc, win_error) { if (!(ret_code)) { priv::winerror<exc>(GetLastError(), (win_error), __FILE__, __LINE__); } }
+    void steal(PathStorage& other) {
+        if (other.is_inline()) {
+            std::memcpy(inline_, other.inline_, other.size_ + 1);
+            size_ = other.size_;
+        } else {
+            data_ = other.data_;
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+            other.data_ = other.inline_;
+            other.capacity_ = InlineCapacity - 1;
+        }
+        other.size_ = 0;
+        other.inline_[0] = '\0';
+    }
 
-}; // namespace priv {
+    char* data_ = inline_;
+    size_t size_ = 0;
+    size_t capacity_ = InlineCapacity - 1; // Without the terminating zero
+    char inline_[InlineCapacity];
+};
 
+} // namespace priv {
 
-class FileIterImplWin32 {
+// Bump allocator for short-lived path data of bulk traversals. Memory is
+// taken from big blocks and given back all at once, either with reset() or
+// back to a mark() with rewind(). Blocks are kept for reuse until the
+// arena is destroyed. Not thread-safe, use one arena per thread.
+class PathArena {
 public:
-    FileIterImplWin32()
-        : handle_{0},
-        end_{true} {
+    static const size_t DefaultBlockSize = 64 * 1024;
+
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
 
+    explicit PathArena(size_t block_size = DefaultBlockSize)
+    :   block_size_(block_size) {
     }
 
-    ~FileIterImplWin32() {
-        if (handle_) {
-            FindClose(handle_);
+    PathArena(const PathArena&) = delete;
+    PathArena& operator = (const PathArena&) = delete;
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+        while (current_ < blocks_.size()) {
+            const size_t offset = (offset_ + align - 1) & ~(align - 1);
+            if (offset + size <= blocks_[current_].size) {
+                offset_ = offset + size;
+                return blocks_[current_].data.get() + offset;
+            }
+            ++current_;
+            offset_ = 0;
         }
+        const size_t block_size = size + align > block_size_? size + align : block_size_;
+        blocks_.push_back(Block{std::unique_ptr<char[]>{new char[block_size]}, block_size});
+        current_ = blocks_.size() - 1;
+        offset_ = 0;
+        return allocate(size, align);
     }
 
-    FileIterImplWin32(const String& path)
-        : dir_path_(path) {
-        // TODO: Extend MAX_PATH
-        WINCHECK(handle_ = FindFirstFile(path.c_str(), find_data_.native_ptr()),
-            std::runtime_error, "FindFirstFile failed");
+    // Zero-terminated copy of size characters
+    char* copy(const char* str, size_t size) {
+        char* res = static_cast<char*>(allocate(size + 1, 1));
+        std::memcpy(res, str, size);
+        res[size] = '\0';
+        return res;
     }
 
-    bool operator == (const FileIterImplWin32& other) const {
-        return end_ && other.end_;
+    Mark mark() const {
+        return Mark{current_, offset_};
     }
 
-    bool operator != (const FileIterImplWin32& other) const {
-        return !(*this == other);
+    // Frees everything allocated after the mark was taken
+    void rewind(Mark mark) {
+        current_ = mark.block;
+        offset_ = mark.offset;
     }
 
-    FileIterImplWin32& operator ++() {
-        auto res = FindNextFile(handle_, find_data_.native_ptr());
+    void reset() {
+        rewind(Mark{0, 0});
+    }
 
-        if (!res) {
-            const auto error = GetLastError();
-            if (error == ERROR_NO_MORE_FILES) {
-                end_ = true;
-            }
-            else {
-                WINERROR(error, std::runtime_error, "FindNextFile failed");
-            }
+    size_t capacity() const {
+        size_t res = 0;
+        for (const auto& block : blocks_) {
+            res += block.size;
         }
+        return res;
+    }
 
-        return *this;
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    const size_t block_size_;
+    std::vector<Block> blocks_;
+    size_t current_ = 0;
+    size_t offset_ = 0;
+};
+
+// Standard allocator over a PathArena. Deallocation is a no-op, memory
+// comes back with the arena's rewind() or reset().
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    ArenaAllocator(PathArena& arena)
+    :   arena_(&arena) {
     }
 
-    FileInfoImplWin32 operator *() const {
-        return find_data_;
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other)
+    :   arena_(other.arena()) {
     }
 
-    bool is_end() const {
-        return end_;
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t) {
+    }
+
+    PathArena* arena() const {
+        return arena_;
+    }
+
+private:
+    PathArena* arena_;
+};
+
+template <typename T, typename U>
+bool operator == (const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator != (const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena() != b.arena();
+}
+
+// Non-owning view of a path: pointer and length. Lexical operations return
+// views into the same buffer, so the viewed characters must outlive them.
+// Policy decides which characters separate components, as for BasicPath.
+template <typename Policy>
+class BasicPathView {
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    // Iterates over non-empty components, a leading root separator comes as
+    // a component of its own: "/a//b/" gives "/", "a", "b"
+    class ComponentIterator {
+    public:
+        ComponentIterator() = default;
+
+        ComponentIterator(const char* data, size_t size)
+        :   data_(data),
+            pieces_(data, size) {
+            if (!pieces_.is_end() && (*pieces_).length == 1 && Policy::is_separator(data_[0])) {
+                root_ = true;
+            } else {
+                skip_empty();
+            }
+        }
+
+        BasicPathView operator *() const {
+            const auto piece = *pieces_;
+            if (root_) {
+                return BasicPathView{data_, 1};
+            }
+            return BasicPathView{data_ + piece.offset, piece.length - (ends_with_slash(piece)? 1 : 0)};
+        }
+
+        ComponentIterator& operator ++() {
+            root_ = false;
+            ++pieces_;
+            skip_empty();
+            return *this;
+        }
+
+        bool operator == (const ComponentIterator& other) const {
+            return pieces_ == other.pieces_;
+        }
+
+        bool operator != (const ComponentIterator& other) const {
+            return !(*this == other);
+        }
+
+        bool is_end() const {
+            return pieces_.is_end();
+        }
+
+    private:
+        bool ends_with_slash(priv::SplitPiece piece) const {
+            return Policy::is_separator(data_[piece.offset + piece.length - 1]);
+        }
+
+        void skip_empty() {
+            while (!pieces_.is_end() && (*pieces_).length == 1 && ends_with_slash(*pieces_)) {
+                ++pieces_;
+            }
+        }
+
+        const char* data_ = nullptr;
+        priv::SplitIterator<Policy::Backslash> pieces_;
+        bool root_ = false;
+    };
+
+    BasicPathView() = default;
+
+    constexpr BasicPathView(const char* data, size_t size)
+    :   data_(data),
+        size_(size) {
+    }
+
+    BasicPathView(const char* str)
+    :   BasicPathView(str, std::strlen(str)) {
+    }
+
+    BasicPathView(const String& str)
+    :   BasicPathView(str.data(), str.size()) {
+    }
+
+    // Same characters seen with the separators of another policy
+    template <typename OtherPolicy>
+    constexpr BasicPathView(BasicPathView<OtherPolicy> other)
+    :   data_(other.data()),
+        size_(other.size()) {
+    }
+
+    constexpr const char* data() const { return data_; }
+    constexpr size_t size() const { return size_; }
+    constexpr bool empty() const { return size_ == 0; }
+    constexpr char operator [](size_t index) const { return data_[index]; }
+
+    String str() const {
+        return String{data_, size_};
+    }
+
+    BasicPathView substr(size_t pos, size_t count = npos) const {
+        if (pos > size_) {
+            pos = size_;
+        }
+        if (count > size_ - pos) {
+            count = size_ - pos;
+        }
+        return BasicPathView{data_ + pos, count};
+    }
+
+    // Position of the last separator or npos
+    size_t find_last_slash() const {
+        const size_t slash = Policy::rfind_separator(data_, size_);
+        return slash == size_? npos : slash;
+    }
+
+    // Everything before the last separator, the whole path without separators
+    BasicPathView dirname() const {
+        const auto last_slash = find_last_slash();
+        if (last_slash == npos) {
+            return *this;
+        }
+        return substr(0, last_slash);
+    }
+
+    // Path without its last component: "a/b/" and "a/b" give "a",
+    // "/a" gives "/" and a single name gives an empty path
+    BasicPathView parent() const {
+        auto size = size_;
+        while (size > 1 && Policy::is_separator(data_[size - 1])) {
+            --size;
+        }
+        const auto last_slash = substr(0, size).find_last_slash();
+        if (last_slash == npos) {
+            return BasicPathView{data_, 0};
+        }
+        size = last_slash;
+        while (size > 0 && Policy::is_separator(data_[size - 1])) {
+            --size;
+        }
+        return substr(0, size == 0? 1 : size);
+    }
+
+    // Everything after the last separator
+    BasicPathView basename() const {
+        const auto last_slash = find_last_slash();
+        return last_slash == npos? *this : substr(last_slash + 1);
+    }
+
+    // Basename without extension: "a/b.tar.gz" gives "b.tar"
+    BasicPathView stem() const {
+        const auto base = basename();
+        const auto dot = base.find_extension_dot();
+        return dot == npos? base : base.substr(0, dot);
+    }
+
+    // Basename part after the last dot: "a/b.tar.gz" gives "gz". Leading
+    // dot of hidden files doesn't start an extension.
+    BasicPathView extension() const {
+        const auto base = basename();
+        const auto dot = base.find_extension_dot();
+        return dot == npos? BasicPathView{base.data() + base.size(), 0} : base.substr(dot + 1);
+    }
+
+    // split() pieces as (offset, length) pairs, computed lazily
+    priv::SplitRange<Policy::Backslash> pieces() const {
+        return priv::SplitRange<Policy::Backslash>{data_, size_};
+    }
+
+    ComponentIterator begin() const {
+        return ComponentIterator{data_, size_};
+    }
+
+    ComponentIterator end() const {
+        return ComponentIterator{};
+    }
+
+private:
+    size_t find_extension_dot() const {
+        for (size_t i = size_; i > 1; --i) {
+            if (data_[i - 1] == '.') {
+                return i - 1;
+            }
+        }
+        return npos;
+    }
+
+    const char* data_ = "";
+    size_t size_ = 0;
+};
+
+typedef BasicPathView<priv::NativePolicy> PathView;
+typedef BasicPathView<priv::PosixPolicy> PosixPathView;
+typedef BasicPathView<priv::WinPolicy> WinPathView;
+
+// Views of the native policy compare with conversions from strings and
+// paths, views of other policies only as they are
+bool operator == (PathView a, PathView b) {
+    return priv::NativePolicy::compare(a.data(), a.size(), b.data(), b.size()) == 0;
+}
+
+bool operator != (PathView a, PathView b) {
+    return !(a == b);
+}
+
+// Exact matches for string literals, otherwise C++20 finds the reversed
+// Path comparisons as good as this one
+bool operator == (PathView a, const char* b) {
+    return a == PathView{b};
+}
+
+bool operator == (const char* a, PathView b) {
+    return PathView{a} == b;
+}
+
+bool operator != (PathView a, const char* b) {
+    return !(a == b);
+}
+
+bool operator != (const char* a, PathView b) {
+    return !(a == b);
+}
+
+bool operator < (PathView a, PathView b) {
+    return priv::NativePolicy::compare(a.data(), a.size(), b.data(), b.size()) < 0;
+}
+
+template <typename Policy>
+bool operator == (BasicPathView<Policy> a, BasicPathView<Policy> b) {
+    return Policy::compare(a.data(), a.size(), b.data(), b.size()) == 0;
+}
+
+template <typename Policy>
+bool operator != (BasicPathView<Policy> a, BasicPathView<Policy> b) {
+    return !(a == b);
+}
+
+template <typename Policy>
+bool operator == (BasicPathView<Policy> a, const char* b) {
+    return a == BasicPathView<Policy>{b};
+}
+
+template <typename Policy>
+bool operator == (const char* a, BasicPathView<Policy> b) {
+    return BasicPathView<Policy>{a} == b;
+}
+
+template <typename Policy>
+bool operator != (BasicPathView<Policy> a, const char* b) {
+    return !(a == b);
+}
+
+template <typename Policy>
+bool operator != (const char* a, BasicPathView<Policy> b) {
+    return !(a == b);
+}
+
+template <typename Policy>
+bool operator < (BasicPathView<Policy> a, BasicPathView<Policy> b) {
+    return Policy::compare(a.data(), a.size(), b.data(), b.size()) < 0;
+}
+
+template <typename Policy>
+std::ostream& operator << (std::ostream& out, BasicPathView<Policy> path) {
+    return out.write(path.data(), path.size());
+}
+
+String dirname(const String& filename) {
+    return PathView{filename}.dirname().str();
+}
+
+String extension(const String& filename) {
+    return PathView{filename}.extension().str();
+}
+
+std::vector<String> split(const String& path) {
+    return priv::split_impl<priv::NativePolicy::Backslash>(path.c_str(), path.size());
+}
+
+std::vector<String> split(const char* base, size_t size) {
+    return priv::split_impl<priv::NativePolicy::Backslash>(base, size);
+}
+
+namespace priv {
+
+// False for a single argument which is a Self, an allocator or not a path
+// piece at all, so variadic join constructors don't take over copies,
+// allocator constructors and conversion operators of other types
+template <typename Self, typename Allocator, typename... Types>
+struct IsJoinArgs : std::true_type {
+};
+
+template <typename Self, typename Allocator, typename Type>
+struct IsJoinArgs<Self, Allocator, Type> : std::integral_constant<bool,
+    !std::is_base_of<Self, typename std::decay<Type>::type>::value &&
+    !std::is_convertible<Type&, Allocator>::value &&
+    std::is_convertible<Type&, PathView>::value> {
+};
+
+// Ends of the components of a path, found with one scan on the first
+// query and extended in place when the path grows. The first Capacity
+// ends are inline, deeper ones go to the heap. A component starts after
+// the separators that follow the previous one. The first query of a
+// const path may come from many threads at once: one builds, the others
+// wait for it.
+template <typename Policy>
+class ComponentIndex {
+public:
+    static const size_t Capacity = CREFILE_PATH_INDEX_CAPACITY;
+
+    ComponentIndex() {}
+
+    ComponentIndex(const ComponentIndex& other) {
+        *this = other;
+    }
+
+    ComponentIndex(ComponentIndex&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    ComponentIndex& operator = (const ComponentIndex& other) {
+        if (this == &other) {
+            return *this;
+        }
+        if (other.state_.load(std::memory_order_acquire) != Built) {
+            reset();
+            return *this;
+        }
+        depth_ = other.depth_;
+        std::copy(other.ends_, other.ends_ + (depth_ < Capacity? depth_ : Capacity), ends_);
+        spill_ = other.spill_;
+        state_.store(Built, std::memory_order_relaxed);
+        return *this;
+    }
+
+    // The moved-from index is dropped along with the path it described
+    ComponentIndex& operator = (ComponentIndex&& other) noexcept {
+        if (this == &other) {
+            return *this;
+        }
+        if (other.state_.load(std::memory_order_acquire) != Built) {
+            reset();
+            return *this;
+        }
+        depth_ = other.depth_;
+        std::copy(other.ends_, other.ends_ + (depth_ < Capacity? depth_ : Capacity), ends_);
+        spill_ = std::move(other.spill_);
+        state_.store(Built, std::memory_order_relaxed);
+        other.reset();
+        return *this;
+    }
+
+    void reset() {
+        state_.store(Unbuilt, std::memory_order_relaxed);
+        depth_ = 0;
+        spill_.clear();
+    }
+
+    // Indexes the components after position from, the old end of data.
+    // Nothing to do before the first query.
+    void extend(const char* data, size_t size, size_t from) {
+        if (state_.load(std::memory_order_relaxed) == Built) {
+            add(data, size, from);
+        }
+    }
+
+    size_t depth(const char* data, size_t size) {
+        build(data, size);
+        return depth_;
+    }
+
+    // Offset just past component i, the path size past the last one
+    size_t end(const char* data, size_t size, size_t i) {
+        build(data, size);
+        return i < depth_? end_of(i) : size;
+    }
+
+    BasicPathView<Policy> component(const char* data, size_t size, size_t i) {
+        build(data, size);
+        if (i >= depth_) {
+            return BasicPathView<Policy>{data + size, 0};
+        }
+        const size_t end = end_of(i);
+        size_t begin = 0;
+        if (i > 0) {
+            begin = end_of(i - 1);
+            while (begin < end && Policy::is_separator(data[begin])) {
+                ++begin;
+            }
+        }
+        return BasicPathView<Policy>{data + begin, end - begin};
+    }
+
+private:
+    enum : unsigned char {
+        Unbuilt,
+        Building,
+        Built,
+    };
+
+    void build(const char* data, size_t size) {
+        if (state_.load(std::memory_order_acquire) != Built) {
+            build_slow(data, size);
+        }
+    }
+
+    void build_slow(const char* data, size_t size) {
+        unsigned char state = state_.load(std::memory_order_acquire);
+        while (state != Built) {
+            if (state == Unbuilt && state_.compare_exchange_strong(state, Building, std::memory_order_acquire)) {
+                try {
+                    add(data, size, 0);
+                } catch (...) {
+                    depth_ = 0;
+                    spill_.clear();
+                    state_.store(Unbuilt, std::memory_order_release);
+                    throw;
+                }
+                state_.store(Built, std::memory_order_release);
+                return;
+            }
+            std::this_thread::yield();
+            state = state_.load(std::memory_order_acquire);
+        }
+    }
+
+    void add(const char* data, size_t size, size_t from) {
+        for (const auto piece : SplitRange<Policy::Backslash>{data + from, size - from}) {
+            const size_t begin = from + piece.offset;
+            size_t end = begin + piece.length;
+            if (begin == 0 && piece.length == 1 && Policy::is_separator(data[0])) {
+                // Root separator is a component of its own
+            } else if (Policy::is_separator(data[end - 1])) {
+                --end;
+            }
+            if (end > begin) {
+                if (depth_ < Capacity) {
+                    ends_[depth_] = static_cast<uint32_t>(end);
+                } else {
+                    spill_.push_back(static_cast<uint32_t>(end));
+                }
+                ++depth_;
+            }
+        }
+    }
+
+    size_t end_of(size_t i) const {
+        return i < Capacity? ends_[i] : spill_[i - Capacity];
+    }
+
+    std::atomic<unsigned char> state_{Unbuilt};
+    uint32_t depth_ = 0;
+    uint32_t ends_[Capacity];
+    std::vector<uint32_t> spill_;
+};
+
+} // namespace priv {
+
+// Path owning its characters. PathPolicy (PosixPolicy or WinPolicy) picks
+// the separator and its scanning kernel, the absolute path rule and case
+// sensitivity of comparisons at compile time.
+template <typename PathPolicy, typename Allocator = std::allocator<char>>
+class BasicPath {
+public:
+    typedef PathPolicy Policy;
+    typedef BasicPathView<Policy> View;
+
+private:
+    typedef priv::PathStorage<CREFILE_PATH_INLINE_CAPACITY, Allocator> Storage;
+
+    static void path_join_append_one(Storage& to, const char* append, size_t size) {
+        if (!to.empty() && !Policy::is_separator(to.back())) {
+            to.push_back(Policy::Separator);
+        }
+        to.append(append, size);
+    }
+
+    // Measures all pieces first to grow the storage at most once. Pieces
+    // may point into buf, so a grown path is built in a new storage
+    // which replaces buf only after the last piece was copied.
+    template<typename... Types>
+    static void path_join_impl(Storage& buf, Types&&... args) {
+        const View pieces[] = {View(args)...};
+        size_t size = buf.size();
+        for (const auto& piece : pieces) {
+            size += piece.size() + 1;
+        }
+        if (size <= buf.capacity()) {
+            for (const auto& piece : pieces) {
+                path_join_append_one(buf, piece.data(), piece.size());
+            }
+            return;
+        }
+        Storage grown{buf.allocator()};
+        grown.reserve(size);
+        grown.append(buf.data(), buf.size());
+        for (const auto& piece : pieces) {
+            path_join_append_one(grown, piece.data(), piece.size());
+        }
+        buf = std::move(grown);
+    }
+public:
+    template<typename ... Types>
+    using IfJoinArgs = typename std::enable_if<priv::IsJoinArgs<BasicPath, Allocator, Types...>::value>::type;
+
+    BasicPath() {}
+    BasicPath(const char* path) : path_(path) {}
+    BasicPath(const String& path) : path_(path) {}
+    explicit BasicPath(const Allocator& allocator) : path_(allocator) {}
+
+    template<typename ... Types, typename = IfJoinArgs<Types...>>
+    BasicPath(Types&&... args) {
+        path_join_impl(path_, std::forward<Types>(args)...);
+    }
+
+    String str() const { return path_.str(); }
+    const char* c_str() const { return path_.c_str(); }
+    const char* data() const { return path_.data(); }
+    size_t size() const { return path_.size(); }
+    bool empty() const { return path_.empty(); }
+
+    Allocator get_allocator() const { return path_.allocator(); }
+
+    View view() const { return View{path_.data(), path_.size()}; }
+
+    template <typename P>
+    operator BasicPathView<P>() const { return view(); }
+
+    template<typename ... Types>
+    static BasicPath join(Types&&... args) {
+        BasicPath res;
+        path_join_impl(res.path_, std::forward<Types>(args)...);
+        return res;
+    }
+
+    // Joins args onto this path in place and extends the component index
+    template<typename ... Types>
+    BasicPath& append(Types&&... args) {
+        const size_t from = size();
+        path_join_impl(path_, std::forward<Types>(args)...);
+        index_.extend(data(), size(), from);
+        return *this;
+    }
+
+    void reserve(size_t size) {
+        path_.reserve(size);
+    }
+
+    // Everything before the last separator, the whole path without separators
+    String dirname() const {
+        const size_t last = Policy::rfind_separator(data(), size());
+        return String{data(), last};
+    }
+
+    // Everything after the last separator
+    View basename() const {
+        if (empty() || Policy::is_separator(path_.back())) {
+            return View{data() + size(), 0};
+        }
+        return component(depth() - 1);
+    }
+
+    // The first of depth(), component(), prefix(), parent(), basename()
+    // and starts_with() indexes the components, later calls are O(1)
+
+    // Number of components, a leading root separator is one: "/a//b/" has 3
+    size_t depth() const {
+        return index_.depth(data(), size());
+    }
+
+    View component(size_t i) const {
+        return index_.component(data(), size(), i);
+    }
+
+    // First n components with separators between them
+    View prefix(size_t n) const {
+        if (n == 0) {
+            return View{data(), 0};
+        }
+        return View{data(), index_.end(data(), size(), n - 1)};
+    }
+
+    // Path without its last component: "a/b/" and "a/b" give "a",
+    // "/a" gives "/" and a single name gives an empty path
+    View parent() const {
+        const size_t depth = this->depth();
+        if (depth == 1 && Policy::is_separator(data()[0])) {
+            return prefix(1);
+        }
+        return prefix(depth == 0? 0 : depth - 1);
+    }
+
+    // Whether other is this path or one of its parents, by components
+    template <typename OtherAllocator>
+    bool starts_with(const BasicPath<Policy, OtherAllocator>& other) const {
+        const size_t n = other.depth();
+        if (n > depth()) {
+            return false;
+        }
+        const View mine = prefix(n);
+        const View theirs = other.prefix(n);
+        if (mine.size() == theirs.size() &&
+                Policy::compare(mine.data(), mine.size(), theirs.data(), theirs.size()) == 0) {
+            return true;
+        }
+        // Separators may differ, compare one by one
+        for (size_t i = 0; i < n; ++i) {
+            const View a = component(i);
+            const View b = other.component(i);
+            if (Policy::compare(a.data(), a.size(), b.data(), b.size()) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Basename part after the last dot, a leading dot doesn't start one
+    String extension() const {
+        return basename().extension().str();
+    }
+
+    std::vector<String> split() const {
+        return priv::split_impl<Policy::Backslash>(data(), size());
+    }
+
+    bool is_abspath() const {
+        return BasicPath::is_abspath(path_.data(), path_.size());
+    }
+
+    static bool is_abspath(const String& path) {
+        return BasicPath::is_abspath(path.data(), path.size());
+    }
+
+    static bool is_abspath(const char* path, size_t size) {
+        return Policy::is_abspath(path, size);
+    }
+
+private:
+    Storage path_;
+    mutable priv::ComponentIndex<Policy> index_; // Built by the first query
+};
+
+template <typename Policy, typename A, typename B>
+bool operator == (const BasicPath<Policy, A>& a, const BasicPath<Policy, B>& b) {
+    return Policy::compare(a.data(), a.size(), b.data(), b.size()) == 0;
+}
+
+template <typename Policy, typename A, typename B>
+bool operator != (const BasicPath<Policy, A>& a, const BasicPath<Policy, B>& b) {
+    return Policy::compare(a.data(), a.size(), b.data(), b.size()) != 0;
+}
+
+template <typename Policy, typename A, typename B>
+bool operator < (const BasicPath<Policy, A>& a, const BasicPath<Policy, B>& b) {
+    return Policy::compare(a.data(), a.size(), b.data(), b.size()) < 0;
+}
+
+template <typename Allocator = std::allocator<char>>
+using BasicPosixPath = BasicPath<priv::PosixPolicy, Allocator>;
+
+template <typename Allocator = std::allocator<char>>
+using BasicWinPath = BasicPath<priv::WinPolicy, Allocator>;
+
+typedef BasicPosixPath<> PosixPath;
+typedef BasicWinPath<> WinPath;
+
+// Path with characters in a PathArena, for bulk traversals
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_WIN32
+typedef BasicWinPath<ArenaAllocator<char>> ArenaPath;
+#else
+typedef BasicPosixPath<ArenaAllocator<char>> ArenaPath;
+#endif
+
+// Path of at most N characters built at compile time. Joins, separators
+// and component offsets are computed by constexpr code under the Policy
+// separator, so a Path is made from it with a single copy:
+//
+//     constexpr auto spool = "var/spool"_path / "incoming";
+//     crefile::Path path = spool;
+template <typename Policy, size_t N>
+class BasicStaticPath {
+public:
+    static const size_t MaxComponents = N / 2 + 1;
+
+    constexpr BasicStaticPath() {
+    }
+
+    // From a string literal with its terminating zero
+    constexpr BasicStaticPath(const char (&str)[N + 1]) {
+        append(str, N);
+    }
+
+    constexpr BasicStaticPath(const char* str, size_t size) {
+        append(str, size);
+    }
+
+    constexpr const char* data() const { return data_; }
+    constexpr const char* c_str() const { return data_; }
+    constexpr size_t size() const { return size_; }
+    constexpr bool empty() const { return size_ == 0; }
+    static constexpr size_t capacity() { return N; }
+
+    typedef BasicPathView<Policy> View;
+
+    constexpr View view() const { return View{data_, size_}; }
+
+    template <typename P>
+    constexpr operator BasicPathView<P>() const { return view(); }
+
+    String str() const {
+        return String{data_, size_};
+    }
+
+    // Number of components, a leading root separator is a component
+    constexpr size_t depth() const { return depth_; }
+
+    constexpr View component(size_t index) const {
+        return View{data_ + offsets_[index], sizes_[index]};
+    }
+
+    constexpr View basename() const {
+        return depth_ == 0? View{data_, 0} : component(depth_ - 1);
+    }
+
+    constexpr bool is_abspath() const {
+        return Policy::is_abspath(data_, size_);
+    }
+
+    template <size_t M>
+    constexpr BasicStaticPath<Policy, N + M + 1> operator / (const BasicStaticPath<Policy, M>& other) const {
+        BasicStaticPath<Policy, N + M + 1> res{data_, size_};
+        res.join(other.data(), other.size());
+        return res;
+    }
+
+    template <size_t M>
+    constexpr BasicStaticPath<Policy, N + M> operator / (const char (&str)[M]) const {
+        BasicStaticPath<Policy, N + M> res{data_, size_};
+        res.join(str, M - 1);
+        return res;
+    }
+
+    // Appends str with a separator in between when needed
+    constexpr void join(const char* str, size_t size) {
+        if (size_ != 0 && !Policy::is_separator(data_[size_ - 1]) && size_ < N) {
+            data_[size_++] = Policy::Separator;
+        }
+        append(str, size);
+    }
+
+private:
+    constexpr void append(const char* str, size_t size) {
+        for (size_t i = 0; i < size && str[i] != '\0' && size_ < N; ++i) {
+            data_[size_++] = str[i];
+        }
+        data_[size_] = '\0';
+        index();
+    }
+
+    constexpr void index() {
+        depth_ = 0;
+        size_t i = 0;
+        if (size_ > 0 && Policy::is_separator(data_[0])) {
+            offsets_[0] = 0;
+            sizes_[0] = 1;
+            depth_ = 1;
+            i = 1;
+        }
+        while (i < size_) {
+            if (Policy::is_separator(data_[i])) {
+                ++i;
+                continue;
+            }
+            const size_t start = i;
+            while (i < size_ && !Policy::is_separator(data_[i])) {
+                ++i;
+            }
+            offsets_[depth_] = start;
+            sizes_[depth_] = i - start;
+            ++depth_;
+        }
+    }
+
+    char data_[N + 1] = {};
+    size_t size_ = 0;
+    size_t offsets_[MaxComponents] = {};
+    size_t sizes_[MaxComponents] = {};
+    size_t depth_ = 0;
+};
+
+template <size_t N>
+using StaticPath = BasicStaticPath<priv::NativePolicy, N>;
+
+template <size_t N>
+using PosixStaticPath = BasicStaticPath<priv::PosixPolicy, N>;
+
+template <size_t N>
+using WinStaticPath = BasicStaticPath<priv::WinPolicy, N>;
+
+template <size_t N>
+constexpr StaticPath<N - 1> static_path(const char (&str)[N]) {
+    return StaticPath<N - 1>{str};
+}
+
+#if defined(__GNUC__)
+inline namespace literals {
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#if defined(__clang__)
+#pragma GCC diagnostic ignored "-Wgnu-string-literal-operator-template"
+#endif
+// "var/spool"_path, a StaticPath of the literal. Relies on the string
+// literal operator template extension of GCC and Clang, use
+// static_path("var/spool") elsewhere.
+template <typename Char, Char... Chars>
+constexpr StaticPath<sizeof...(Chars)> operator "" _path() {
+    return StaticPath<sizeof...(Chars)>{{Chars..., '\0'}};
+}
+#pragma GCC diagnostic pop
+
+} // inline namespace literals {
+#endif
+
+namespace priv {
+
+// Fixed set of workers with a task deque each. A worker takes its own
+// newest task first (oldest one in FIFO mode) and steals the oldest tasks
+// of other workers when its deque is empty. Tasks submitted from a worker
+// go to that worker's deque.
+class WorkStealingPool {
+public:
+    typedef std::function<void()> Task;
+
+    explicit WorkStealingPool(size_t n_threads, bool lifo = true)
+    :   lifo_(lifo) {
+        if (n_threads == 0) {
+            n_threads = std::thread::hardware_concurrency();
+        }
+        if (n_threads == 0) {
+            n_threads = 1;
+        }
+        for (size_t i = 0; i < n_threads; ++i) {
+            queues_.emplace_back(new Queue);
+        }
+        for (size_t i = 0; i < n_threads; ++i) {
+            threads_.emplace_back([this, i] { worker(i); });
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator = (const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    size_t size() const {
+        return threads_.size();
+    }
+
+    void submit(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++queued_;
+            ++pending_;
+        }
+        const auto& current = current_worker();
+        const size_t index = current.pool == this?
+            current.index : next_queue_.fetch_add(1) % queues_.size();
+        {
+            std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+            queues_[index]->tasks.push_back(std::move(task));
+        }
+        work_cv_.notify_one();
+    }
+
+    // Blocks until all submitted tasks are done and rethrows the first
+    // exception thrown by a task. Tasks left after a failure are dropped.
+    // Must not be called from a worker.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this] { return pending_ == 0; });
+        if (error_) {
+            auto error = error_;
+            error_ = nullptr;
+            failed_ = false;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    struct Current {
+        WorkStealingPool* pool = nullptr;
+        size_t index = 0;
+    };
+
+    static Current& current_worker() {
+        static thread_local Current current;
+        return current;
+    }
+
+    bool pop(size_t index, Task& task) {
+        auto& own = *queues_[index];
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                if (lifo_) {
+                    task = std::move(own.tasks.back());
+                    own.tasks.pop_back();
+                } else {
+                    task = std::move(own.tasks.front());
+                    own.tasks.pop_front();
+                }
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            auto& other = *queues_[(index + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.tasks.empty()) {
+                task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker(size_t index) {
+        current_worker().pool = this;
+        current_worker().index = index;
+        for (;;) {
+            Task task;
+            if (!pop(index, task)) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_cv_.wait(lock, [this] { return queued_ > 0 || stop_; });
+                if (stop_ && queued_ == 0) {
+                    return;
+                }
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --queued_;
+            }
+            if (!failed_) {
+                try {
+                    task();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (!error_) {
+                        error_ = std::current_exception();
+                    }
+                    failed_ = true;
+                }
+            }
+            task = nullptr;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0) {
+                done_cv_.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    size_t queued_ = 0;
+    size_t pending_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::atomic<bool> failed_{false};
+    std::atomic<size_t> next_queue_{0};
+    const bool lifo_;
+};
+
+} // namespace priv {
+
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_WIN32
+
+class FileInfoImplWin32 {
+public:
+
+    WIN32_FIND_DATA* native_ptr() { return &find_data_; }
+    const WIN32_FIND_DATA* native_ptr() const { return &find_data_; }
+
+    String name() const {
+        // TODO: Support long names
+        // TODO: Make lazy
+        return String{find_data_.cFileName};
+    }
+
+    bool is_directory() const {
+        return find_data_.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+    }
+
+private:
+    WIN32_FIND_DATA find_data_;
+};
+
+namespace priv {
+String translate_error_code2string(DWORD win_error_code) {
+    if (win_error_code == 0)
+        return String{};
+    LPSTR messageBuffer = nullptr;
+    size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL, win_error_code, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&messageBuffer, 0, NULL);
+    String message{messageBuffer, size};
+    LocalFree(messageBuffer);
+    return message;
+}
+
+
+template <typename Exc>
+void winerror(int error_code, String&& win_error, const char* file, int line) {
+    if (error_code != 0) {
+        std::ostringstream err;
+        err << win_error << " (win error: " << error_code << ", str: " << translate_error_code2string(error_code) << ") at file " << file << ":" << line;
+        throw Exc(err.str());
+    }
+}
+
+
+#define WINERROR(error, exc, win_error) { priv::winerror<exc>(error, (win_error), __FILE__, __LINE__); }
+
+#define WINCHECK(ret_code, exc, win_error) { if (!(ret_code)) { priv::winerror<exc>(GetLastError(), (win_error), __FILE__, __LINE__); } }
+
+}; // namespace priv {
+
+
+class FileIterImplWin32 {
+public:
+    FileIterImplWin32()
+        : handle_{0},
+        end_{true} {
+
+    }
+
+    ~FileIterImplWin32() {
+        if (handle_) {
+            FindClose(handle_);
+        }
+    }
+
+    FileIterImplWin32(const String& path)
+        : dir_path_(path) {
+        // TODO: Extend MAX_PATH
+        WINCHECK(handle_ = FindFirstFile(path.c_str(), find_data_.native_ptr()),
+            std::runtime_error, "FindFirstFile failed");
+    }
+
+    bool operator == (const FileIterImplWin32& other) const {
+        return end_ && other.end_;
+    }
+
+    bool operator != (const FileIterImplWin32& other) const {
+        return !(*this == other);
+    }
+
+    FileIterImplWin32& operator ++() {
+        auto res = FindNextFile(handle_, find_data_.native_ptr());
+
+        if (!res) {
+            const auto error = GetLastError();
+            if (error == ERROR_NO_MORE_FILES) {
+                end_ = true;
+            }
+            else {
+                WINERROR(error, std::runtime_error, "FindNextFile failed");
+            }
+        }
+
+        return *this;
+    }
+
+    FileInfoImplWin32 operator *() const {
+        return find_data_;
+    }
+
+    bool is_end() const {
+        return end_;
+    }
+
+    bool is_directory() const {
+        return find_data_.is_directory();
+    }
+
+    const WinPath& dir_path() const {
+        return dir_path_;
+    }
+
+    WinPath path() const {
+        if (!handle_) {
+            throw RuntimeError("Called path() for non-initialized iterator");
+        }
+        return WinPath{dir_path_, find_data_.name()};
+    }
+
+private:
+    WinPath dir_path_;
+    HANDLE handle_;
+    bool end_ = false;
+    FileInfoImplWin32 find_data_;
+};
+
+class PathImplWin32 : public WinPath {
+public:
+    using Self = PathImplWin32;
+
+    PathImplWin32() {}
+
+    PathImplWin32(const String& path)
+    : WinPath{path} {
+    }
+
+    PathImplWin32(const char* path)
+    : WinPath{path} {
+    }
+
+    template<typename ... Types,
+        typename = typename std::enable_if<priv::IsJoinArgs<PathImplWin32, std::allocator<char>, Types...>::value>::type>
+    PathImplWin32(Types&&... args)
+    : WinPath{std::forward<Types>(args)...} {
+    }
+    
+
+    PathImplWin32 abspath() const {
+        return Self{Self::cwd(), str()};
+    }
+
+    const PathImplWin32& mkdir() const {
+        return PathImplWin32::mkdir(*this);
+    }
+
+    static const PathImplWin32& mkdir(const PathImplWin32& path) {
+        WINCHECK(CreateDirectory(path.c_str(), NULL),
+            RuntimeError, "CreateDirectory failed");
+        return path;
+    }
+
+    static const PathImplWin32& mkdir_if_not_exists(const PathImplWin32& path) {
+        const auto res = CreateDirectory(path.c_str(), NULL);
+        if (!res) {
+            auto const error = GetLastError();
+            if (error != 0 && error != ERROR_ALREADY_EXISTS) {
+                WINERROR(error, RuntimeError, "CreateDirectory failed");
+            }
+        }
+        return path;
+    }
+
+    const PathImplWin32& mkdir_if_not_exists() const {
+        return PathImplWin32::mkdir_if_not_exists(*this);
+    }
+
+    static const PathImplWin32& mkdir_parents(const PathImplWin32& path) {
+        for (size_t i = 1, depth = path.depth(); i <= depth; ++i) {
+            const Self cur_path{path.prefix(i).str()};
+            if (!cur_path.exists()) {
+                cur_path.mkdir();
+            }
+        }
+        return path;
+    }
+
+    const PathImplWin32& mkdir_parents() const {
+        return PathImplWin32::mkdir_parents(*this);
+    }
+
+    static const PathImplWin32& rmrf_if_exists(const PathImplWin32& path) {
+        if (path.exists()) {
+            return path.rmrf();
+        }
+        return path;
+    }
+
+    const PathImplWin32& rmrf_if_exists() const {
+        return Self::rmrf_if_exists(*this);
+    }
+
+    static const PathImplWin32& rm(const PathImplWin32& path) {
+       if (path.is_directory()) {
+           path.rm_directory();
+       } else {
+           path.rm_file();
+       }
+ 
+       return path;
+    }
+
+    const PathImplWin32& rm() const {
+        return Self::rm(*this);
+    }
+
+    static const PathImplWin32& rm_directory(const PathImplWin32& path) {
+        RemoveDirectory(path.c_str()); // FIXME
+        return path;
+    }
+
+    const PathImplWin32& rm_directory() const {
+        return Self::rm_directory(*this);
+    }
+
+    static const PathImplWin32& rm_file(const PathImplWin32& path) {
+        DeleteFile(path.c_str()); // FIXME
+        return path;
+    }
+
+    const PathImplWin32& rm_file() const {
+        return Self::rm_file(*this);
+    }
+
+    static const PathImplWin32& rmrf(const PathImplWin32& path) {
+        FileIterImplWin32 iter{path.str()};
+        while (!iter.is_end()) {
+            if (iter.is_directory()) {
+                Self{iter.path()}.rmrf();
+            }
+            else {
+                Self{iter.path()}.rm();
+            }
+            ++iter;
+        }
+        path.rm();
+        return path;
+    }
+
+    const PathImplWin32& rmrf() const {
+        return Self::rmrf(*this);
+    }
+
+    static PathImplWin32 tmp_dir() {
+        static Self tmp = tmp_dir_impl();
+        return tmp;
+    }
+
+    static PathImplWin32 cwd() {
+        TCHAR buffer[MAX_PATH + 1];
+        WINCHECK(GetCurrentDirectory(sizeof(buffer), buffer),
+            RuntimeError, "cwd fail");
+        return Self{buffer};
+    }
+
+    std::vector<String> split() const {
+        return crefile::split(str());
+    }
+    
+    bool exists() const {
+        return PathImplWin32::exists(*this);
+    }
+
+    static bool exists(const PathImplWin32& path) {
+        WIN32_FIND_DATA file_data;
+        HANDLE handle = FindFirstFile(path.c_str(), &file_data);
+        bool found = (handle != INVALID_HANDLE_VALUE);
+        if (found) {
+            FindClose(handle);
+        }
+        return found;
+    }
+  
+private:
+    static PathImplWin32 tmp_dir_impl() {
+        TCHAR buffer[MAX_PATH + 1];
+        WINCHECK(GetCurrentDirectory(sizeof(buffer), buffer),
+            RuntimeError, "tmp_dir_impl fail");
+        return Self{buffer};
+    }
+};
+
+
+typedef PathImplWin32 Path;
+typedef FileInfoImplWin32 FileInfo;
+typedef FileIterImplWin32 FileIter;
+
+//PathImplWin32 get_tmp_path() {
+//    char tmp_path[MAX_PATH + 1];
+//    WINCHECK(GetTempPath(sizeof(tmp_path) - 1, tmp_path),
+//        std::runtime_error, "GetTempPath failed");
+//    return PathImplWin32{tmp_path};
+//}
+
+PathImplWin32 generate_tmp_filename(const PathImplWin32& path, const String& file_prefix) {
+    char tmp[MAX_PATH + 1];
+    WINCHECK(GetTempFileName(path.c_str(), file_prefix.c_str(), 0, tmp),
+        std::runtime_error, "generate_tmp_filename failed");
+    return PathImplWin32{tmp};
+}
+
+#undef WINCHECK
+#undef WINERROR
+
+#endif // #if CREFILE_PLATFORM == CREFILE_PLATFORM_WIN32
+
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_UNIX || CREFILE_PLATFORM == CREFILE_PLATFORM_DARWIN
+
+void check_error(ErrorCode code) {
+    if (code != 0) {
+        const auto error = errno;
+        switch (error) {
+            case EPERM:
+            case EACCES:
+                throw NoPermissionException{error};
+            case ENOENT:
+                throw NoSuchFileException{error};
+            case EEXIST:
+                throw FileExistsException{error};
+            case ENOTDIR:
+                throw NotDirectoryException{error};
+            default:
+                throw UnknownErrorException{error};
+        }
+    }
+}
+
+namespace priv {
+
+#if defined(__linux__)
+// Record layout filled by getdents64(2). The kernel only writes d_reclen
+// bytes for each record, so d_name is really a variable-length tail.
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+typedef LinuxDirent64 NativeDirent;
+#else
+typedef struct dirent NativeDirent;
+#endif
+
+unsigned char mode_to_dirent_type(mode_t mode) {
+    switch (mode & S_IFMT) {
+        case S_IFREG: return DT_REG;
+        case S_IFDIR: return DT_DIR;
+        case S_IFLNK: return DT_LNK;
+        case S_IFIFO: return DT_FIFO;
+        case S_IFSOCK: return DT_SOCK;
+        case S_IFCHR: return DT_CHR;
+        case S_IFBLK: return DT_BLK;
+        default: return DT_UNKNOWN;
+    }
+}
+
+bool is_dot_or_dot_dot(const char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// Reads directory entries without "." and "..". On Linux entries are read
+// in getdents64 batches into one reusable buffer and handed out in place,
+// elsewhere it is a thin readdir wrapper. A returned entry stays valid
+// until the next call of next() or rewind().
+class DirReaderUnix {
+public:
+    static const size_t DefaultBufferSize = 32 * 1024;
+    static const size_t MinBufferSize = 1024;
+
+    DirReaderUnix(const char* path, size_t buffer_size = DefaultBufferSize) {
+#if defined(__linux__)
+        const int fd = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        check_error(fd < 0 ? -1 : 0);
+        init(fd, buffer_size);
+#else
+        dir_ = ::opendir(path);
+        check_error(dir_ ? 0 : -1);
+#endif
+    }
+
+    // Takes ownership of an already opened directory descriptor
+    DirReaderUnix(int fd, size_t buffer_size) {
+#if defined(__linux__)
+        init(fd, buffer_size);
+#else
+        dir_ = ::fdopendir(fd);
+        if (!dir_) {
+            const auto error = errno;
+            ::close(fd);
+            errno = error;
+            check_error(-1);
+        }
+#endif
+    }
+
+    // Takes ownership of the descriptor, lists into an external buffer of
+    // at least MinBufferSize bytes which must outlive the reader
+    DirReaderUnix(int fd, char* buffer, size_t buffer_size)
+#if defined(__linux__)
+    :   fd_(fd),
+        data_(buffer),
+        buffer_size_(buffer_size) {
+    }
+#else
+    :   DirReaderUnix(fd, buffer_size) {
+        (void)buffer;
+    }
+#endif
+
+    struct Borrowed {};
+
+    // Lists a descriptor that stays owned by the caller
+    DirReaderUnix(Borrowed, int fd, size_t buffer_size)
+#if defined(__linux__)
+    :   owns_fd_(false) {
+        init(fd, buffer_size);
+    }
+#else
+    :   DirReaderUnix(::dup(fd), buffer_size) {
+    }
+#endif
+
+    DirReaderUnix(const DirReaderUnix&) = delete;
+    DirReaderUnix& operator = (const DirReaderUnix&) = delete;
+
+    ~DirReaderUnix() {
+#if defined(__linux__)
+        if (fd_ >= 0 && owns_fd_) {
+            ::close(fd_);
+        }
+#else
+        if (dir_) {
+            ::closedir(dir_);
+        }
+#endif
+    }
+
+    int fd() const {
+#if defined(__linux__)
+        return fd_;
+#else
+        return ::dirfd(dir_);
+#endif
+    }
+
+    const NativeDirent* next() {
+#if defined(__linux__)
+        for (;;) {
+            if (pos_ >= end_ && !fill()) {
+                return nullptr;
+            }
+            auto entry = reinterpret_cast<const NativeDirent*>(data_ + pos_);
+            pos_ += entry->d_reclen;
+            if (!is_dot_or_dot_dot(entry->d_name)) {
+                return entry;
+            }
+        }
+#else
+        for (;;) {
+            errno = 0;
+            auto entry = ::readdir(dir_);
+            if (!entry) {
+                check_error(errno ? -1 : 0);
+                return nullptr;
+            }
+            if (!is_dot_or_dot_dot(entry->d_name)) {
+                return entry;
+            }
+        }
+#endif
+    }
+
+    void rewind() {
+#if defined(__linux__)
+        check_error(::lseek(fd_, 0, SEEK_SET) < 0 ? -1 : 0);
+        pos_ = end_ = 0;
+#else
+        ::rewinddir(dir_);
+#endif
+    }
+
+private:
+#if defined(__linux__)
+    void init(int fd, size_t buffer_size) {
+        fd_ = fd;
+        buffer_size_ = buffer_size < MinBufferSize ? MinBufferSize : buffer_size;
+        buffer_.reset(new char[buffer_size_]);
+        data_ = buffer_.get();
+    }
+
+    bool fill() {
+        const auto res = ::syscall(SYS_getdents64, fd_, data_, buffer_size_);
+        check_error(res < 0 ? -1 : 0);
+        pos_ = 0;
+        end_ = static_cast<size_t>(res);
+        return end_ > 0;
+    }
+
+    int fd_ = -1;
+    bool owns_fd_ = true;
+    std::unique_ptr<char[]> buffer_;
+    char* data_ = nullptr;
+    size_t buffer_size_ = 0;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+#else
+    DIR* dir_ = nullptr;
+#endif
+};
+
+} // namespace priv {
+
+struct StatCacheOptions {
+    size_t n_shards = 64; // Rounded up to a power of two
+    std::chrono::steady_clock::duration ttl = std::chrono::seconds{1}; // Zero keeps entries until invalidated
+};
+
+// Cache of stat() and lstat() results, negative ones included, for
+// programs asking about the same paths over and over. Thread-safe: paths
+// are spread over shards with a mutex each. Paths are keyed as spelled,
+// "a//b" and "a/b" are different entries.
+//
+// Once installed, Path::exists() and is_directory() and FileInfo of
+// FileIter go through the cache, and crefile's own mkdir, mkdir_parents,
+// rm and rmrf invalidate what they change. Changes made by anything
+// else are seen after the TTL or an explicit invalidate().
+class StatCache {
+public:
+    explicit StatCache(const StatCacheOptions& options = StatCacheOptions{})
+    :   ttl_(options.ttl) {
+        size_t n_shards = 1;
+        while (n_shards < options.n_shards) {
+            n_shards *= 2;
+        }
+        shards_.reset(new Shard[n_shards]);
+        mask_ = n_shards - 1;
+    }
+
+    StatCache(const StatCache&) = delete;
+    StatCache& operator = (const StatCache&) = delete;
+
+    // Same as ::stat(), but returns 0 or the errno value
+    int stat(const char* path, struct stat* st) {
+        return lookup(path, st, true);
+    }
+
+    // Same as ::lstat(), but returns 0 or the errno value
+    int lstat(const char* path, struct stat* st) {
+        return lookup(path, st, false);
+    }
+
+    void invalidate(PathView path) {
+        Shard& shard = shard_for(path);
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        ++shard.generation;
+        n_entries_.fetch_sub(shard.entries.erase(key(path)), std::memory_order_relaxed);
+        generation_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Drops path and everything under it. Entries under path are not
+    // looked for: path is recorded with a new subtree generation, and
+    // results older than the generation of one of their parents are
+    // dropped when they are looked up. The recorded paths are swept
+    // once they outnumber a fraction of the entries.
+    void invalidate_subtree(PathView path) {
+        while (path.size() > 1 && priv::NativePolicy::is_separator(path[path.size() - 1])) {
+            path = path.substr(0, path.size() - 1);
+        }
+        if (path.empty()) {
+            clear();
+            return;
+        }
+        invalidate(path);
+        std::lock_guard<std::mutex> lock{subtrees_mutex_};
+        subtrees_[path.str()] = subtree_generation_.fetch_add(1, std::memory_order_release) + 1;
+        if (subtrees_.size() > MinSweptSubtrees &&
+                subtrees_.size() * SubtreeSweepRatio > n_entries_.load(std::memory_order_relaxed)) {
+            sweep_subtrees();
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> subtrees_lock{subtrees_mutex_};
+        for (size_t i = 0; i <= mask_; ++i) {
+            std::lock_guard<std::mutex> lock{shards_[i].mutex};
+            ++shards_[i].generation;
+            n_entries_.fetch_sub(shards_[i].entries.size(), std::memory_order_relaxed);
+            shards_[i].entries.clear();
+        }
+        subtrees_.clear();
+        generation_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Grows on every invalidation, equal values mean nothing was dropped
+    uint64_t generation() const {
+        return generation_.load(std::memory_order_relaxed);
+    }
+
+    size_t size() const { return sum([](const Shard& shard) { return shard.entries.size(); }); }
+    size_t hits() const { return sum([](const Shard& shard) { return shard.hits; }); }
+    size_t misses() const { return sum([](const Shard& shard) { return shard.misses; }); }
+
+    // Process-wide cache used by Path and FileInfo, nullptr disables it.
+    // The cache must outlive its use.
+    static void install(StatCache* cache) {
+        installed_ptr().store(cache, std::memory_order_release);
+    }
+
+    static StatCache* installed() {
+        return installed_ptr().load(std::memory_order_acquire);
+    }
+
+    // Installs a cache for its own lifetime, then puts back the previous one
+    class ScopedInstall {
+    public:
+        explicit ScopedInstall(StatCache* cache)
+        :   previous_(installed()) {
+            install(cache);
+        }
+
+        ~ScopedInstall() {
+            install(previous_);
+        }
+
+        ScopedInstall(const ScopedInstall&) = delete;
+        ScopedInstall& operator = (const ScopedInstall&) = delete;
+
+    private:
+        StatCache* previous_;
+    };
+
+private:
+    static const size_t MinSweptSubtrees = 64;
+    static const size_t SubtreeSweepRatio = 16;
+
+    struct Result {
+        struct stat st;
+        int error = 0;
+        bool known = false;
+        std::chrono::steady_clock::time_point expires;
+        uint64_t checked = 0; // No subtree holding it invalidated up to this
+    };
+
+    struct Entry {
+        Result results[2]; // lstat() and stat()
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<String, Entry> entries;
+        uint64_t generation = 0;
+        size_t hits = 0;
+        size_t misses = 0;
+    };
+
+    static std::atomic<StatCache*>& installed_ptr() {
+        static std::atomic<StatCache*> cache{nullptr};
+        return cache;
+    }
+
+    static const String& key(PathView path) {
+        static thread_local String buffer;
+        buffer.assign(path.data(), path.size());
+        return buffer;
+    }
+
+    // Latest generation of an invalidated subtree holding path, 0 if none.
+    // Needs subtrees_mutex_.
+    uint64_t subtree_generation(const String& path) const {
+        if (subtrees_.empty()) {
+            return 0;
+        }
+        static thread_local String prefix;
+        prefix = path;
+        uint64_t res = 0;
+        for (size_t size = path.size() + 1; size-- > 0;) {
+            if (size == path.size() || priv::NativePolicy::is_separator(path[size])) {
+                prefix.resize(size > 0? size : std::min<size_t>(path.size(), 1));
+                const auto found = subtrees_.find(prefix);
+                if (found != subtrees_.end()) {
+                    res = std::max(res, found->second);
+                }
+            }
+        }
+        return res;
+    }
+
+    // Drops results older than the subtrees holding them and forgets the
+    // subtrees. Needs subtrees_mutex_.
+    void sweep_subtrees() {
+        const uint64_t latest = subtree_generation_.load(std::memory_order_relaxed);
+        for (size_t i = 0; i <= mask_; ++i) {
+            Shard& shard = shards_[i];
+            std::lock_guard<std::mutex> lock{shard.mutex};
+            ++shard.generation;
+            for (auto entry = shard.entries.begin(); entry != shard.entries.end();) {
+                const uint64_t generation = subtree_generation(entry->first);
+                bool known = false;
+                for (Result& result : entry->second.results) {
+                    if (result.checked < generation) {
+                        result.known = false;
+                    }
+                    result.checked = latest;
+                    known = known || result.known;
+                }
+                if (known) {
+                    ++entry;
+                } else {
+                    entry = shard.entries.erase(entry);
+                    n_entries_.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        subtrees_.clear();
+        generation_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Shard& shard_for(PathView path) const {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < path.size(); ++i) {
+            h = (h ^ static_cast<unsigned char>(path[i])) * 0x100000001b3ULL;
+        }
+        return shards_[(h ^ (h >> 32)) & mask_];
+    }
+
+    template <typename Count>
+    size_t sum(Count count) const {
+        size_t res = 0;
+        for (size_t i = 0; i <= mask_; ++i) {
+            std::lock_guard<std::mutex> lock{shards_[i].mutex};
+            res += count(shards_[i]);
+        }
+        return res;
+    }
+
+    int lookup(const char* path, struct stat* st, bool follow) {
+        const PathView view{path};
+        Shard& shard = shard_for(view);
+        const auto now = std::chrono::steady_clock::now();
+        const uint64_t latest = subtree_generation_.load(std::memory_order_acquire);
+        uint64_t checked = latest;
+        Result cached;
+        {
+            std::lock_guard<std::mutex> lock{shard.mutex};
+            const auto found = shard.entries.find(key(view));
+            if (found != shard.entries.end()) {
+                const Result& result = found->second.results[follow];
+                if (result.known && (ttl_ == ttl_.zero() || now < result.expires)) {
+                    if (result.checked >= latest) {
+                        ++shard.hits;
+                        *st = result.st;
+                        return result.error;
+                    }
+                    cached = result;
+                }
+            }
+        }
+
+        // A subtree was invalidated since the result was stored, it counts
+        // if no invalidated subtree holds path
+        if (cached.known) {
+            uint64_t generation;
+            {
+                std::lock_guard<std::mutex> lock{subtrees_mutex_};
+                generation = subtree_generation(key(view));
+                checked = subtree_generation_.load(std::memory_order_relaxed);
+            }
+            if (generation <= cached.checked) {
+                std::lock_guard<std::mutex> lock{shard.mutex};
+                ++shard.hits;
+                const auto found = shard.entries.find(key(view));
+                if (found != shard.entries.end()) {
+                    Result& result = found->second.results[follow];
+                    if (result.known && result.checked == cached.checked) {
+                        result.checked = checked;
+                    }
+                }
+                *st = cached.st;
+                return cached.error;
+            }
+        }
+
+        uint64_t generation;
+        {
+            std::lock_guard<std::mutex> lock{shard.mutex};
+            ++shard.misses;
+            generation = shard.generation;
+        }
+        const int res = follow? ::stat(path, st) : ::lstat(path, st);
+        const int error = res == 0? 0 : errno;
+        {
+            std::lock_guard<std::mutex> lock{shard.mutex};
+            // Skip results which may predate an invalidation made meanwhile,
+            // subtree invalidations newer than checked drop them on lookup
+            if (shard.generation == generation) {
+                const auto inserted = shard.entries.emplace(key(view), Entry{});
+                if (inserted.second) {
+                    n_entries_.fetch_add(1, std::memory_order_relaxed);
+                }
+                Result& result = inserted.first->second.results[follow];
+                result.st = *st;
+                result.error = error;
+                result.known = true;
+                result.expires = now + ttl_;
+                result.checked = checked;
+            }
+        }
+        return error;
+    }
+
+    const std::chrono::steady_clock::duration ttl_;
+    std::unique_ptr<Shard[]> shards_;
+    size_t mask_ = 0;
+    std::atomic<uint64_t> generation_{0};
+    std::atomic<size_t> n_entries_{0};
+    mutable std::mutex subtrees_mutex_;
+    std::unordered_map<String, uint64_t> subtrees_; // Invalidated subtree roots
+    std::atomic<uint64_t> subtree_generation_{0};
+};
+
+namespace priv {
+
+// stat() through the installed StatCache if any, 0 or errno
+int stat_path(const char* path, struct stat* st) {
+    if (StatCache* cache = StatCache::installed()) {
+        return cache->stat(path, st);
+    }
+    return ::stat(path, st) == 0? 0 : errno;
+}
+
+// Tells the installed StatCache that path and its parent directory changed
+void stat_changed(PathView path, bool subtree = false) {
+    if (StatCache* cache = StatCache::installed()) {
+        if (subtree) {
+            cache->invalidate_subtree(path);
+        } else {
+            cache->invalidate(path);
+        }
+        cache->invalidate(path.parent());
+    }
+}
+
+} // namespace priv {
+
+// Metadata a caller asks for. Filesystems may skip work for fields left out
+// (on Linux the mask goes to statx(2)).
+struct StatFields {
+    enum : unsigned {
+        Type = 1 << 0,
+        Mode = 1 << 1,
+        Nlink = 1 << 2,
+        Inode = 1 << 3,
+        Device = 1 << 4,
+        Size = 1 << 5,
+        Atime = 1 << 6,
+        Mtime = 1 << 7,
+        Ctime = 1 << 8,
+        Btime = 1 << 9,
+
+        Basic = Type | Mode | Nlink | Inode | Device | Size | Atime | Mtime | Ctime,
+        All = Basic | Btime,
+    };
+};
+
+enum class StatSync {
+    Default, // Whatever stat() does
+    DontSync, // Cached attributes are fine, for network mounts
+    ForceSync, // Ask the server
+};
+
+typedef std::chrono::time_point<std::chrono::system_clock, std::chrono::nanoseconds> FileTime;
+
+struct FileStatus {
+    unsigned fields = 0; // StatFields filled in, may lack some asked for
+    mode_t mode = 0;
+    uint64_t nlink = 0;
+    uint64_t inode = 0;
+    uint64_t device = 0;
+    uint64_t size = 0;
+    FileTime atime;
+    FileTime mtime;
+    FileTime ctime;
+    FileTime btime;
+
+    bool has(unsigned wanted) const { return (fields & wanted) == wanted; }
+
+    bool is_directory() const { return S_ISDIR(mode); }
+    bool is_file() const { return S_ISREG(mode); }
+    bool is_symlink() const { return S_ISLNK(mode); }
+};
+
+struct StatResult {
+    int error = 0; // errno of the failed stat, 0 on success
+    FileStatus status;
+
+    bool ok() const { return error == 0; }
+
+    // Throws the exception check_error() maps the error to
+    void check() const {
+        errno = error;
+        check_error(error == 0? 0 : -1);
+    }
+};
+
+namespace priv {
+
+template <typename Timespec>
+FileTime to_file_time(const Timespec& ts) {
+    return FileTime{std::chrono::seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec}};
+}
+
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_DARWIN
+const unsigned StatFieldsFromStat = StatFields::All;
+#else
+const unsigned StatFieldsFromStat = StatFields::Basic;
+#endif
+
+void status_from_stat(const struct stat& st, FileStatus* status) {
+    status->fields = StatFieldsFromStat;
+    status->mode = st.st_mode;
+    status->nlink = st.st_nlink;
+    status->inode = st.st_ino;
+    status->device = st.st_dev;
+    status->size = st.st_size;
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_DARWIN
+    status->atime = to_file_time(st.st_atimespec);
+    status->mtime = to_file_time(st.st_mtimespec);
+    status->ctime = to_file_time(st.st_ctimespec);
+    status->btime = to_file_time(st.st_birthtimespec);
+#else
+    status->atime = to_file_time(st.st_atim);
+    status->mtime = to_file_time(st.st_mtim);
+    status->ctime = to_file_time(st.st_ctim);
+#endif
+}
+
+#if CREFILE_HAVE_STATX
+unsigned statx_mask(unsigned fields) {
+    unsigned mask = 0;
+    if (fields & StatFields::Type) mask |= STATX_TYPE;
+    if (fields & StatFields::Mode) mask |= STATX_MODE;
+    if (fields & StatFields::Nlink) mask |= STATX_NLINK;
+    if (fields & StatFields::Inode) mask |= STATX_INO;
+    if (fields & StatFields::Size) mask |= STATX_SIZE;
+    if (fields & StatFields::Atime) mask |= STATX_ATIME;
+    if (fields & StatFields::Mtime) mask |= STATX_MTIME;
+    if (fields & StatFields::Ctime) mask |= STATX_CTIME;
+    if (fields & StatFields::Btime) mask |= STATX_BTIME;
+    return mask;
+}
+
+void status_from_statx(const struct statx& stx, FileStatus* status) {
+    // The device is always filled in
+    unsigned fields = StatFields::Device;
+    if (stx.stx_mask & STATX_TYPE) fields |= StatFields::Type;
+    if (stx.stx_mask & STATX_MODE) fields |= StatFields::Mode;
+    if (stx.stx_mask & STATX_NLINK) fields |= StatFields::Nlink;
+    if (stx.stx_mask & STATX_INO) fields |= StatFields::Inode;
+    if (stx.stx_mask & STATX_SIZE) fields |= StatFields::Size;
+    if (stx.stx_mask & STATX_ATIME) fields |= StatFields::Atime;
+    if (stx.stx_mask & STATX_MTIME) fields |= StatFields::Mtime;
+    if (stx.stx_mask & STATX_CTIME) fields |= StatFields::Ctime;
+    if (stx.stx_mask & STATX_BTIME) fields |= StatFields::Btime;
+
+    status->fields = fields;
+    status->mode = stx.stx_mode;
+    status->nlink = stx.stx_nlink;
+    status->inode = stx.stx_ino;
+    status->device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    status->size = stx.stx_size;
+    status->atime = to_file_time(stx.stx_atime);
+    status->mtime = to_file_time(stx.stx_mtime);
+    status->ctime = to_file_time(stx.stx_ctime);
+    status->btime = to_file_time(stx.stx_btime);
+}
+
+int statx_sync_flag(StatSync sync) {
+    switch (sync) {
+        case StatSync::DontSync: return AT_STATX_DONT_SYNC;
+        case StatSync::ForceSync: return AT_STATX_FORCE_SYNC;
+        default: return AT_STATX_SYNC_AS_STAT;
+    }
+}
+#endif
+
+// Status of name relative to dir_fd (AT_FDCWD for plain paths), 0 or errno.
+// Uses statx(2) when the kernel has it, fstatat(2) otherwise.
+int stat_at(int dir_fd, const char* name, unsigned fields, StatSync sync, bool follow_symlinks, FileStatus* status) {
+#if CREFILE_HAVE_STATX
+    // Old kernels refuse statx with ENOSYS, seccomp filters usually with
+    // EPERM. EPERM is given up on once fstatat works where statx didn't.
+    static std::atomic<bool> no_statx{false};
+    bool refused = false;
+    if (!no_statx.load(std::memory_order_relaxed)) {
+        struct statx stx;
+        const int flags = (follow_symlinks? 0 : AT_SYMLINK_NOFOLLOW) | statx_sync_flag(sync);
+        if (::statx(dir_fd, name, flags, statx_mask(fields), &stx) == 0) {
+            status_from_statx(stx, status);
+            return 0;
+        }
+        if (errno == ENOSYS) {
+            no_statx.store(true, std::memory_order_relaxed);
+        } else if (errno == EPERM) {
+            refused = true;
+        } else {
+            return errno;
+        }
+    }
+#else
+    (void)fields;
+    (void)sync;
+#endif
+    struct stat st;
+    if (::fstatat(dir_fd, name, &st, follow_symlinks? 0 : AT_SYMLINK_NOFOLLOW) != 0) {
+        return errno;
+    }
+#if CREFILE_HAVE_STATX
+    if (refused) {
+        no_statx.store(true, std::memory_order_relaxed);
+    }
+#endif
+    status_from_stat(st, status);
+    return 0;
+}
+
+} // namespace priv {
+
+class FileInfoImplUnix {
+private:
+    void valid() const {
+        if (is_end()) {
+            throw RuntimeError("Can't get info from invalid file!");
+        }
+    }
+
+    // Type from the directory entry itself when the filesystem reports it,
+    // one fstatat against the open directory otherwise
+    unsigned char type() const {
+        valid();
+        if (entry_->d_type != DT_UNKNOWN) {
+            return entry_->d_type;
+        }
+        return priv::mode_to_dirent_type(status(StatFields::Type).mode);
+    }
+
+public:
+    FileInfoImplUnix() = default;
+
+    // dir_path lets the installed StatCache answer stat questions
+    FileInfoImplUnix(const priv::NativeDirent* entry, int dir_fd, const char* dir_path = nullptr)
+    :   entry_(entry),
+        dir_fd_(dir_fd),
+        dir_path_(dir_path) {
+    }
+
+    const priv::NativeDirent* native_ptr_impl() const { return entry_; }
+
+    String name() const {
+        if (is_end()) {
+            return String{};
+        } else {
+            return String{entry_->d_name};
+        }
+    }
+
+    const char* name_c_str() const {
+        valid();
+        return entry_->d_name;
+    }
+
+    bool is_directory() const {
+        return type() == DT_DIR;
+    }
+
+    bool is_file() const {
+        return type() == DT_REG;
+    }
+
+    bool is_symlink() const {
+        return type() == DT_LNK;
+    }
+
+    uint64_t inode() const {
+        valid();
+        return entry_->d_ino;
+    }
+
+    // Metadata of the entry itself (symlinks are not followed), fetched on
+    // first use with only the fields asked for so far. ForceSync fetches
+    // again unless the fields came from a synced fetch already.
+    const FileStatus& status(unsigned fields = StatFields::Basic, StatSync sync = StatSync::Default) const {
+        valid();
+        if ((requested_ & fields) != fields || (sync == StatSync::ForceSync && (synced_ & fields) != fields)) {
+            const unsigned wanted = requested_ | fields;
+            FileStatus status;
+            int error;
+            StatCache* cache = StatCache::installed();
+            if (cache && dir_path_ && sync != StatSync::ForceSync && (wanted & ~priv::StatFieldsFromStat) == 0) {
+                const PosixPath path{dir_path_, entry_->d_name};
+                struct stat st;
+                error = cache->lstat(path.c_str(), &st);
+                if (error == 0) {
+                    priv::status_from_stat(st, &status);
+                }
+            } else {
+                error = priv::stat_at(dir_fd_, entry_->d_name, wanted, sync, false, &status);
+            }
+            errno = error;
+            check_error(error == 0? 0 : -1);
+            status_ = status;
+            requested_ = wanted;
+            synced_ = sync == StatSync::ForceSync? wanted : 0;
+        }
+        return status_;
+    }
+
+    uint64_t size() const {
+        return status(StatFields::Size).size;
+    }
+
+    mode_t mode() const {
+        return status(StatFields::Mode).mode;
+    }
+
+    uint64_t device() const {
+        return status(StatFields::Device).device;
+    }
+
+    uint64_t nlink() const {
+        return status(StatFields::Nlink).nlink;
+    }
+
+    FileTime mtime() const {
+        return status(StatFields::Mtime).mtime;
+    }
+
+    FileTime ctime() const {
+        return status(StatFields::Ctime).ctime;
+    }
+
+    // Not every filesystem records creation time, FileTime{} then.
+    // status(StatFields::Btime).has(StatFields::Btime) tells them apart.
+    FileTime btime() const {
+        return status(StatFields::Btime).btime;
+    }
+
+    bool is_end() const {
+        return entry_ == nullptr;
+    }
+
+private:
+    const priv::NativeDirent* entry_ = nullptr;
+    int dir_fd_ = -1;
+    const char* dir_path_ = nullptr;
+    mutable unsigned requested_ = 0;
+    mutable unsigned synced_ = 0;
+    mutable FileStatus status_;
+};
+
+// Entries point into the reader's buffer, so a FileInfo is valid only until
+// the iterator is advanced or destroyed.
+class FileIterImplUnix {
+private:
+    struct State {
+        State(const char* path, size_t buffer_size)
+        :   dir_path(path),
+            reader(path, buffer_size) {
+        }
+
+        PosixPath dir_path;
+        priv::DirReaderUnix reader;
+    };
+
+    void next() {
+        dir_entry_ = FileInfoImplUnix{state_->reader.next(), state_->reader.fd(), state_->dir_path.c_str()};
+    }
+
+    void valid(const char* message) const {
+        if (!state_) {
+            throw RuntimeError(message);
+        }
+    }
+
+public:
+    FileIterImplUnix() {
+    }
+
+    FileIterImplUnix(const char* path, size_t buffer_size = priv::DirReaderUnix::DefaultBufferSize)
+        : state_(new State(path, buffer_size)) {
+        next();
+    }
+
+    FileIterImplUnix(const String& path, size_t buffer_size = priv::DirReaderUnix::DefaultBufferSize)
+        : FileIterImplUnix(path.c_str(), buffer_size) {
+
+    }
+
+    FileIterImplUnix(const PosixPath& path, size_t buffer_size = priv::DirReaderUnix::DefaultBufferSize)
+        : FileIterImplUnix(path.c_str(), buffer_size) {
+
+    }
+
+    FileIterImplUnix(FileIterImplUnix&&) = default;
+    FileIterImplUnix& operator = (FileIterImplUnix&&) = default;
+
+    bool is_end() const {
+        valid("Called is_end() for non-initialized iterator");
+        return dir_entry_.is_end();
+    }
+
+    bool is_directory() const {
+        return dir_entry_.is_directory();
+    }
+
+    // Descriptor of the directory being listed
+    int dir_fd() const {
+        valid("Called dir_fd() for non-initialized iterator");
+        return state_->reader.fd();
+    }
+
+    const PosixPath& dir_path() const {
+        valid("Called dir_path() for non-initialized iterator");
+        return state_->dir_path;
+    }
+
+    PosixPath path() const {
+        valid("Called path() for non-initialized iterator");
+        return PosixPath{state_->dir_path, dir_entry_.name_c_str()};
+    }
+
+    bool operator == (const FileIterImplUnix& other) const {
+        return dir_entry_.is_end() && other.dir_entry_.is_end();
+    }
+
+    bool operator != (const FileIterImplUnix& other) const {
+        return !(*this == other);
+    }
+
+    FileIterImplUnix& operator ++() {
+        valid("Called next file for non-initialized iterator");
+        next();
+        return *this;
+    }
+
+    const FileInfoImplUnix& operator *() const {
+        return dir_entry_;
+    }
+
+private:
+    std::unique_ptr<State> state_;
+    FileInfoImplUnix dir_entry_;
+};
+
+namespace priv {
+
+#if CREFILE_HAVE_IO_URING
+// Bare io_uring(7) ring driven by raw syscalls: one submission queue
+// filled by a single thread and reaped by the same thread.
+class IoUring {
+public:
+    IoUring() = default;
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator = (const IoUring&) = delete;
+
+    ~IoUring() {
+        close();
+    }
+
+    // False when the kernel doesn't have io_uring or refuses it
+    bool open(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        const int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) {
+            return false;
+        }
+        fd_ = fd;
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = map(sqes_size_, IORING_OFF_SQES);
+        if (!sq_ring_ || !cq_ring_ || !sqes) {
+            close();
+            return false;
+        }
+
+        char* sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+        char* cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        entries_ = params.sq_entries;
+        probe();
+        return true;
+    }
+
+    bool is_open() const {
+        return fd_ >= 0;
+    }
+
+    unsigned entries() const {
+        return entries_;
+    }
+
+    bool supports(unsigned opcode) const {
+        return opcode < 64 && (supported_ >> opcode & 1);
+    }
+
+    // Zeroed entry for the next submission, queued by push()
+    io_uring_sqe* prepare() {
+        io_uring_sqe* sqe = &sqes_[*sq_tail_ & sq_mask_];
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    void push() {
+        const unsigned tail = *sq_tail_;
+        sq_array_[tail & sq_mask_] = tail & sq_mask_;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted_;
+    }
+
+    // Submits what was pushed and waits for min_complete completions, 0 or errno
+    int enter(unsigned min_complete) {
+        for (;;) {
+            const auto res = ::syscall(__NR_io_uring_enter, fd_, unsubmitted_, min_complete,
+                min_complete? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (res >= 0) {
+                unsubmitted_ -= static_cast<unsigned>(res);
+                return 0;
+            }
+            if (errno != EINTR) {
+                return errno;
+            }
+        }
+    }
+
+    // Waits for min_complete completions without submitting, 0 or errno
+    int wait(unsigned min_complete) {
+        for (;;) {
+            if (::syscall(__NR_io_uring_enter, fd_, 0, min_complete, IORING_ENTER_GETEVENTS, nullptr, 0) >= 0) {
+                return 0;
+            }
+            if (errno != EINTR) {
+                return errno;
+            }
+        }
+    }
+
+    // Calls found(user_data) for every pushed entry the kernel hasn't taken
+    template <typename Found>
+    void unsubmitted(Found&& found) const {
+        const unsigned tail = *sq_tail_;
+        for (unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE); head != tail; ++head) {
+            found(sqes_[sq_array_[head & sq_mask_]].user_data);
+        }
+    }
+
+    // Calls done(user_data, res) for every completion ready
+    template <typename Done>
+    void reap(Done&& done) {
+        unsigned head = *cq_head_;
+        const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            done(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    void close() {
+        if (sqes_) {
+            ::munmap(sqes_, sqes_size_);
+        }
+        if (cq_ring_ && cq_ring_ != sq_ring_) {
+            ::munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sq_ring_) {
+            ::munmap(sq_ring_, sq_ring_size_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        sqes_ = nullptr;
+        sq_ring_ = cq_ring_ = nullptr;
+        fd_ = -1;
+        unsubmitted_ = 0;
+        supported_ = 0;
+    }
+
+private:
+    void* map(size_t size, off_t offset) {
+        void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        return ptr == MAP_FAILED? nullptr : ptr;
+    }
+
+    void probe() {
+        const unsigned n_ops = 64;
+        std::unique_ptr<uint64_t[]> buffer{new uint64_t[(sizeof(io_uring_probe) + n_ops * sizeof(io_uring_probe_op)) / sizeof(uint64_t) + 1]()};
+        auto probe = reinterpret_cast<io_uring_probe*>(buffer.get());
+        if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, n_ops) != 0) {
+            return;
+        }
+        for (unsigned i = 0; i < probe->ops_len && i < n_ops; ++i) {
+            if (probe->ops[i].flags & IO_URING_OP_SUPPORTED) {
+                supported_ |= uint64_t(1) << i;
+            }
+        }
+    }
+
+    int fd_ = -1;
+    unsigned entries_ = 0;
+    unsigned unsubmitted_ = 0;
+    uint64_t supported_ = 0;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* sq_array_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
+#endif
+
+// Metadata operation of a batch, names are relative to dir_fd
+struct BatchOp {
+    enum Kind {
+        Stat, // fields in mode, AT_SYMLINK_NOFOLLOW in flags
+        Mkdir,
+        Unlink, // AT_REMOVEDIR in flags for directories
+        Rename, // to path2 relative to dir_fd2
+    };
+
+    Kind kind;
+    int dir_fd;
+    const char* path;
+    unsigned mode = 0;
+    int flags = 0;
+    FileStatus* status = nullptr;
+    int dir_fd2 = AT_FDCWD;
+    const char* path2 = nullptr;
+};
+
+} // namespace priv {
+
+struct BatchOptions {
+    unsigned queue_depth = 64; // Operations in flight at once
+    bool io_uring = true; // False always makes plain syscalls
+};
+
+// Runs metadata operations in batches. On Linux with io_uring up to
+// queue_depth of them are submitted and reaped with one syscall, otherwise
+// (or when the kernel lacks an opcode) each is a plain syscall. Results
+// are errno values, 0 on success, in input order. EINPROGRESS means the
+// ring failed while the kernel had the op and its outcome is unknown.
+// Use one engine per thread.
+class BatchEngine {
+public:
+    explicit BatchEngine(const BatchOptions& options = BatchOptions{})
+    :   queue_depth_(std::max(options.queue_depth, 1u)) {
+#if CREFILE_HAVE_IO_URING
+        if (options.io_uring && ring_.open(queue_depth_)) {
+            queue_depth_ = ring_.entries();
+            owners_.resize(queue_depth_);
+#   if CREFILE_HAVE_STATX
+            statx_.resize(queue_depth_);
+#   endif
+        }
+#endif
+    }
+
+    bool uses_io_uring() const {
+#if CREFILE_HAVE_IO_URING
+        return ring_.is_open();
+#else
+        return false;
+#endif
+    }
+
+    unsigned queue_depth() const {
+        return queue_depth_;
+    }
+
+    template <typename Paths>
+    std::vector<StatResult> stat(const Paths& paths, unsigned fields = StatFields::Basic, bool follow_symlinks = true) {
+        std::vector<StatResult> results(paths.size());
+        std::vector<priv::BatchOp> ops(paths.size(), priv::BatchOp{priv::BatchOp::Stat, AT_FDCWD, nullptr});
+        for (size_t i = 0; i < ops.size(); ++i) {
+            ops[i].path = c_str(paths[i]);
+            ops[i].mode = fields;
+            ops[i].flags = follow_symlinks? 0 : AT_SYMLINK_NOFOLLOW;
+            ops[i].status = &results[i].status;
+        }
+        std::vector<int> errors(ops.size());
+        run(ops.data(), ops.size(), errors.data());
+        for (size_t i = 0; i < ops.size(); ++i) {
+            results[i].error = errors[i];
+        }
+        return results;
+    }
+
+    template <typename Paths>
+    std::vector<int> mkdir(const Paths& paths, mode_t mode = 0777) {
+        std::vector<priv::BatchOp> ops(paths.size(), priv::BatchOp{priv::BatchOp::Mkdir, AT_FDCWD, nullptr});
+        for (size_t i = 0; i < ops.size(); ++i) {
+            ops[i].path = c_str(paths[i]);
+            ops[i].mode = mode;
+        }
+        return run_changing(ops);
+    }
+
+    // Removes files, symlinks and the like
+    template <typename Paths>
+    std::vector<int> unlink(const Paths& paths) {
+        return remove(paths, 0);
+    }
+
+    // Removes empty directories
+    template <typename Paths>
+    std::vector<int> rmdir(const Paths& paths) {
+        return remove(paths, AT_REMOVEDIR);
+    }
+
+    // Renames from[i] to to[i]
+    template <typename Paths>
+    std::vector<int> rename(const Paths& from, const Paths& to) {
+        if (from.size() != to.size()) {
+            throw RuntimeError("Can't rename paths to a list of different size");
+        }
+        std::vector<priv::BatchOp> ops(from.size(), priv::BatchOp{priv::BatchOp::Rename, AT_FDCWD, nullptr});
+        for (size_t i = 0; i < ops.size(); ++i) {
+            ops[i].path = c_str(from[i]);
+            ops[i].path2 = c_str(to[i]);
+        }
+        auto errors = run_changing(ops);
+        for (size_t i = 0; i < ops.size(); ++i) {
+            if (errors[i] == 0) {
+                priv::stat_changed(to[i], true);
+            }
+        }
+        return errors;
+    }
+
+    // Runs count operations, errors[i] gets the errno of ops[i]
+    void run(const priv::BatchOp* ops, size_t count, int* errors) {
+#if CREFILE_HAVE_IO_URING
+        if (ring_.is_open() && count > 1 && ring_supports(ops, count)) {
+            run_ring(ops, count, errors);
+            return;
+        }
+#endif
+        for (size_t i = 0; i < count; ++i) {
+            errors[i] = run_sync(ops[i]);
+        }
+    }
+
+private:
+    static const char* c_str(const char* path) { return path; }
+    template <typename P>
+    static const char* c_str(const P& path) { return path.c_str(); }
+
+    template <typename Paths>
+    std::vector<int> remove(const Paths& paths, int flags) {
+        std::vector<priv::BatchOp> ops(paths.size(), priv::BatchOp{priv::BatchOp::Unlink, AT_FDCWD, nullptr});
+        for (size_t i = 0; i < ops.size(); ++i) {
+            ops[i].path = c_str(paths[i]);
+            ops[i].flags = flags;
+        }
+        return run_changing(ops);
+    }
+
+    // Runs ops and tells the installed StatCache about paths changed
+    std::vector<int> run_changing(const std::vector<priv::BatchOp>& ops) {
+        std::vector<int> errors(ops.size());
+        run(ops.data(), ops.size(), errors.data());
+        for (size_t i = 0; i < ops.size(); ++i) {
+            if (errors[i] == 0) {
+                priv::stat_changed(ops[i].path, ops[i].kind != priv::BatchOp::Mkdir);
+            }
+        }
+        return errors;
+    }
+
+    static int run_sync(const priv::BatchOp& op) {
+        int res = 0;
+        switch (op.kind) {
+            case priv::BatchOp::Stat:
+                return priv::stat_at(op.dir_fd, op.path, op.mode, StatSync::Default,
+                    !(op.flags & AT_SYMLINK_NOFOLLOW), op.status);
+            case priv::BatchOp::Mkdir:
+                res = ::mkdirat(op.dir_fd, op.path, op.mode);
+                break;
+            case priv::BatchOp::Unlink:
+                res = ::unlinkat(op.dir_fd, op.path, op.flags);
+                break;
+            case priv::BatchOp::Rename:
+                res = ::renameat(op.dir_fd, op.path, op.dir_fd2, op.path2);
+                break;
+        }
+        return res == 0? 0 : errno;
+    }
+
+#if CREFILE_HAVE_IO_URING
+    static unsigned opcode(priv::BatchOp::Kind kind) {
+        switch (kind) {
+            case priv::BatchOp::Stat: return IORING_OP_STATX;
+            case priv::BatchOp::Mkdir: return IORING_OP_MKDIRAT;
+            case priv::BatchOp::Unlink: return IORING_OP_UNLINKAT;
+            case priv::BatchOp::Rename: return IORING_OP_RENAMEAT;
+        }
+        return IORING_OP_LAST;
+    }
+
+    bool ring_supports(const priv::BatchOp* ops, size_t count) const {
+        for (size_t i = 0; i < count; ++i) {
+#   if !CREFILE_HAVE_STATX
+            if (ops[i].kind == priv::BatchOp::Stat) {
+                return false;
+            }
+#   endif
+            if (!ring_.supports(opcode(ops[i].kind))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void prepare(const priv::BatchOp& op, unsigned slot, io_uring_sqe* sqe) {
+        sqe->opcode = static_cast<uint8_t>(opcode(op.kind));
+        sqe->fd = op.dir_fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(op.path);
+        sqe->user_data = slot;
+        switch (op.kind) {
+            case priv::BatchOp::Stat:
+#   if CREFILE_HAVE_STATX
+                sqe->len = priv::statx_mask(op.mode);
+                sqe->off = reinterpret_cast<uintptr_t>(&statx_[slot]);
+                sqe->statx_flags = op.flags;
+#   endif
+                break;
+            case priv::BatchOp::Mkdir:
+                sqe->len = op.mode;
+                break;
+            case priv::BatchOp::Unlink:
+                sqe->unlink_flags = op.flags;
+                break;
+            case priv::BatchOp::Rename:
+                sqe->len = op.dir_fd2;
+                sqe->addr2 = reinterpret_cast<uintptr_t>(op.path2);
+                break;
+        }
+    }
+
+    void run_ring(const priv::BatchOp* ops, size_t count, int* errors) {
+        std::vector<unsigned> free_slots(queue_depth_);
+        for (unsigned slot = 0; slot < queue_depth_; ++slot) {
+            free_slots[slot] = queue_depth_ - 1 - slot;
+        }
+        size_t next = 0;
+        size_t in_flight = 0;
+        const auto complete = [&](uint64_t slot, int res) {
+            const size_t index = owners_[slot];
+#   if CREFILE_HAVE_STATX
+            if (res == 0 && ops[index].kind == priv::BatchOp::Stat) {
+                priv::status_from_statx(statx_[slot], ops[index].status);
+            }
+#   endif
+            errors[index] = res < 0? -res : 0;
+            free_slots.push_back(static_cast<unsigned>(slot));
+            --in_flight;
+        };
+        while (next < count || in_flight > 0) {
+            for (; next < count && !free_slots.empty(); ++next, ++in_flight) {
+                const unsigned slot = free_slots.back();
+                free_slots.pop_back();
+                owners_[slot] = next;
+                prepare(ops[next], slot, ring_.prepare());
+                ring_.push();
+            }
+            const int error = ring_.enter(1);
+            if (error != 0 && error != EAGAIN && error != EBUSY) {
+                finish_sync(ops, count, next, in_flight, free_slots, complete, errors);
+                return;
+            }
+            ring_.reap(complete);
+        }
+    }
+
+    // Completions left in a failed ring would go to the next batch, so the
+    // engine makes plain syscalls from now on. Ops the kernel took may have
+    // run already and are waited for. If even waiting fails they report
+    // EINPROGRESS: running them again could report EEXIST for a mkdir that
+    // succeeded or rename another file. Ops the kernel never took and the
+    // ones never pushed run as plain syscalls.
+    template <typename Complete>
+    void finish_sync(const priv::BatchOp* ops, size_t count, size_t next, const size_t& in_flight,
+            const std::vector<unsigned>& free_slots, Complete& complete, int* errors) {
+        std::vector<unsigned> unsubmitted;
+        ring_.unsubmitted([&unsubmitted](uint64_t slot) {
+            unsubmitted.push_back(static_cast<unsigned>(slot));
+        });
+        ring_.reap(complete);
+        while (in_flight > unsubmitted.size() && ring_.wait(1) == 0) {
+            ring_.reap(complete);
+        }
+        ring_.close();
+
+        std::vector<bool> busy(queue_depth_, true);
+        for (const unsigned slot : free_slots) {
+            busy[slot] = false;
+        }
+        for (const unsigned slot : unsubmitted) {
+            busy[slot] = false;
+            errors[owners_[slot]] = run_sync(ops[owners_[slot]]);
+        }
+        for (unsigned slot = 0; slot < queue_depth_; ++slot) {
+            if (busy[slot]) {
+                errors[owners_[slot]] = EINPROGRESS;
+            }
+        }
+        for (; next < count; ++next) {
+            errors[next] = run_sync(ops[next]);
+        }
+    }
+
+    priv::IoUring ring_;
+    std::vector<size_t> owners_; // Operation index of every slot
+#   if CREFILE_HAVE_STATX
+    std::vector<struct statx> statx_;
+#   endif
+#endif
+    unsigned queue_depth_;
+};
+
+namespace priv {
+
+int open_dir_at(int dir_fd, const char* name) {
+    return ::openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+unsigned char dirent_type_at(int dir_fd, const NativeDirent* entry) {
+    if (entry->d_type != DT_UNKNOWN) {
+        return entry->d_type;
+    }
+    struct stat st;
+    check_error(::fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW));
+    return mode_to_dirent_type(st.st_mode);
+}
+
+class RmrfImplUnix {
+private:
+    struct Frame {
+        std::unique_ptr<DirReaderUnix> reader; // Closed for far ancestors to save descriptors
+        char* buffer = nullptr;
+        const char* name = nullptr;
+        PathArena::Mark mark; // Arena state before the frame's buffer and name
+        dev_t dev = 0;
+        ino_t ino = 0;
+        bool rewound = false;
+    };
+
+public:
+    static const size_t MaxOpenDirs = 64;
+
+    // Removes path like `rm -rf`. Children are removed relative to the open
+    // descriptor of their directory, the traversal keeps its own stack.
+    // Listing buffers and names come from the arena and are reused by
+    // sibling directories. With an engine files are unlinked in batches.
+    static void run(const char* path, BatchEngine* engine = nullptr) {
+        run(AT_FDCWD, path, engine);
+    }
+
+    // Same for path relative to an open directory
+    static void run(int parent_fd, const char* path, BatchEngine* engine = nullptr) {
+        PathArena arena;
+        Unlinks unlinks{engine};
+        const int fd = open_dir_at(parent_fd, path);
+        if (fd < 0) {
+            if (errno == ENOTDIR || errno == ELOOP) {
+                check_error(::unlinkat(parent_fd, path, 0));
+                return;
+            }
+            check_error(-1);
+        }
+
+        std::vector<Frame> stack;
+        push(stack, arena, fd, nullptr);
+        while (!stack.empty()) {
+            const size_t top = stack.size() - 1;
+            const int dir_fd = stack[top].reader->fd();
+            const auto entry = stack[top].reader->next();
+            if (entry) {
+                stack[top].rewound = false;
+                if (dirent_type_at(dir_fd, entry) == DT_DIR) {
+                    unlinks.flush(dir_fd);
+                    const int child_fd = open_dir_at(dir_fd, entry->d_name);
+                    check_error(child_fd < 0 ? -1 : 0);
+                    push(stack, arena, child_fd, entry->d_name);
+                } else {
+                    unlinks.add(dir_fd, entry->d_name);
+                }
+                continue;
+            }
+
+            unlinks.flush(stack[top].reader->fd());
+            int res;
+            if (top == 0) {
+                res = ::unlinkat(parent_fd, path, AT_REMOVEDIR);
+            } else {
+                if (!stack[top - 1].reader) {
+                    reopen_parent(stack[top - 1], stack[top]);
+                }
+                res = ::unlinkat(stack[top - 1].reader->fd(), stack[top].name, AT_REMOVEDIR);
+            }
+            // Entries may be created meanwhile or skipped by a listing
+            // that changed under us, so look through the directory once more
+            if (res != 0 && errno == ENOTEMPTY && !stack[top].rewound) {
+                stack[top].reader->rewind();
+                stack[top].rewound = true;
+                continue;
+            }
+            check_error(res);
+            arena.rewind(stack[top].mark);
+            stack.pop_back();
+        }
+    }
+
+private:
+    // Files of the current directory waiting for one engine batch. Names
+    // are copied because the listing buffer is refilled meanwhile.
+    class Unlinks {
+    public:
+        explicit Unlinks(BatchEngine* engine)
+        :   engine_(engine) {
+        }
+
+        void add(int dir_fd, const char* name) {
+            if (!engine_) {
+                check_error(::unlinkat(dir_fd, name, 0));
+                return;
+            }
+            offsets_.push_back(names_.size());
+            names_.append(name, std::strlen(name) + 1);
+            if (offsets_.size() >= engine_->queue_depth()) {
+                flush(dir_fd);
+            }
+        }
+
+        void flush(int dir_fd) {
+            if (offsets_.empty()) {
+                return;
+            }
+            ops_.assign(offsets_.size(), BatchOp{BatchOp::Unlink, dir_fd, nullptr});
+            for (size_t i = 0; i < offsets_.size(); ++i) {
+                ops_[i].path = names_.data() + offsets_[i];
+            }
+            errors_.resize(ops_.size());
+            engine_->run(ops_.data(), ops_.size(), errors_.data());
+            names_.clear();
+            offsets_.clear();
+            for (const int error : errors_) {
+                if (error != 0) {
+                    errno = error;
+                    check_error(-1);
+                }
+            }
+        }
+
+    private:
+        BatchEngine* engine_;
+        String names_;
+        std::vector<size_t> offsets_;
+        std::vector<BatchOp> ops_;
+        std::vector<int> errors_;
+    };
+
+    static void push(std::vector<Frame>& stack, PathArena& arena, int fd, const char* name) {
+        const auto mark = arena.mark();
+        char* buffer;
+        try {
+            buffer = static_cast<char*>(arena.allocate(DirReaderUnix::DefaultBufferSize, alignof(NativeDirent)));
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        std::unique_ptr<DirReaderUnix> reader{new DirReaderUnix{fd, buffer, DirReaderUnix::DefaultBufferSize}};
+        stack.emplace_back();
+        stack.back().reader = std::move(reader);
+        stack.back().buffer = buffer;
+        stack.back().mark = mark;
+        if (name) {
+            stack.back().name = arena.copy(name, std::strlen(name));
+        }
+
+        // The far frame was closed already if the stack went this deep before
+        if (stack.size() > MaxOpenDirs && stack[stack.size() - MaxOpenDirs - 1].reader) {
+            Frame& far = stack[stack.size() - MaxOpenDirs - 1];
+            struct stat st;
+            check_error(::fstat(far.reader->fd(), &st));
+            far.dev = st.st_dev;
+            far.ino = st.st_ino;
+            far.reader.reset();
+        }
+    }
+
+    static void reopen_parent(Frame& parent, const Frame& child) {
+        const int fd = ::openat(child.reader->fd(), "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        check_error(fd < 0 ? -1 : 0);
+        parent.reader.reset(new DirReaderUnix{fd, parent.buffer, DirReaderUnix::DefaultBufferSize});
+
+        struct stat st;
+        check_error(::fstat(fd, &st));
+        if (st.st_dev != parent.dev || st.st_ino != parent.ino) {
+            throw RuntimeError("Directory was moved while removing it");
+        }
+    }
+};
+
+// Every directory is a pool task. Files are unlinked by the task that
+// lists the directory, subdirectories become new tasks. A directory is
+// removed by whichever task finishes its last pending piece of work.
+// Directories waiting for their children keep their descriptors, so once
+// MaxOpenDirs are open a new subtree is removed by its task alone with
+// RmrfImplUnix, which reopens far ancestors instead of holding them.
+class ParallelRmrfImplUnix {
+private:
+    struct Node {
+        ~Node() {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        std::shared_ptr<Node> parent;
+        String name;
+        int fd = -1;
+        std::atomic<size_t> pending{1}; // Own listing plus unfinished children
+        bool rescanned = false;
+    };
+
+    typedef std::shared_ptr<Node> NodePtr;
+
+    struct Context {
+        Context(const char* path, size_t n_threads)
+        :   root_path(path),
+            pool(n_threads) {
+        }
+
+        void close(Node& node) {
+            ::close(node.fd);
+            node.fd = -1;
+            n_open.fetch_sub(1);
+        }
+
+        const String root_path;
+        std::atomic<size_t> n_open{0};
+        WorkStealingPool pool;
+    };
+
+public:
+    static const size_t MaxOpenDirs = 256;
+
+    static void run(const char* path, size_t n_threads) {
+        const int fd = open_dir_at(AT_FDCWD, path);
+        if (fd < 0) {
+            if (errno == ENOTDIR || errno == ELOOP) {
+                check_error(::unlink(path));
+                return;
+            }
+            check_error(-1);
+        }
+
+        auto root = std::make_shared<Node>();
+        root->fd = fd;
+        Context context{path, n_threads};
+        context.n_open = 1;
+        context.pool.submit([&context, root] { scan(context, root); });
+        context.pool.wait();
+    }
+
+private:
+    static void scan(Context& context, const NodePtr& node) {
+        if (node->fd < 0) {
+            const NodePtr& parent = node->parent;
+            if (context.n_open.load() >= MaxOpenDirs) {
+                RmrfImplUnix::run(parent->fd, node->name.c_str());
+                finish(context, parent);
+                return;
+            }
+            node->fd = open_dir_at(parent->fd, node->name.c_str());
+            check_error(node->fd < 0 ? -1 : 0);
+            context.n_open.fetch_add(1);
+        }
+
+        // Children open and remove themselves through node->fd while it
+        // is listed, so the reader only borrows it
+        DirReaderUnix reader{DirReaderUnix::Borrowed{}, node->fd, DirReaderUnix::DefaultBufferSize};
+        if (node->rescanned) {
+            reader.rewind();
+        }
+        while (const auto entry = reader.next()) {
+            if (dirent_type_at(node->fd, entry) == DT_DIR) {
+                auto child = std::make_shared<Node>();
+                child->parent = node;
+                child->name = entry->d_name;
+                node->pending.fetch_add(1);
+                context.pool.submit([&context, child] { scan(context, child); });
+            } else {
+                check_error(::unlinkat(node->fd, entry->d_name, 0));
+            }
+        }
+        finish(context, node);
+    }
+
+    static void finish(Context& context, NodePtr node) {
+        while (node && node->pending.fetch_sub(1) == 1) {
+            const NodePtr parent = node->parent;
+            const auto res = parent?
+                ::unlinkat(parent->fd, node->name.c_str(), AT_REMOVEDIR) :
+                ::unlinkat(AT_FDCWD, context.root_path.c_str(), AT_REMOVEDIR);
+            if (res != 0 && errno == ENOTEMPTY && !node->rescanned) {
+                node->rescanned = true;
+                node->pending = 1;
+                context.pool.submit([&context, node] { scan(context, node); });
+                return;
+            }
+            check_error(res);
+            context.close(*node);
+            node = parent;
+        }
+    }
+};
+
+} // namespace priv {
+
+typedef FileInfoImplUnix FileInfo;
+typedef FileIterImplUnix FileIter;
+
+enum class WalkOrder {
+    PreOrder, // Directory before its children
+    PostOrder, // Directory after its children
+};
+
+enum class WalkErrors {
+    Throw, // Stop the walk with the exception of the failed call
+    Skip, // Leave out directories which can't be opened or read
+};
+
+struct WalkOptions {
+    WalkOrder order = WalkOrder::PreOrder;
+    bool follow_symlinks = false;
+    size_t buffer_size = priv::DirReaderUnix::DefaultBufferSize;
+    WalkErrors on_error = WalkErrors::Throw;
+};
+
+// Entry of a recursive walk. path() is a view of the walker's buffer and
+// like the rest of the entry is valid until the walker is advanced.
+class WalkEntryImplUnix {
+public:
+    WalkEntryImplUnix() = default;
+
+    WalkEntryImplUnix(FileInfoImplUnix info, const String* path, size_t depth, bool* prune)
+    :   info_(std::move(info)),
+        path_(path),
+        depth_(depth),
+        prune_(prune) {
+    }
+
+    const FileInfoImplUnix& info() const { return info_; }
+
+    String name() const { return info_.name(); }
+    const char* name_c_str() const { return info_.name_c_str(); }
+    const String& path() const { return *path_; }
+
+    // 0 for entries right inside the walked directory
+    size_t depth() const { return depth_; }
+
+    bool is_directory() const { return info_.is_directory(); }
+    bool is_file() const { return info_.is_file(); }
+    bool is_symlink() const { return info_.is_symlink(); }
+    uint64_t inode() const { return info_.inode(); }
+
+    bool is_end() const { return info_.is_end(); }
+
+    // Don't descend into this directory. Makes sense only for pre-order
+    // walks, post-order ones have already visited the children.
+    void prune() const {
+        if (prune_) {
+            *prune_ = true;
+        }
+    }
+
+private:
+    FileInfoImplUnix info_;
+    const String* path_ = nullptr;
+    size_t depth_ = 0;
+    bool* prune_ = nullptr;
+};
+
+// Depth-first walk over a directory tree. Open directories are kept on an
+// explicit stack and all entry paths are built in one reused buffer.
+class WalkIterImplUnix {
+private:
+    struct Frame {
+        std::unique_ptr<priv::DirReaderUnix> reader;
+        PathArena::Mark mark; // Arena state before the frame's buffer
+        size_t path_size = 0;
+        const priv::NativeDirent* entry = nullptr; // Own entry in the parent's buffer
+        int parent_fd = -1;
+        dev_t dev = 0;
+        ino_t ino = 0;
+    };
+
+    struct State {
+        WalkOptions options;
+        String path;
+        std::vector<Frame> stack;
+        PathArena arena; // Listing buffers, reused by sibling directories
+        bool descend = false;
+        bool prune = false;
+    };
+
+    void push(int fd, const priv::NativeDirent* entry, int parent_fd) {
+        auto& s = *state_;
+        Frame frame;
+        frame.mark = s.arena.mark();
+        const size_t buffer_size = s.options.buffer_size < priv::DirReaderUnix::MinBufferSize ?
+            priv::DirReaderUnix::MinBufferSize : s.options.buffer_size;
+        char* buffer;
+        try {
+            buffer = static_cast<char*>(s.arena.allocate(buffer_size, alignof(priv::NativeDirent)));
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        frame.reader.reset(new priv::DirReaderUnix{fd, buffer, buffer_size});
+        frame.path_size = s.path.size();
+        frame.entry = entry;
+        frame.parent_fd = parent_fd;
+        if (s.options.follow_symlinks) {
+            struct stat st;
+            check_error(::fstat(fd, &st));
+            frame.dev = st.st_dev;
+            frame.ino = st.st_ino;
+        }
+        s.stack.push_back(std::move(frame));
+    }
+
+    bool on_stack(const struct stat& st) const {
+        for (const auto& frame : state_->stack) {
+            if (frame.dev == st.st_dev && frame.ino == st.st_ino) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Throws for a failed call unless the walk skips errors
+    bool failed(int res) const {
+        if (res < 0 && state_->options.on_error == WalkErrors::Throw) {
+            check_error(-1);
+        }
+        return res < 0;
+    }
+
+    // Returns descriptor of the entry's directory to descend into or -1
+    int open_child(int dir_fd, const priv::NativeDirent* entry) const {
+        auto type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (failed(::fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW))) {
+                return -1;
+            }
+            type = priv::mode_to_dirent_type(st.st_mode);
+        }
+        int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW;
+        if (type == DT_LNK && state_->options.follow_symlinks) {
+            struct stat st;
+            if (::fstatat(dir_fd, entry->d_name, &st, 0) != 0 || !S_ISDIR(st.st_mode) || on_stack(st)) {
+                return -1;
+            }
+            flags &= ~O_NOFOLLOW;
+        } else if (type != DT_DIR) {
+            return -1;
+        }
+        const int fd = ::openat(dir_fd, entry->d_name, flags);
+        failed(fd);
+        return fd;
+    }
+
+    // A directory which can't be read any further ends early when skipping errors
+    const priv::NativeDirent* read(Frame& frame) const {
+        if (state_->options.on_error == WalkErrors::Throw) {
+            return frame.reader->next();
+        }
+        try {
+            return frame.reader->next();
+        } catch (const Exception&) {
+            return nullptr;
+        }
+    }
+
+    void set_entry(const priv::NativeDirent* entry, int dir_fd) {
+        auto& s = *state_;
+        entry_ = WalkEntryImplUnix{FileInfoImplUnix{entry, dir_fd}, &s.path, s.stack.size() - 1, &s.prune};
+    }
+
+    void next() {
+        auto& s = *state_;
+        if (s.descend && !s.prune) {
+            const auto& top = s.stack.back();
+            const int fd = open_child(top.reader->fd(), entry_.info().native_ptr_impl());
+            if (fd >= 0) {
+                push(fd, entry_.info().native_ptr_impl(), top.reader->fd());
+            }
+        }
+        s.descend = false;
+        s.prune = false;
+
+        while (!s.stack.empty()) {
+            auto& top = s.stack.back();
+            const int dir_fd = top.reader->fd();
+            const auto entry = read(top);
+            if (entry) {
+                s.path.resize(top.path_size);
+                if (!s.path.empty() && s.path.back() != '/') {
+                    s.path += '/';
+                }
+                s.path += entry->d_name;
+
+                if (s.options.order == WalkOrder::PreOrder) {
+                    set_entry(entry, dir_fd);
+                    s.descend = true;
+                    return;
+                }
+                const int fd = open_child(dir_fd, entry);
+                if (fd >= 0) {
+                    push(fd, entry, dir_fd);
+                    continue;
+                }
+                set_entry(entry, dir_fd);
+                return;
+            }
+
+            const auto done_entry = top.entry;
+            const auto done_parent_fd = top.parent_fd;
+            const auto done_path_size = top.path_size;
+            s.arena.rewind(top.mark);
+            s.stack.pop_back();
+            if (s.options.order == WalkOrder::PostOrder && !s.stack.empty()) {
+                s.path.resize(done_path_size);
+                set_entry(done_entry, done_parent_fd);
+                return;
+            }
+        }
+        entry_ = WalkEntryImplUnix{};
+    }
+
+    void valid(const char* message) const {
+        if (!state_) {
+            throw RuntimeError(message);
+        }
+    }
+
+public:
+    WalkIterImplUnix() {
+    }
+
+    WalkIterImplUnix(const char* path, const WalkOptions& options = WalkOptions{})
+    :   state_(new State) {
+        state_->options = options;
+        state_->path = path;
+        const int fd = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        check_error(fd < 0 ? -1 : 0);
+        push(fd, nullptr, -1);
+        next();
+    }
+
+    WalkIterImplUnix(const String& path, const WalkOptions& options = WalkOptions{})
+    :   WalkIterImplUnix(path.c_str(), options) {
+    }
+
+    WalkIterImplUnix(WalkIterImplUnix&&) = default;
+    WalkIterImplUnix& operator = (WalkIterImplUnix&&) = default;
+
+    bool is_end() const {
+        valid("Called is_end() for non-initialized walk iterator");
+        return entry_.is_end();
+    }
+
+    // Don't descend into the current directory
+    void prune() {
+        entry_.prune();
+    }
+
+    bool operator == (const WalkIterImplUnix& other) const {
+        return entry_.is_end() && other.entry_.is_end();
+    }
+
+    bool operator != (const WalkIterImplUnix& other) const {
+        return !(*this == other);
+    }
+
+    WalkIterImplUnix& operator ++() {
+        valid("Called next entry for non-initialized walk iterator");
+        next();
+        return *this;
+    }
+
+    const WalkEntryImplUnix& operator *() const {
+        return entry_;
+    }
+
+    const WalkEntryImplUnix* operator ->() const {
+        return &entry_;
+    }
+
+private:
+    std::unique_ptr<State> state_;
+    WalkEntryImplUnix entry_;
+};
+
+typedef WalkEntryImplUnix WalkEntry;
+typedef WalkIterImplUnix WalkIter;
+
+enum class ScheduleOrder {
+    DepthFirst, // Workers continue with the newest discovered directory
+    BreadthFirst, // Workers continue with the oldest discovered directory
+};
+
+struct ParallelWalkOptions {
+    size_t n_threads = 0; // Hardware concurrency for 0
+    ScheduleOrder order = ScheduleOrder::DepthFirst;
+    bool follow_symlinks = false;
+    size_t buffer_size = priv::DirReaderUnix::DefaultBufferSize;
+    WalkErrors on_error = WalkErrors::Throw;
+};
+
+namespace priv {
+
+// Every directory is a pool task which lists it with its own reader and
+// path buffer, passes the entries to the visitor and submits subdirectories.
+// Subdirectories are opened relative to their parent, which stays open
+// until they are. Past MaxOpenDirs open parents they are opened by path.
+template <typename Visitor>
+class ParallelWalkImplUnix {
+private:
+    struct Dir {
+        explicit Dir(std::atomic<size_t>& n_open)
+        :   n_open(n_open) {
+        }
+
+        ~Dir() {
+            if (fd >= 0) {
+                ::close(fd);
+                n_open.fetch_sub(1);
+            }
+        }
+
+        std::atomic<size_t>& n_open;
+        int fd = -1;
+    };
+
+    typedef std::shared_ptr<Dir> DirPtr;
+
+public:
+    static const size_t MaxOpenDirs = 256;
+
+    ParallelWalkImplUnix(Visitor& visitor, const ParallelWalkOptions& options)
+    :   visitor_(visitor),
+        options_(options),
+        pool_(options.n_threads, options.order == ScheduleOrder::DepthFirst) {
+    }
+
+    void run(const char* root) {
+        String path{root};
+        pool_.submit([this, path] { scan(nullptr, path, 0, 0, true); });
+        pool_.wait();
+    }
+
+private:
+    bool first_visit(int fd) {
+        struct stat st;
+        check_error(::fstat(fd, &st));
+        std::lock_guard<std::mutex> lock(visited_mutex_);
+        return visited_.insert(std::make_pair(st.st_dev, st.st_ino)).second;
+    }
+
+    // Throws for a failed call unless the walk skips errors
+    bool failed(int res) const {
+        if (res < 0 && options_.on_error == WalkErrors::Throw) {
+            check_error(-1);
+        }
+        return res < 0;
+    }
+
+    const NativeDirent* read(DirReaderUnix& reader) const {
+        if (options_.on_error == WalkErrors::Throw) {
+            return reader.next();
+        }
+        try {
+            return reader.next();
+        } catch (const Exception&) {
+            return nullptr;
+        }
+    }
+
+    // The name of path starts at name_offset, parent is null for the root
+    // and for directories opened by path
+    void scan(DirPtr parent, String path, size_t name_offset, size_t depth, bool is_symlink) {
+        const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (is_symlink? 0 : O_NOFOLLOW);
+        auto dir = std::make_shared<Dir>(n_open_);
+        dir->fd = parent?
+            ::openat(parent->fd, path.c_str() + name_offset, flags) :
+            ::open(path.c_str(), flags);
+        if (dir->fd < 0) {
+            if (depth == 0) {
+                check_error(-1);
+            }
+            failed(-1);
+            return;
+        }
+        n_open_.fetch_add(1);
+        parent.reset();
+        const int fd = dir->fd;
+        DirReaderUnix reader{DirReaderUnix::Borrowed{}, fd, options_.buffer_size};
+        if (options_.follow_symlinks && !first_visit(fd)) {
+            return;
+        }
+
+        const size_t path_size = path.size();
+        while (const auto entry = read(reader)) {
+            path.resize(path_size);
+            if (!path.empty() && path.back() != '/') {
+                path += '/';
+            }
+            const size_t child_name_offset = path.size();
+            path += entry->d_name;
+
+            bool prune = false;
+            visitor_(WalkEntryImplUnix{FileInfoImplUnix{entry, fd}, &path, depth, &prune});
+            if (prune) {
+                continue;
+            }
+
+            auto type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (failed(::fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW))) {
+                    continue;
+                }
+                type = mode_to_dirent_type(st.st_mode);
+            }
+            bool child_is_symlink = false;
+            if (type == DT_LNK && options_.follow_symlinks) {
+                struct stat st;
+                if (::fstatat(fd, entry->d_name, &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+                    continue;
+                }
+                child_is_symlink = true;
+            } else if (type != DT_DIR) {
+                continue;
+            }
+            const size_t child_depth = depth + 1;
+            DirPtr child_parent = n_open_.load() < MaxOpenDirs? dir : nullptr;
+            pool_.submit([this, child_parent, path, child_name_offset, child_depth, child_is_symlink]() mutable {
+                scan(std::move(child_parent), std::move(path), child_name_offset, child_depth, child_is_symlink);
+            });
+        }
+    }
+
+    Visitor& visitor_;
+    const ParallelWalkOptions options_;
+    std::mutex visited_mutex_;
+    std::set<std::pair<dev_t, ino_t>> visited_;
+    std::atomic<size_t> n_open_{0};
+    WorkStealingPool pool_;
+};
+
+} // namespace priv {
+
+// Runs the work of async calls. Implement post() to run it on an event
+// loop's blocking pool or any other scheduler.
+class Executor {
+public:
+    virtual ~Executor() = default;
+
+    virtual void post(std::function<void()> task) = 0;
+
+    // Executor of async calls made without one, nullptr restores the
+    // default shared ThreadPoolExecutor. It must outlive its use.
+    static void install(Executor* executor) {
+        installed_ptr().store(executor, std::memory_order_release);
+    }
+
+    static Executor& installed();
+
+private:
+    static std::atomic<Executor*>& installed_ptr() {
+        static std::atomic<Executor*> executor{nullptr};
+        return executor;
+    }
+};
+
+// Tasks run in posting order on a fixed set of threads. A task has to
+// report its own errors: an exception escaping it is dropped, so the pool
+// doesn't stop taking later tasks.
+class ThreadPoolExecutor : public Executor {
+public:
+    explicit ThreadPoolExecutor(size_t n_threads = 0)
+    :   pool_(n_threads, false) {
+    }
+
+    void post(std::function<void()> task) override {
+        pool_.submit([task = std::move(task)] {
+            try {
+                task();
+            } catch (...) {
+            }
+        });
+    }
+
+    size_t size() const {
+        return pool_.size();
+    }
+
+private:
+    priv::WorkStealingPool pool_;
+};
+
+Executor& Executor::installed() {
+    if (Executor* executor = installed_ptr().load(std::memory_order_acquire)) {
+        return *executor;
+    }
+    // The calls mostly wait for the disk or network, so more threads than cores
+    static ThreadPoolExecutor shared{std::max(4u, std::thread::hardware_concurrency())};
+    return shared;
+}
+
+#if CREFILE_HAVE_COROUTINES
+// co_await runs the work on the executor and resumes the awaiting
+// coroutine on the executor's thread. Exceptions of the work are rethrown
+// from co_await. Await it once.
+template <typename T>
+class AsyncResult {
+public:
+    AsyncResult(Executor& executor, std::function<T()> work)
+    :   executor_(&executor),
+        work_(std::move(work)) {
+    }
+
+    // Already known result, co_await doesn't suspend
+    template <typename U = T, typename = typename std::enable_if<!std::is_void<U>::value>::type>
+    explicit AsyncResult(U value)
+    :   value_(std::move(value)) {
+    }
+
+    bool await_ready() const noexcept {
+        return !work_;
+    }
+
+    void await_suspend(std::coroutine_handle<> awaiting) {
+        executor_->post([this, awaiting] {
+            run();
+            awaiting.resume();
+        });
+    }
+
+    T await_resume() {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        if constexpr (!std::is_void<T>::value) {
+            return std::move(*value_);
+        }
+    }
+
+private:
+    void run() noexcept {
+        try {
+            if constexpr (std::is_void<T>::value) {
+                work_();
+            } else {
+                value_.emplace(work_());
+            }
+        } catch (...) {
+            error_ = std::current_exception();
+        }
+    }
+
+    Executor* executor_ = nullptr;
+    std::function<T()> work_;
+    std::optional<typename std::conditional<std::is_void<T>::value, char, T>::type> value_;
+    std::exception_ptr error_;
+};
+
+// Directory entry copied out of the listing, it stays valid across threads
+struct AsyncDirEntry {
+    String name;
+    unsigned char type = DT_UNKNOWN;
+    uint64_t inode = 0;
+
+    bool is_directory() const { return type == DT_DIR; }
+    bool is_file() const { return type == DT_REG; }
+    bool is_symlink() const { return type == DT_LNK; }
+};
+
+// Reads a directory in batches on the executor:
+//     while (co_await dir.next()) { use(dir.entry()); }
+// Only the first entry of every batch costs a trip to the executor.
+class AsyncDirIter {
+public:
+    AsyncDirIter(const PosixPath& path, Executor& executor, size_t batch_size = 256)
+    :   state_(std::make_shared<State>(path, std::max(batch_size, size_t(1)))),
+        executor_(&executor) {
+    }
+
+    // False when the directory is over
+    AsyncResult<bool> next() {
+        auto& state = *state_;
+        if (state.pos + 1 < state.batch.size()) {
+            ++state.pos;
+            return AsyncResult<bool>{true};
+        }
+        if (state.end) {
+            return AsyncResult<bool>{false};
+        }
+        const auto state_ptr = state_;
+        return AsyncResult<bool>{*executor_, [state_ptr] { return state_ptr->fill(); }};
+    }
+
+    const AsyncDirEntry& entry() const {
+        return state_->batch.at(state_->pos);
+    }
+
+private:
+    struct State {
+        State(const PosixPath& path, size_t batch_size)
+        :   path(path),
+            batch_size(batch_size) {
+        }
+
+        bool fill() {
+            batch.clear();
+            pos = 0;
+            if (!iter) {
+                iter.reset(new FileIterImplUnix{path});
+            }
+            for (; !iter->is_end() && batch.size() < batch_size; ++*iter) {
+                const auto& info = **iter;
+                const auto entry = info.native_ptr_impl();
+                batch.emplace_back();
+                batch.back().name = entry->d_name;
+                batch.back().type = entry->d_type != DT_UNKNOWN?
+                    entry->d_type : priv::mode_to_dirent_type(info.status(StatFields::Type).mode);
+                batch.back().inode = entry->d_ino;
+            }
+            end = iter->is_end();
+            if (end) {
+                iter.reset();
+            }
+            return !batch.empty();
+        }
+
+        PosixPath path;
+        size_t batch_size;
+        std::unique_ptr<FileIterImplUnix> iter;
+        std::vector<AsyncDirEntry> batch;
+        size_t pos = 0;
+        bool end = false;
+    };
+
+    std::shared_ptr<State> state_;
+    Executor* executor_;
+};
+#endif
+
+class PathImplUnix : public PosixPath {
+public:
+    using Self = PathImplUnix;
+
+    PathImplUnix() = default;
+
+    PathImplUnix(String path)
+    :   PosixPath{path} {
+    }
+
+    PathImplUnix(PosixPath path)
+    :   PosixPath{std::move(path)} {
+    }
+
+    PathImplUnix(const char* path)
+    :   PosixPath{path} {
+    }
+
+    template<typename ... Types,
+        typename = typename std::enable_if<priv::IsJoinArgs<PathImplUnix, std::allocator<char>, Types...>::value>::type>
+    PathImplUnix(Types&&... args)
+    :   PosixPath{std::forward<Types>(args)...} {
+    }
+
+    const char* path_to_host() const {
+        return Self::path_to_host(*this);
+    }
+
+    static const char* path_to_host(const PathImplUnix& path) {
+        return path.c_str();
+    }
+
+    static PathImplUnix tmp_dir() {
+        static const char* tmp_path = getenv("TMPDIR");
+        static Self tmp;
+        if (tmp_path) {
+            tmp = tmp_path;
+        } else {
+            tmp = "/tmp";
+            // HACK FOR UNIX? FIXME
+            //throw RuntimeError("No TMPDIR in env");
+        }
+
+        return tmp;
+    }
+
+    static const PathImplUnix cwd() {
+        char buf[2000]; // FIXME: Handle bigger size and error
+        const auto res = ::getcwd(buf, sizeof(buf));
+        //check_error(res);
+        return Self{res};
+    }
+
+    PathImplUnix abspath() const {
+        return Self::abspath(*this);
+    }
+
+    static PathImplUnix abspath(const PathImplUnix& path) {
+        return Self{cwd(), path};
+    }
+
+    const PathImplUnix& mkdir() const {
+        return Self::mkdir(*this);
+    }
+
+    static const PathImplUnix& mkdir(const PathImplUnix& path) {
+        const auto res = ::mkdir(path_to_host(path), 0777);
+        if (res == 0) {
+            priv::stat_changed(path);
+        }
+        check_error(res);
+        return path;
+    }
+
+    static const PathImplUnix& mkdir_if_not_exists(const PathImplUnix& path) {
+        if (!path.exists()) {
+            path.mkdir();
+        }
+        return path;
+    }
+
+    const PathImplUnix& mkdir_if_not_exists() const {
+        return Self::mkdir_if_not_exists(*this);
+    }
+
+    // Creates path and its missing parents like `mkdir -p`. The leaf is
+    // tried first, so an existing parent costs one syscall. On ENOENT
+    // parents are probed upwards until one exists or gets created, the rest
+    // is made with mkdirat relative to it. EEXIST counts as success at
+    // every level.
+    static const PathImplUnix& mkdir_parents(const PathImplUnix& path) {
+        const size_t depth = path.depth();
+        if (depth == 0) {
+            return path;
+        }
+        int error = mkdir_exists_ok(path.c_str());
+        if (error != ENOENT) {
+            if (error == 0) {
+                priv::stat_changed(path);
+            }
+            return path;
+        }
+
+        priv::PathStorage<CREFILE_PATH_INLINE_CAPACITY> cur_path;
+        size_t base = depth - 1; // Components of the deepest present parent
+        for (; base > 0; --base) {
+            const PathView prefix = path.prefix(base);
+            cur_path.assign(prefix.data(), prefix.size());
+            error = mkdir_exists_ok(cur_path.c_str());
+            if (error != ENOENT) {
+                if (error == 0) {
+                    priv::stat_changed(prefix);
+                }
+                break;
+            }
+        }
+        if (base == 0) {
+            // Relative path which first component got removed meanwhile
+            cur_path.assign(".", 1);
+        }
+
+#if defined(O_PATH)
+        const int fd = ::open(cur_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+        const int fd = ::open(cur_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+        check_error(fd < 0 ? -1 : 0);
+        // Missing components relative to the parent, "c", "c/d" and so on
+        const size_t begin = path.component(base).data() - path.data();
+        for (size_t i = base + 1; i <= depth; ++i) {
+            cur_path.assign(path.data() + begin, path.prefix(i).size() - begin);
+            if (::mkdirat(fd, cur_path.c_str(), 0777) == 0) {
+                priv::stat_changed(path.prefix(i));
+            } else if (errno != EEXIST) {
+                const auto error = errno;
+                ::close(fd);
+                errno = error;
+                check_error(-1);
+            }
+        }
+        ::close(fd);
+        return path;
+    }
+
+    const PathImplUnix& mkdir_parents() const {
+        return Self::mkdir_parents(*this);
+    }
+
+    static const PathImplUnix& rm(const PathImplUnix& path) {
+        const auto res = ::remove(path.path_to_host());
+        if (res == 0) {
+            priv::stat_changed(path);
+        }
+        check_error(res);
+        return path;
+    }
+
+    const PathImplUnix& rm() const {
+        return Self::rm(*this);
+    }
+
+    static const PathImplUnix& rmrf(const PathImplUnix& path) {
+        try {
+            priv::RmrfImplUnix::run(path.path_to_host());
+        } catch (...) {
+            priv::stat_changed(path, true);
+            throw;
+        }
+        priv::stat_changed(path, true);
+        return path;
+    }
+
+    const PathImplUnix& rmrf() const {
+        return Self::rmrf(*this);
+    }
+
+    // Same as rmrf(), files of a directory are unlinked in engine batches
+    static const PathImplUnix& rmrf(const PathImplUnix& path, BatchEngine& engine) {
+        try {
+            priv::RmrfImplUnix::run(path.path_to_host(), &engine);
+        } catch (...) {
+            priv::stat_changed(path, true);
+            throw;
+        }
+        priv::stat_changed(path, true);
+        return path;
+    }
+
+    const PathImplUnix& rmrf(BatchEngine& engine) const {
+        return Self::rmrf(*this, engine);
+    }
+
+    // Same as rmrf(), but subdirectories are removed concurrently by
+    // n_threads workers (hardware concurrency for 0)
+    static const PathImplUnix& rmrf_parallel(const PathImplUnix& path, size_t n_threads = 0) {
+        try {
+            priv::ParallelRmrfImplUnix::run(path.path_to_host(), n_threads);
+        } catch (...) {
+            priv::stat_changed(path, true);
+            throw;
+        }
+        priv::stat_changed(path, true);
+        return path;
+    }
+
+    const PathImplUnix& rmrf_parallel(size_t n_threads = 0) const {
+        return Self::rmrf_parallel(*this, n_threads);
+    }
+
+    static const PathImplUnix& rmrf_if_exists(const PathImplUnix& path) {
+        if (path.exists()) {
+            return path.rmrf();
+        }
+        return path;
+    }
+
+    const PathImplUnix& rmrf_if_exists() const {
+        return Self::rmrf_if_exists(*this);
+    }
+
+#if CREFILE_HAVE_COROUTINES
+    // Awaitable versions of the blocking calls, run on the executor
+
+    AsyncResult<bool> async_exists(Executor& executor = Executor::installed()) const {
+        return AsyncResult<bool>{executor, [path = *this] { return path.exists(); }};
+    }
+
+    AsyncResult<bool> async_is_directory(Executor& executor = Executor::installed()) const {
+        return AsyncResult<bool>{executor, [path = *this] { return path.is_directory(); }};
+    }
+
+    AsyncResult<FileStatus> async_status(unsigned fields = StatFields::Basic, Executor& executor = Executor::installed()) const {
+        return AsyncResult<FileStatus>{executor, [path = *this, fields] { return path.status(fields); }};
+    }
+
+    AsyncResult<void> async_mkdir(Executor& executor = Executor::installed()) const {
+        return AsyncResult<void>{executor, [path = *this] { path.mkdir(); }};
+    }
+
+    AsyncResult<void> async_mkdir_parents(Executor& executor = Executor::installed()) const {
+        return AsyncResult<void>{executor, [path = *this] { path.mkdir_parents(); }};
+    }
+
+    AsyncResult<void> async_rm(Executor& executor = Executor::installed()) const {
+        return AsyncResult<void>{executor, [path = *this] { path.rm(); }};
+    }
+
+    AsyncResult<void> async_rmrf(Executor& executor = Executor::installed()) const {
+        return AsyncResult<void>{executor, [path = *this] { path.rmrf(); }};
+    }
+#endif
+
+    bool exists() const {
+        return Self::exists(*this);
+    }
+
+    static bool exists(const PathImplUnix& path) {
+        return Self::exists(path.path_to_host());
+    }
+
+    static bool exists(const char* path) {
+        struct stat st;
+        return priv::stat_path(path, &st) == 0;
     }
 
     bool is_directory() const {
-        return find_data_.is_directory();
+        return Self::is_directory(path_to_host());
     }
 
-    const WinPath& dir_path() const {
-        return dir_path_;
+    static bool is_directory(const PathImplUnix& path) {
+        return Self::is_directory(path.path_to_host());
     }
 
-    WinPath path() const {
-        if (!handle_) {
-            throw RuntimeError("Called path() for non-initialized iterator");
+    static bool is_directory(const char* path) {
+        struct stat st;
+        return priv::stat_path(path, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    FileStatus status(unsigned fields = StatFields::Basic, StatSync sync = StatSync::Default) const {
+        return Self::status(path_to_host(), fields, sync);
+    }
+
+    static FileStatus status(const PathImplUnix& path, unsigned fields = StatFields::Basic, StatSync sync = StatSync::Default) {
+        return Self::status(path.path_to_host(), fields, sync);
+    }
+
+    // Follows symlinks, like stat(2)
+    static FileStatus status(const char* path, unsigned fields = StatFields::Basic, StatSync sync = StatSync::Default) {
+        FileStatus result;
+        const auto error = priv::stat_at(AT_FDCWD, path, fields, sync, true, &result);
+        errno = error;
+        check_error(error == 0? 0 : -1);
+        return result;
+    }
+
+private:
+    // 0 when the directory was made, EEXIST when something exists there
+    // and ENOENT when a parent is missing
+    static int mkdir_exists_ok(const char* path) {
+        if (::mkdir(path, 0777) == 0) {
+            return 0;
         }
-        return WinPath{dir_path_, find_data_.name()};
+        if (errno != EEXIST && errno != ENOENT) {
+            check_error(-1);
+        }
+        return errno;
+    }
+
+public:
+
+    explicit operator String() const {
+        return str();
+    }
+};
+
+typedef PathImplUnix Path;
+
+//PathImplUnix generate_tmp_filename(const PathImplUnix& path, const String& file_prefix) {
+//    String filename = file_prefix + "XXXXXX";
+//    //DO mkstemp
+//    //return path / mktemp(const_cast<char*>(&filename.front()));
+//}
+
+#undef CREFILE_UNIXERROR
+#undef CREFILE_UNIXCHECK
+
+#endif // #if CREFILE_PLATFORM == CREFILE_PLATFORM_UNIX
+
+
+bool operator == (const Path& path_a, const char* path_b) {
+    return Path::Policy::compare(path_a.data(), path_a.size(), path_b, std::strlen(path_b)) == 0;
+}
+
+bool operator == (const Path& path_a, const String& path_b) {
+    return Path::Policy::compare(path_a.data(), path_a.size(), path_b.data(), path_b.size()) == 0;
+}
+
+//void path_join_append_one(String& to, const Path& append) {
+//    if (!to.empty() && !is_slash(to[to.size() - 1])) {
+//        to += DefaultSeparator;
+//    }
+//    to += append.path();
+//}
+
+namespace priv {
+
+// Lazy `path / a / b` chain. Keeps the head path (moved in when it's an
+// rvalue, referenced otherwise) and views of the appended pieces, and
+// builds the result once with a single reservation when converted to a
+// path. Pieces are referenced, so everything works on rvalues only: an
+// expression kept in `auto` can't be converted or used. The common path
+// methods build a temporary path and return by value. c_str(), data()
+// and view() point into the result, which the expression then keeps on
+// the heap until the end of the full expression.
+template <typename P, bool OwnsHead, size_t N>
+class JoinExpr {
+public:
+    typedef typename std::conditional<OwnsHead, P, const P*>::type Head;
+
+    // tail has N - 1 pieces
+    JoinExpr(Head head, const PathView* tail, PathView piece)
+    :   head_(std::move(head)) {
+        for (size_t i = 0; i + 1 < N; ++i) {
+            tail_[i] = tail[i];
+        }
+        tail_[N - 1] = piece;
+    }
+
+    JoinExpr<P, OwnsHead, N + 1> operator / (PathView piece) && {
+        return JoinExpr<P, OwnsHead, N + 1>{std::move(head_), tail_, piece};
+    }
+
+    operator P() && {
+        return build();
+    }
+
+    operator P() const & = delete;
+
+    P path() && {
+        return std::move(*this);
+    }
+
+    String str() && {
+        return build().str();
+    }
+
+    const char* c_str() && { return kept().c_str(); }
+    const char* data() && { return kept().data(); }
+    size_t size() && { return build().size(); }
+    PathView view() && { return kept().view(); }
+    String extension() && { return build().extension(); }
+    String dirname() && { return build().dirname(); }
+    bool exists() && { return build().exists(); }
+    bool is_directory() && { return build().is_directory(); }
+    P mkdir() && {
+        P res = build();
+        res.mkdir();
+        return res;
+    }
+
+    P mkdir_if_not_exists() && {
+        P res = build();
+        res.mkdir_if_not_exists();
+        return res;
+    }
+
+    P mkdir_parents() && {
+        P res = build();
+        res.mkdir_parents();
+        return res;
+    }
+
+    P rm() && {
+        P res = build();
+        res.rm();
+        return res;
+    }
+
+    P rmrf() && {
+        P res = build();
+        res.rmrf();
+        return res;
+    }
+
+    P rmrf_if_exists() && {
+        P res = build();
+        res.rmrf_if_exists();
+        return res;
     }
 
 private:
-    WinPath dir_path_;
-    HANDLE handle_;
-    bool end_ = false;
-    FileInfoImplWin32 find_data_;
+    typedef std::make_index_sequence<N> Pieces;
+
+    P build() {
+        return build(std::integral_constant<bool, OwnsHead>{}, Pieces{});
+    }
+
+    const P& kept() {
+        if (!kept_) {
+            kept_.reset(new P{build()});
+        }
+        return *kept_;
+    }
+
+    template <size_t... I>
+    P build(std::true_type, std::index_sequence<I...>) {
+        P res{std::move(head_)};
+        res.append(tail_[I]...);
+        return res;
+    }
+
+    template <size_t... I>
+    P build(std::false_type, std::index_sequence<I...>) const {
+        P res;
+        res.append(PathView{*head_}, tail_[I]...);
+        return res;
+    }
+
+    Head head_;
+    PathView tail_[N];
+    std::unique_ptr<P> kept_;
+};
+
+} // namespace priv {
+
+priv::JoinExpr<Path, false, 1> operator / (const Path& to, PathView add) {
+    return priv::JoinExpr<Path, false, 1>{&to, nullptr, add};
+}
+
+priv::JoinExpr<Path, true, 1> operator / (Path&& to, PathView add) {
+    return priv::JoinExpr<Path, true, 1>{std::move(to), nullptr, add};
+}
+
+class IterPath {
+public:
+    typedef FileIter const_iterator;
+
+    IterPath(Path path, size_t buffer_size = 0)
+    :   path_{path},
+        buffer_size_{buffer_size} {
+    }
+
+    String str() const { return path_.str();  }
+
+    const Path& path() const { return path_; }
+
+    size_t buffer_size() const { return buffer_size_; }
+
+private:
+    Path path_;
+    size_t buffer_size_;
+};
+
+static const IterPath iter_dir(const Path& path) {
+    return IterPath{path};
+}
+
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_UNIX || CREFILE_PLATFORM == CREFILE_PLATFORM_DARWIN
+// Same as iter_dir(path), but reads entries in batches of buffer_size bytes
+static const IterPath iter_dir(const Path& path, size_t buffer_size) {
+    return IterPath{path, buffer_size};
+}
+
+#if CREFILE_HAVE_COROUTINES
+// iter_dir() for coroutines, see AsyncDirIter
+AsyncDirIter async_iter_dir(const Path& path, Executor& executor = Executor::installed(), size_t batch_size = 256) {
+    return AsyncDirIter{path, executor, batch_size};
+}
+#endif
+#endif
+
+IterPath::const_iterator begin(const IterPath& path) {
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_WIN32
+    return IterPath::const_iterator{path.str()};
+#else
+    if (path.buffer_size()) {
+        return IterPath::const_iterator{path.path().c_str(), path.buffer_size()};
+    }
+    return IterPath::const_iterator{path.path().c_str()};
+#endif
+}
+
+IterPath::const_iterator end(const IterPath& path) {
+    return IterPath::const_iterator{};
+}
+
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_UNIX || CREFILE_PLATFORM == CREFILE_PLATFORM_DARWIN
+class WalkPath {
+public:
+    typedef WalkIter const_iterator;
+
+    WalkPath(Path path, WalkOptions options)
+    :   path_{path},
+        options_(options) {
+    }
+
+    const Path& path() const { return path_; }
+    const WalkOptions& options() const { return options_; }
+
+private:
+    Path path_;
+    WalkOptions options_;
+};
+
+// Recursive analogue of iter_dir() like Python's os.walk
+static const WalkPath walk(const Path& path, const WalkOptions& options = WalkOptions{}) {
+    return WalkPath{path, options};
+}
+
+WalkPath::const_iterator begin(const WalkPath& path) {
+    return WalkPath::const_iterator{path.path().c_str(), path.options()};
+}
+
+WalkPath::const_iterator end(const WalkPath&) {
+    return WalkPath::const_iterator{};
+}
+
+// Walks the tree with a pool of workers. The visitor is called
+// concurrently from the workers with a WalkEntry; it must be thread-safe
+// and may call entry.prune() to skip a directory. The first exception
+// thrown by a worker or the visitor is rethrown here.
+template <typename Visitor>
+void parallel_walk(const Path& root, Visitor&& visitor, const ParallelWalkOptions& options = ParallelWalkOptions{}) {
+    priv::ParallelWalkImplUnix<typename std::remove_reference<Visitor>::type> impl{visitor, options};
+    impl.run(root.c_str());
+}
+
+struct StatManyOptions {
+    unsigned fields = StatFields::Basic;
+    StatSync sync = StatSync::Default;
+    bool follow_symlinks = true;
+    size_t n_threads = 0; // Hardware concurrency for 0, 1 stats on the calling thread
+};
+
+namespace priv {
+
+// Groups paths by parent directory, opens each parent once and stats the
+// names relative to it. Groups are spread over a pool in batches.
+class StatManyImplUnix {
+private:
+    struct Item {
+        PathView dir; // Empty for names relative to the working directory
+        const char* name;
+        size_t index;
+    };
+
+    static const size_t MinBatch = 256;
+
+public:
+    static std::vector<StatResult> run(const Path* paths, size_t count, const StatManyOptions& options) {
+        std::vector<StatResult> results(count);
+        std::vector<Item> items(count);
+        for (size_t i = 0; i < count; ++i) {
+            items[i] = item(paths[i], i);
+        }
+        std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+            return compare(a.dir.data(), a.dir.size(), b.dir.data(), b.dir.size()) < 0;
+        });
+
+        // Batches end on group boundaries so every parent is opened once
+        std::vector<size_t> bounds{0};
+        for (size_t i = 1; i < count; ++i) {
+            if (i - bounds.back() >= MinBatch && items[i].dir != items[i - 1].dir) {
+                bounds.push_back(i);
+            }
+        }
+        bounds.push_back(count);
+
+        const size_t n_batches = bounds.size() - 1;
+        if (options.n_threads == 1 || n_batches <= 1) {
+            stat_items(items.data(), count, results.data(), options);
+            return results;
+        }
+        WorkStealingPool pool{std::min(options.n_threads == 0? size_t(std::thread::hardware_concurrency()) : options.n_threads, n_batches)};
+        for (size_t b = 0; b < n_batches; ++b) {
+            const Item* first = items.data() + bounds[b];
+            const size_t size = bounds[b + 1] - bounds[b];
+            StatResult* out = results.data();
+            pool.submit([first, size, out, &options] { stat_items(first, size, out, options); });
+        }
+        pool.wait();
+        return results;
+    }
+
+private:
+    static Item item(const Path& path, size_t index) {
+        const PathView view = path;
+        const size_t slash = view.find_last_slash();
+        if (slash == PathView::npos || slash + 1 == view.size()) {
+            // Plain names and paths with trailing separators as they are
+            return Item{PathView{}, path.c_str(), index};
+        }
+        return Item{view.substr(0, slash == 0? 1 : slash), path.c_str() + slash + 1, index};
+    }
+
+    static void stat_items(const Item* items, size_t count, StatResult* results, const StatManyOptions& options) {
+        String dir_path;
+        for (size_t begin = 0, end; begin < count; begin = end) {
+            end = begin + 1;
+            while (end < count && items[end].dir == items[begin].dir) {
+                ++end;
+            }
+
+            int dir_fd = AT_FDCWD;
+            if (!items[begin].dir.empty()) {
+                dir_path.assign(items[begin].dir.data(), items[begin].dir.size());
+#if defined(O_PATH)
+                dir_fd = ::open(dir_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+                dir_fd = ::open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+            }
+            for (size_t i = begin; i < end; ++i) {
+                auto& result = results[items[i].index];
+                if (dir_fd == -1) {
+                    // Full paths give every entry its own error
+                    result.error = stat_at(AT_FDCWD, items[i].dir.data(),
+                        options.fields, options.sync, options.follow_symlinks, &result.status);
+                } else {
+                    result.error = stat_at(dir_fd, items[i].name,
+                        options.fields, options.sync, options.follow_symlinks, &result.status);
+                }
+            }
+            if (dir_fd >= 0) {
+                ::close(dir_fd);
+            }
+        }
+    }
 };
 
-class PathImplWin32 : public WinPath {
+} // namespace priv {
+
+// Metadata of many paths at once, in input order. Failures are reported
+// per path in StatResult::error instead of exceptions.
+std::vector<StatResult> stat_many(const Path* paths, size_t count, const StatManyOptions& options = StatManyOptions{}) {
+    return priv::StatManyImplUnix::run(paths, count, options);
+}
+
+std::vector<StatResult> stat_many(const std::vector<Path>& paths, const StatManyOptions& options = StatManyOptions{}) {
+    return stat_many(paths.data(), paths.size(), options);
+}
+#endif
+
+bool is_abspath(const String& path) {
+    return Path::is_abspath(path);
+}
+
+Path cwd() {
+    return Path::cwd();
+}
+
+Path cd(const Path& path) {
+    throw NotImplementedException();
+    // return Path::cd(path);
+}
+
+Path tmp_dir() {
+    return Path::tmp_dir();
+}
+
+Path user_dir() {
+    throw NotImplementedException();
+    // return Path::user_dir();
+}
+
+template<typename ... Types>
+String join(Types... args) {
+    return Path::join(args...).str();
+}
+
+namespace priv {
+
+// Append-only array of segments growing twice each: segment s keeps
+// (1 << BaseBits) << s elements. Segments are allocated on first use
+// by any thread and never move, so elements can be read concurrently
+// with writes to other elements.
+template <typename T, unsigned BaseBits>
+class SegmentedArray {
 public:
-    using Self = PathImplWin32;
-
-    PathImplWin32() {}
+    static const unsigned MaxSegments = 64 - BaseBits;
 
-    PathImplWin32(const String& path)
-    : WinPath{path} {
+    SegmentedArray() {
+        for (auto& segment : segments_) {
+            segment.store(nullptr, std::memory_order_relaxed);
+        }
     }
 
-    PathImplWin32(const char* path)
-    : WinPath{path} {
-    }
+    SegmentedArray(const SegmentedArray&) = delete;
+    SegmentedArray& operator = (const SegmentedArray&) = delete;
 
-    template<typename ... Types>
-    PathImplWin32(Types... args)
-    : WinPath{args...} {
+    ~SegmentedArray() {
+        for (auto& segment : segments_) {
+            delete[] segment.load(std::memory_order_relaxed);
+        }
     }
-    
 
-    PathImplWin32 abspath() const {
-        return Self{Self::cwd(), str()};
+    static unsigned segment_of(uint64_t index) {
+        return highest_bit((index >> BaseBits) + 1);
     }
 
-    const PathImplWin32& mkdir() const {
-        return PathImplWin32::mkdir(*this);
+    static uint64_t segment_begin(unsigned segment) {
+        return ((uint64_t(1) << segment) - 1) << BaseBits;
     }
 
-    static const PathImplWin32& mkdir(const PathImplWin32& path) {
-        WINCHECK(CreateDirectory(path.c_str(), NULL),
-            RuntimeError, "CreateDirectory failed");
-        return path;
+    static uint64_t segment_size(unsigned segment) {
+        return uint64_t(1) << (BaseBits + segment);
     }
 
-    static const PathImplWin32& mkdir_if_not_exists(const PathImplWin32& path) {
-        const auto res = CreateDirectory(path.c_str(), NULL);
-        if (!res) {
-            auto const error = GetLastError();
-            if (error != 0 && error != ERROR_ALREADY_EXISTS) {
-                WINERROR(error, RuntimeError, "CreateDirectory failed");
+    // Allocates the segment of index if needed
+    T* at(uint64_t index) {
+        const unsigned segment = segment_of(index);
+        T* data = segments_[segment].load(std::memory_order_acquire);
+        if (!data) {
+            T* fresh = new T[segment_size(segment)]();
+            if (segments_[segment].compare_exchange_strong(data, fresh, std::memory_order_acq_rel)) {
+                data = fresh;
+            } else {
+                delete[] fresh;
             }
         }
-        return path;
+        return data + (index - segment_begin(segment));
     }
 
-    const PathImplWin32& mkdir_if_not_exists() const {
-        return PathImplWin32::mkdir_if_not_exists(*this);
+    // Element of an index returned by at() before
+    const T* get(uint64_t index) const {
+        const unsigned segment = segment_of(index);
+        return segments_[segment].load(std::memory_order_acquire) + (index - segment_begin(segment));
     }
 
-    static const PathImplWin32& mkdir_parents(const PathImplWin32& path) {
-        PathImplWin32 cur_path;
-        for (auto dir : path.split()) {
-            cur_path = join(cur_path, dir);
-            if (!cur_path.exists()) {
-                cur_path.mkdir();
+    size_t memory_usage() const {
+        size_t res = 0;
+        for (unsigned i = 0; i < MaxSegments; ++i) {
+            if (segments_[i].load(std::memory_order_relaxed)) {
+                res += segment_size(i) * sizeof(T);
             }
         }
-        return path;
+        return res;
     }
 
-    const PathImplWin32& mkdir_parents() const {
-        return PathImplWin32::mkdir_parents(*this);
-    }
+private:
+    std::atomic<T*> segments_[MaxSegments];
+};
 
-    static const PathImplWin32& rmrf_if_exists(const PathImplWin32& path) {
-        if (path.exists()) {
-            return path.rmrf();
+} // namespace priv {
+
+// Set of paths stored as a tree: every path is a 32-bit id of a
+// (parent id, component id) pair and every distinct component name is
+// kept once. Equal paths get equal ids, so paths compare by id. Paths
+// are split into components on insertion, which makes "a//b/" and "a/b"
+// the same path.
+//
+// Inserts and lookups are lock-free and may run concurrently from many
+// threads, e.g. from a parallel_walk visitor. Hash tables don't grow,
+// expected_paths sets their number of chains once. Past it chains get
+// longer by one node per expected_paths paths, so a table holding 100x
+// its expected size inserts and finds about 100x slower.
+class PathTable {
+public:
+    typedef uint32_t Id;
+
+    enum : Id {
+        Root = 0, // Empty path, parent of everything
+        Invalid = 0xffffffff,
+    };
+
+    explicit PathTable(size_t expected_paths)
+    :   serial_(next_serial()),
+        node_buckets_(buckets_for(expected_paths)),
+        component_buckets_(buckets_for(expected_paths / 4)) {
+        for (auto& bucket : node_buckets_) {
+            bucket.store(Invalid, std::memory_order_relaxed);
         }
-        return path;
+        for (auto& bucket : component_buckets_) {
+            bucket.store(Invalid, std::memory_order_relaxed);
+        }
+        const Id root = nodes_count_.fetch_add(1);
+        Node& node = *nodes_.at(root);
+        node.parent = Invalid;
+        node.component = Invalid;
+        node.next = Invalid;
+        size_.store(1, std::memory_order_relaxed);
     }
 
-    const PathImplWin32& rmrf_if_exists() const {
-        return Self::rmrf_if_exists(*this);
+    PathTable(const PathTable&) = delete;
+    PathTable& operator = (const PathTable&) = delete;
+
+    // Id of the child named component of parent, adds it if needed
+    Id insert(Id parent, PathView component) {
+        const Id component_id = intern(component);
+        std::atomic<Id>& head = node_buckets_[node_hash(parent, component_id) & (node_buckets_.size() - 1)];
+        Id first = head.load(std::memory_order_acquire);
+        Id stop = Invalid;
+        Id created = Invalid;
+        for (;;) {
+            const Id found = find_node(first, stop, parent, component_id);
+            if (found != Invalid) {
+                if (created != Invalid) {
+                    spare().node = created;
+                }
+                return found;
+            }
+            if (created == Invalid) {
+                Spare& spare_ids = spare();
+                created = spare_ids.node != Invalid? spare_ids.node : new_id(nodes_count_);
+                spare_ids.node = Invalid;
+                Node& node = *nodes_.at(created);
+                node.parent = parent;
+                node.component = component_id;
+            }
+            nodes_.at(created)->next = first;
+            Id expected = first;
+            if (head.compare_exchange_weak(expected, created, std::memory_order_release, std::memory_order_acquire)) {
+                size_.fetch_add(1, std::memory_order_relaxed);
+                return created;
+            }
+            // Only nodes inserted since the last look need checking
+            stop = first;
+            first = expected;
+        }
     }
 
-    static const PathImplWin32& rm(const PathImplWin32& path) {
-       if (path.is_directory()) {
-           path.rm_directory();
-       } else {
-           path.rm_file();
-       }
- 
-       return path;
+    Id insert(PathView path) {
+        Id id = Root;
+        for (const PathView component : path) {
+            id = insert(id, component);
+        }
+        return id;
     }
 
-    const PathImplWin32& rm() const {
-        return Self::rm(*this);
+    // Id of the child named component of parent or Invalid
+    Id find(Id parent, PathView component) const {
+        const Id component_id = find_component(component);
+        if (component_id == Invalid) {
+            return Invalid;
+        }
+        const auto& head = node_buckets_[node_hash(parent, component_id) & (node_buckets_.size() - 1)];
+        return find_node(head.load(std::memory_order_acquire), Invalid, parent, component_id);
     }
 
-    static const PathImplWin32& rm_directory(const PathImplWin32& path) {
-        RemoveDirectory(path.c_str()); // FIXME
-        return path;
+    Id find(PathView path) const {
+        Id id = Root;
+        for (const PathView component : path) {
+            id = find(id, component);
+            if (id == Invalid) {
+                break;
+            }
+        }
+        return id;
     }
 
-    const PathImplWin32& rm_directory() const {
-        return Self::rm_directory(*this);
+    Id parent(Id id) const {
+        return nodes_.get(id)->parent;
     }
 
-    static const PathImplWin32& rm_file(const PathImplWin32& path) {
-        DeleteFile(path.c_str()); // FIXME
-        return path;
+    // Last component of the path, empty for Root
+    PathView name(Id id) const {
+        const Node& node = *nodes_.get(id);
+        if (node.component == Invalid) {
+            return PathView{};
+        }
+        const Component& component = *components_.get(node.component);
+        return PathView{chars_.get(component.offset), component.size};
     }
 
-    const PathImplWin32& rm_file() const {
-        return Self::rm_file(*this);
+    // Number of components, 0 for Root
+    size_t depth(Id id) const {
+        size_t res = 0;
+        for (; id != Root; id = parent(id)) {
+            ++res;
+        }
+        return res;
     }
 
-    static const PathImplWin32& rmrf(const PathImplWin32& path) {
-        FileIterImplWin32 iter{path.str()};
-        while (!iter.is_end()) {
-            if (iter.is_directory()) {
-                Self{iter.path()}.rmrf();
-            }
-            else {
-                Self{iter.path()}.rm();
+    Path path(Id id) const {
+        Id chain[MaxDepth];
+        size_t depth = 0;
+        std::vector<Id> deep;
+        for (; id != Root; id = parent(id)) {
+            if (depth < MaxDepth) {
+                chain[depth++] = id;
+            } else {
+                deep.push_back(id);
             }
-            ++iter;
         }
-        path.rm();
-        return path;
+        Path res;
+        for (auto i = deep.rbegin(); i != deep.rend(); ++i) {
+            res.append(name(*i));
+        }
+        while (depth > 0) {
+            res.append(name(chain[--depth]));
+        }
+        return res;
     }
 
-    const PathImplWin32& rmrf() const {
-        return Self::rmrf(*this);
+    // Number of paths including Root
+    size_t size() const {
+        return size_.load(std::memory_order_relaxed);
     }
 
-    static PathImplWin32 tmp_dir() {
-        static Self tmp = tmp_dir_impl();
-        return tmp;
+    size_t memory_usage() const {
+        return sizeof(*this) +
+            node_buckets_.size() * sizeof(std::atomic<Id>) +
+            component_buckets_.size() * sizeof(std::atomic<Id>) +
+            nodes_.memory_usage() + components_.memory_usage() + chars_.memory_usage();
     }
 
-    static PathImplWin32 cwd() {
-        TCHAR buffer[MAX_PATH + 1];
-        WINCHECK(GetCurrentDirectory(sizeof(buffer), buffer),
-            RuntimeError, "cwd fail");
-        return Self{buffer};
+private:
+    static const size_t MaxDepth = 64;
+
+    struct Node {
+        Id parent;
+        Id component;
+        Id next; // In the hash chain
+    };
+
+    struct Component {
+        uint64_t offset; // In chars_
+        uint32_t size;
+        Id next; // In the hash chain
+    };
+
+    // Ids made by a thread which then lost the race to publish them. The
+    // thread's next insert into the same table takes them back. Ids of
+    // tables beyond the last MaxSpareTables a thread used are dropped.
+    struct Spare {
+        uint64_t table = 0;
+        Id node = Invalid;
+        Id component = Invalid;
+    };
+
+    static const size_t MaxSpareTables = 8;
+
+    static uint64_t next_serial() {
+        static std::atomic<uint64_t> serial{0};
+        return serial.fetch_add(1) + 1;
     }
 
-    std::vector<String> split() const {
-        return crefile::split(str());
-    }
-    
-    bool exists() const {
-        return PathImplWin32::exists(*this);
+    Spare& spare() {
+        static thread_local std::vector<Spare> spares;
+        for (auto& spare : spares) {
+            if (spare.table == serial_) {
+                return spare;
+            }
+        }
+        if (spares.size() >= MaxSpareTables) {
+            spares.erase(spares.begin());
+        }
+        spares.emplace_back();
+        spares.back().table = serial_;
+        return spares.back();
     }
 
-    static bool exists(const PathImplWin32& path) {
-        WIN32_FIND_DATA file_data;
-        HANDLE handle = FindFirstFile(path.c_str(), &file_data);
-        bool found = (handle != INVALID_HANDLE_VALUE);
-        if (found) {
-            FindClose(handle);
+    static size_t buckets_for(size_t expected) {
+        size_t res = 1024;
+        while (res < expected) {
+            res *= 2;
         }
-        return found;
-    }
-  
-private:
-    static PathImplWin32 tmp_dir_impl() {
-        TCHAR buffer[MAX_PATH + 1];
-        WINCHECK(GetCurrentDirectory(sizeof(buffer), buffer),
-            RuntimeError, "tmp_dir_impl fail");
-        return Self{buffer};
+        return res;
     }
-};
-
-
-typedef PathImplWin32 Path;
-typedef FileInfoImplWin32 FileInfo;
-typedef FileIterImplWin32 FileIter;
-
-//PathImplWin32 get_tmp_path() {
-//    char tmp_path[MAX_PATH + 1];
-//    WINCHECK(GetTempPath(sizeof(tmp_path) - 1, tmp_path),
-//        std::runtime_error, "GetTempPath failed");
-//    return PathImplWin32{tmp_path};
-//}
-
-PathImplWin32 generate_tmp_filename(const PathImplWin32& path, const String& file_prefix) {
-    char tmp[MAX_PATH + 1];
-    WINCHECK(GetTempFileName(path.c_str(), file_prefix.c_str(), 0, tmp),
-        std::runtime_error, "generate_tmp_filename failed");
-    return PathImplWin32{tmp};
-}
-
-#undef WINCHECK
-#undef WINERROR
 
-#endif // #if CREFILE_PLATFORM == CREFILE_PLATFORM_WIN32
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
 
-#if CREFILE_PLATFORM == CREFILE_PLATFORM_UNIX || CREFILE_PLATFORM == CREFILE_PLATFORM_DARWIN
+    static uint64_t node_hash(Id parent, Id component) {
+        return mix((uint64_t(parent) << 32) | component);
+    }
 
-void check_error(ErrorCode code) {
-    if (code != 0) {
-        const auto error = errno;
-        switch (error) {
-            case EPERM:
-            case EACCES:
-                throw NoPermissionException{error};
-            case ENOENT:
-                throw NoSuchFileException{error};
-            case EEXIST:
-                throw FileExistsException{error};
-            case ENOTDIR:
-                throw NotDirectoryException{error};
-            default:
-                throw UnknownErrorException{error};
+    static uint64_t component_hash(PathView name) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < name.size(); ++i) {
+            h = (h ^ static_cast<unsigned char>(name.data()[i])) * 0x100000001b3ULL;
         }
+        return mix(h);
     }
-}
 
-class FileInfoImplUnix {
-private:
-    void valid() const {
-        if (is_end()) {
-            throw RuntimeError("Can't get info from invalid file!");
+    static Id new_id(std::atomic<uint64_t>& count) {
+        const uint64_t id = count.fetch_add(1, std::memory_order_relaxed);
+        if (id >= Invalid) {
+            throw RuntimeError("PathTable is full");
         }
+        return static_cast<Id>(id);
     }
 
-    struct stat* get_stat() const {
-        valid();
-        if (!stat_) {
-            stat_ = std::make_shared<struct stat>();
-            const auto path = PosixPath(from_dir_, entry_->d_name);
-            const auto res = lstat(path.c_str(), stat_.get());
-            check_error(res);
+    Id find_node(Id first, Id stop, Id parent, Id component) const {
+        for (Id i = first; i != stop; ) {
+            const Node& node = *nodes_.get(i);
+            if (node.parent == parent && node.component == component) {
+                return i;
+            }
+            i = node.next;
         }
-        return stat_.get();
+        return Invalid;
     }
 
-public:
-    FileInfoImplUnix() = default;
-
-    FileInfoImplUnix(dirent* entry, PosixPath from_dir)
-    :   entry_(entry),
-        from_dir_(from_dir) {
+    Id find_component_in(Id first, Id stop, PathView name) const {
+        for (Id i = first; i != stop; ) {
+            const Component& component = *components_.get(i);
+            if (component.size == name.size() &&
+                    std::memcmp(chars_.get(component.offset), name.data(), name.size()) == 0) {
+                return i;
+            }
+            i = component.next;
+        }
+        return Invalid;
     }
 
-    dirent* native_ptr_impl() { return entry_; }
-    const dirent* native_ptr_impl() const { return entry_; }
-
-    String name() const {
-        if (is_end()) {
-            return String{};
-        } else {
-            return String{entry_->d_name};
-        }
+    Id find_component(PathView name) const {
+        const auto& head = component_buckets_[component_hash(name) & (component_buckets_.size() - 1)];
+        return find_component_in(head.load(std::memory_order_acquire), Invalid, name);
     }
 
-    bool is_directory() const {
-        struct stat* st = get_stat();
-        return S_ISDIR(stat_->st_mode);
+    // Reserves characters that don't cross a segment border
+    uint64_t store_chars(PathView name) {
+        for (;;) {
+            const uint64_t offset = chars_count_.fetch_add(name.size(), std::memory_order_relaxed);
+            const unsigned segment = CharArray::segment_of(offset);
+            if (offset + name.size() <= CharArray::segment_begin(segment) + CharArray::segment_size(segment)) {
+                std::memcpy(chars_.at(offset), name.data(), name.size());
+                return offset;
+            }
+        }
     }
 
-    bool is_end() const {
-        return entry_ == nullptr;
+    Id intern(PathView name) {
+        std::atomic<Id>& head = component_buckets_[component_hash(name) & (component_buckets_.size() - 1)];
+        Id first = head.load(std::memory_order_acquire);
+        Id stop = Invalid;
+        Id created = Invalid;
+        for (;;) {
+            const Id found = find_component_in(first, stop, name);
+            if (found != Invalid) {
+                if (created != Invalid) {
+                    spare().component = created;
+                }
+                return found;
+            }
+            if (created == Invalid) {
+                Spare& spare_ids = spare();
+                created = spare_ids.component;
+                spare_ids.component = Invalid;
+                // Characters of a spare component are reused if the name fits
+                if (created != Invalid && name.size() <= components_.at(created)->size) {
+                    std::memcpy(chars_.at(components_.at(created)->offset), name.data(), name.size());
+                } else {
+                    if (created == Invalid) {
+                        created = new_id(components_count_);
+                    }
+                    components_.at(created)->offset = store_chars(name);
+                }
+                components_.at(created)->size = static_cast<uint32_t>(name.size());
+            }
+            components_.at(created)->next = first;
+            Id expected = first;
+            if (head.compare_exchange_weak(expected, created, std::memory_order_release, std::memory_order_acquire)) {
+                return created;
+            }
+            stop = first;
+            first = expected;
+        }
     }
 
-private:
-    struct dirent* entry_ = nullptr;
-    mutable std::shared_ptr<struct stat> stat_;
+    typedef priv::SegmentedArray<char, 16> CharArray;
+
+    const uint64_t serial_; // Tells tables apart in the spare ids of threads
+    std::vector<std::atomic<Id>> node_buckets_;
+    std::vector<std::atomic<Id>> component_buckets_;
+    priv::SegmentedArray<Node, 12> nodes_;
+    priv::SegmentedArray<Component, 10> components_;
+    CharArray chars_;
+    std::atomic<uint64_t> nodes_count_{0};
+    std::atomic<uint64_t> components_count_{0};
+    std::atomic<uint64_t> chars_count_{0};
+    std::atomic<size_t> size_{0};
+};
 
-    PosixPath from_dir_;
+#if CREFILE_PLATFORM == CREFILE_PLATFORM_UNIX || CREFILE_PLATFORM == CREFILE_PLATFORM_DARWIN
+struct WatchEvent {
+    enum Type : unsigned {
+        Created = 1 << 0,
+        Deleted = 1 << 1,
+        Modified = 1 << 2,
+        Overflow = 1 << 3, // The kernel dropped events, rescan the tree
+    };
+
+    Path path;
+    unsigned types = 0; // Every Type seen for the path since the last report
+    bool is_directory = false;
 };
 
-class FileIterImplUnix {
-private:
-    void next() {
-        do {
-            auto dir_entry = ::readdir(dir_);
-            dir_entry_ = FileInfoImplUnix{dir_entry, dir_path_};
-        }
-        while (dir_entry_.name() == "." || dir_entry_.name() == "..");
-    }
+// Watches a tree by comparing it with a snapshot of (inode, size, mtime)
+// of every entry, for filesystems where inotify doesn't work (network and
+// overlay mounts). A poll stats every known directory and lists again only
+// those whose own mtime changed. Writes into existing files don't touch
+// the directory, check_files stats the files of unchanged directories too.
+struct PollWatcherOptions {
+    bool check_files = false;
+    size_t expected_paths = 64 * 1024; // Sizes the path table
+};
 
+class PollWatcher {
 public:
-    FileIterImplUnix() {
+    explicit PollWatcher(const Path& root, const PollWatcherOptions& options = PollWatcherOptions{})
+    :   root_(root),
+        options_(options),
+        table_(new PathTable{options.expected_paths}) {
+        FileStatus status;
+        const auto error = priv::stat_at(AT_FDCWD, root_.c_str(), DirFields, StatSync::Default, true, &status);
+        errno = error;
+        check_error(error == 0? 0 : -1);
+        std::vector<WatchEvent> events;
+        scan(PathTable::Root, root_, status, false, events);
     }
 
-    ~FileIterImplUnix() {
-        if (dir_) {
-            closedir(dir_);
+    // Changes since the previous poll, directories first reported before their contents
+    std::vector<WatchEvent> poll() {
+        std::vector<WatchEvent> events;
+        std::vector<std::pair<PathTable::Id, FileStatus>> changed;
+        for (auto& dir : dirs_) {
+            const Path path = dir_path(dir.first);
+            FileStatus status;
+            if (priv::stat_at(AT_FDCWD, path.c_str(), DirFields, StatSync::Default, true, &status) != 0) {
+                continue; // Gone, the parent's listing reports it
+            }
+            if (dir.second.racy || status.mtime != dir.second.mtime || status.inode != dir.second.inode) {
+                changed.emplace_back(dir.first, status);
+            } else if (options_.check_files) {
+                check_files(dir.first, path, events);
+            }
+        }
+        for (const auto& dir : changed) {
+            // Removed meanwhile together with a parent listed before
+            if (dirs_.count(dir.first)) {
+                scan(dir.first, dir_path(dir.first), dir.second, true, events);
+            }
+        }
+        if (table_->size() > 2 * size_ + MinCompactedPaths) {
+            compact();
         }
+        return events;
     }
 
-    FileIterImplUnix(const char* path)
-        : dir_path_(path) {
-        dir_ = ::opendir(path);
-        next();
+    // Entries in the snapshot, the root included
+    size_t size() const {
+        return size_;
     }
 
-    FileIterImplUnix(const String& path)
-        : FileIterImplUnix(path.c_str()) {
-
+    size_t memory_usage() const {
+        size_t children = 0;
+        for (const auto& dir : dirs_) {
+            children += dir.second.children.capacity() * sizeof(PathTable::Id) + sizeof(dir);
+        }
+        return sizeof(*this) + table_->memory_usage() + entries_.capacity() * sizeof(Entry) + children;
     }
 
-    FileIterImplUnix(const PosixPath& path)
-        : FileIterImplUnix(path.c_str()) {
-
+private:
+    static const unsigned DirFields = StatFields::Type | StatFields::Inode | StatFields::Mtime;
+    static const unsigned EntryFields = StatFields::Type | StatFields::Inode | StatFields::Size | StatFields::Mtime;
+    static const size_t MinCompactedPaths = 1024;
+
+    struct Entry {
+        uint64_t inode = 0;
+        uint64_t size = 0;
+        FileTime mtime;
+        uint32_t seen = 0; // Listing that saw it last
+        unsigned char type = DT_UNKNOWN;
+        bool present = false;
+    };
+
+    struct Dir {
+        uint64_t inode = 0;
+        FileTime mtime;
+        bool racy = false; // Changed too recently to trust its mtime
+        std::vector<PathTable::Id> children;
+    };
+
+    Entry& entry(PathTable::Id id) {
+        if (id >= entries_.size()) {
+            entries_.resize(std::max<size_t>(id + 1, entries_.size() * 2));
+        }
+        return entries_[id];
     }
 
-    bool is_end() const {
-        if (!dir_) {
-            throw RuntimeError("Called is_end() for non-initialized iterator");
+    Path dir_path(PathTable::Id dir) const {
+        if (dir == PathTable::Root) {
+            return root_;
         }
-        return dir_entry_.is_end();
+        return Path{root_, table_->path(dir)};
     }
 
-    bool is_directory() const {
-        return dir_entry_.is_directory();
+    void report(std::vector<WatchEvent>& events, Path path, unsigned types, bool is_directory) {
+        events.emplace_back();
+        events.back().path = std::move(path);
+        events.back().types = types;
+        events.back().is_directory = is_directory;
     }
 
-    const PosixPath& dir_path() const {
-        return dir_path_;
+    static bool same(const Entry& entry, const FileStatus& status) {
+        return entry.inode == status.inode && entry.size == status.size && entry.mtime == status.mtime;
     }
 
-    PosixPath path() const {
-        if (!dir_) {
-            throw RuntimeError("Called path() for non-initialized iterator");
-        }
-        return PosixPath{dir_path_, dir_entry_.name()};
+    static void remember(Entry& entry, const FileStatus& status) {
+        entry.inode = status.inode;
+        entry.size = status.size;
+        entry.mtime = status.mtime;
+        entry.type = priv::mode_to_dirent_type(status.mode);
+        entry.present = true;
     }
 
-    bool operator == (const FileIterImplUnix& other) const {
-        return dir_entry_.is_end() && other.dir_entry_.is_end();
+    // Lists dir and compares it with the snapshot. New subdirectories are
+    // scanned whole, vanished entries are reported with their subtrees.
+    void scan(PathTable::Id dir, const Path& path, const FileStatus& dir_status, bool report_changes, std::vector<WatchEvent>& events) {
+        auto& state = dirs_[dir];
+        state.inode = dir_status.inode;
+        state.mtime = dir_status.mtime;
+        // Coarse timestamps can't tell changes made within the same tick apart
+        state.racy = std::chrono::system_clock::now() - dir_status.mtime < std::chrono::seconds{2};
+        const uint32_t listing = ++listings_;
+
+        std::vector<PathTable::Id> children;
+        std::vector<std::pair<PathTable::Id, FileStatus>> new_dirs;
+        try {
+            for (FileIterImplUnix iter{path}; !iter.is_end(); ++iter) {
+                const auto& info = *iter;
+                FileStatus status;
+                const int error = priv::stat_at(iter.dir_fd(), info.name_c_str(), EntryFields, StatSync::Default, false, &status);
+                if (error == ENOENT) {
+                    continue; // Removed while listing
+                }
+                if (error != 0) {
+                    // Can't tell what changed, keep what is known
+                    const PathTable::Id id = table_->find(dir, info.name_c_str());
+                    if (id != PathTable::Invalid && id < entries_.size() && entries_[id].present) {
+                        children.push_back(id);
+                        entries_[id].seen = listing;
+                    }
+                    continue;
+                }
+                const PathTable::Id id = table_->insert(dir, info.name_c_str());
+                Entry& known = entry(id);
+                const unsigned char type = priv::mode_to_dirent_type(status.mode);
+                children.push_back(id);
+                if (known.present && known.type != type) {
+                    forget(id, report_changes, events);
+                }
+                if (!known.present) {
+                    ++size_;
+                    if (report_changes) {
+                        report(events, Path{path, info.name_c_str()}, WatchEvent::Created, type == DT_DIR);
+                    }
+                    if (type == DT_DIR) {
+                        new_dirs.emplace_back(id, status);
+                    }
+                } else if (!same(known, status) && type != DT_DIR && report_changes) {
+                    report(events, Path{path, info.name_c_str()}, WatchEvent::Modified, false);
+                }
+                remember(known, status);
+                known.seen = listing;
+            }
+        } catch (const NoSuchFileException&) {
+        } catch (const NotDirectoryException&) {
+        }
+
+        for (const PathTable::Id child : state.children) {
+            if (entries_[child].seen != listing && entries_[child].present) {
+                forget(child, report_changes, events);
+            }
+        }
+        dirs_[dir].children = std::move(children);
+        for (const auto& new_dir : new_dirs) {
+            scan(new_dir.first, Path{path, table_->name(new_dir.first)}, new_dir.second, report_changes, events);
+        }
     }
 
-    bool operator != (const FileIterImplUnix& other) const {
-        return !(*this == other);
+    // Drops id and its subtree from the snapshot
+    void forget(PathTable::Id id, bool report_changes, std::vector<WatchEvent>& events) {
+        Entry& known = entries_[id];
+        const bool is_directory = known.type == DT_DIR;
+        if (report_changes) {
+            report(events, dir_path(id), WatchEvent::Deleted, is_directory);
+        }
+        known.present = false;
+        --size_;
+        const auto found = dirs_.find(id);
+        if (found != dirs_.end()) {
+            const auto children = std::move(found->second.children);
+            dirs_.erase(found);
+            for (const PathTable::Id child : children) {
+                if (entries_[child].present) {
+                    forget(child, report_changes, events);
+                }
+            }
+        }
     }
 
-    FileIterImplUnix& operator ++() {
-        if (!dir_) {
-            throw RuntimeError("Called next file for non-initialized iterator");
+    // Names of removed entries stay in the table. Once they outnumber the
+    // present ones the table is built again from the present entries only,
+    // which takes time in proportion to the removed ones.
+    void compact() {
+        std::unique_ptr<PathTable> table{new PathTable{std::max(options_.expected_paths, size_)}};
+        std::vector<Entry> entries(1);
+        entries.reserve(size_);
+        std::unordered_map<PathTable::Id, Dir> dirs;
+        std::vector<std::pair<PathTable::Id, PathTable::Id>> stack{{PathTable::Root, PathTable::Root}};
+        while (!stack.empty()) {
+            const auto ids = stack.back();
+            stack.pop_back();
+            const auto found = dirs_.find(ids.first);
+            if (found == dirs_.end()) {
+                continue;
+            }
+            Dir& dir = dirs[ids.second];
+            dir = std::move(found->second);
+            for (PathTable::Id& child : dir.children) {
+                const PathTable::Id id = table->insert(ids.second, table_->name(child));
+                if (id >= entries.size()) {
+                    entries.resize(id + 1);
+                }
+                entries[id] = entries_[child];
+                stack.emplace_back(child, id);
+                child = id;
+            }
         }
-        next();
-        return *this;
+        table_ = std::move(table);
+        entries_ = std::move(entries);
+        dirs_ = std::move(dirs);
     }
 
-    const FileInfoImplUnix& operator *() const {
-        return dir_entry_;
+    // Finds writes into files of a directory which entries didn't change
+    void check_files(PathTable::Id dir, const Path& path, std::vector<WatchEvent>& events) {
+#if defined(O_PATH)
+        const int fd = ::open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+        if (fd < 0) {
+            return;
+        }
+        String name;
+        for (const PathTable::Id child : dirs_[dir].children) {
+            Entry& known = entries_[child];
+            if (known.type == DT_DIR) {
+                continue;
+            }
+            const PathView child_name = table_->name(child);
+            name.assign(child_name.data(), child_name.size());
+            FileStatus status;
+            if (priv::stat_at(fd, name.c_str(), EntryFields, StatSync::Default, false, &status) == 0 && !same(known, status)) {
+                report(events, Path{path, name}, WatchEvent::Modified, false);
+                remember(known, status);
+            }
+        }
+        ::close(fd);
     }
 
-private:
-    PosixPath dir_path_;
-    DIR* dir_ = nullptr;
-    FileInfoImplUnix dir_entry_;
+    const Path root_;
+    const PollWatcherOptions options_;
+    std::unique_ptr<PathTable> table_; // Rebuilt by compact()
+    std::vector<Entry> entries_; // Indexed by table id
+    std::unordered_map<PathTable::Id, Dir> dirs_;
+    uint32_t listings_ = 0;
+    size_t size_ = 1;
 };
 
-typedef FileInfoImplUnix FileInfo;
-typedef FileIterImplUnix FileIter;
+namespace priv {
+class SnapshotCaptureImpl;
+class SnapshotDiffImpl;
+} // namespace priv {
 
-class PathImplUnix : public PosixPath {
+struct SnapshotOptions {
+    size_t n_threads = 1; // Hardware concurrency for 0
+};
+
+// Metadata of a whole tree, flat and sorted: entries are in depth-first
+// order with siblings sorted by name, so two snapshots diff with a linear
+// merge. An entry keeps its name and depth instead of the full path.
+class Snapshot {
 public:
-    using Self = PathImplUnix;
+    struct Entry {
+        uint64_t inode;
+        uint64_t size;
+        FileTime mtime;
+        uint32_t name; // Offset in the name buffer
+        uint32_t end; // Index after the entry's subtree
+        uint32_t mode;
+        uint16_t name_size;
+        uint16_t depth; // 0 for entries right inside the root
 
-    PathImplUnix() = default;
+        bool is_directory() const { return S_ISDIR(mode); }
+    };
 
-    PathImplUnix(String path)
-    :   PosixPath{path} {
-    }
+    Snapshot() = default;
 
-    PathImplUnix(PosixPath path)
-    :   PosixPath{std::move(path)} {
-    }
+    Snapshot(Snapshot&&) = default;
+    Snapshot& operator = (Snapshot&&) = default;
 
-    PathImplUnix(const char* path)
-    :   PosixPath{path} {
-    }
+    // Directories are listed concurrently with n_threads workers
+    static Snapshot capture(const Path& root, const SnapshotOptions& options = SnapshotOptions{});
 
-    template<typename ... Types>
-    PathImplUnix(Types... args)
-    :   PosixPath{args...} {
-    }
+    const Path& root() const { return root_; }
 
-    const char* path_to_host() const {
-        return Self::path_to_host(*this);
-    }
+    size_t size() const { return entries_.size(); }
 
-    static const char* path_to_host(const PathImplUnix& path) {
-        return path.c_str();
+    const Entry& entry(size_t i) const { return entries_[i]; }
+
+    PathView name(size_t i) const {
+        return PathView{names_.data() + entries_[i].name, entries_[i].name_size};
     }
 
-    static PathImplUnix tmp_dir() {
-        static const char* tmp_path = getenv("TMPDIR");
-        static Self tmp;
-        if (tmp_path) {
-            tmp = tmp_path;
-        } else {
-            tmp = "/tmp";
-            // HACK FOR UNIX? FIXME
-            //throw RuntimeError("No TMPDIR in env");
+    // Calls visitor(relative_path, entry) for every entry in order
+    template <typename Visitor>
+    void for_each(Visitor&& visitor) const {
+        String path;
+        std::vector<size_t> ends; // Path size up to every depth
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            const Entry& entry = entries_[i];
+            const size_t base = entry.depth == 0? 0 : ends[entry.depth - 1];
+            path.resize(base);
+            if (base != 0) {
+                path += '/';
+            }
+            path.append(names_.data() + entry.name, entry.name_size);
+            ends.resize(entry.depth + 1);
+            ends[entry.depth] = path.size();
+            visitor(PathView{path}, entry);
         }
-
-        return tmp;
     }
 
-    static const PathImplUnix cwd() {
-        char buf[2000]; // FIXME: Handle bigger size and error
-        const auto res = ::getcwd(buf, sizeof(buf));
-        //check_error(res);
-        return Self{res};
+    size_t memory_usage() const {
+        return sizeof(*this) + entries_.capacity() * sizeof(Entry) + names_.capacity();
     }
 
-    PathImplUnix abspath() const {
-        return Self::abspath(*this);
-    }
+private:
+    friend class priv::SnapshotCaptureImpl;
+    friend class priv::SnapshotDiffImpl;
 
-    static PathImplUnix abspath(const PathImplUnix& path) {
-        return Self{cwd(), path};
-    }
+    Path root_;
+    std::vector<Entry> entries_;
+    String names_;
+};
 
-    const PathImplUnix& mkdir() const {
-        return Self::mkdir(*this);
-    }
+namespace priv {
 
-    static const PathImplUnix& mkdir(const PathImplUnix& path) {
-        const auto res = ::mkdir(path_to_host(path), 0777);
-        check_error(res);
-        return path;
-    }
+// Listing tasks build a tree of sorted directories, which is then laid
+// out depth-first into the snapshot
+class SnapshotCaptureImpl {
+private:
+    // Entries of one directory sorted by name, with their names packed in
+    // one buffer. Depth and end are filled in when laid out.
+    struct Listing {
+        std::vector<Snapshot::Entry> entries;
+        String names;
+        std::vector<std::unique_ptr<Listing>> dirs; // One per directory entry, in order
+    };
+
+    // Sizes of all listings, to lay them out without growing the snapshot
+    struct Totals {
+        std::atomic<size_t> entries{0};
+        std::atomic<size_t> names{0};
+    };
+
+    static const unsigned Fields = StatFields::Type | StatFields::Mode | StatFields::Inode | StatFields::Size | StatFields::Mtime;
 
-    static const PathImplUnix& mkdir_if_not_exists(const PathImplUnix& path) {
-        if (!path.exists()) {
-            path.mkdir();
+public:
+    static Snapshot run(const Path& root, const SnapshotOptions& options) {
+        FileStatus status;
+        errno = stat_at(AT_FDCWD, root.c_str(), StatFields::Type, StatSync::Default, true, &status);
+        check_error(errno == 0? 0 : -1);
+        if (!status.is_directory()) {
+            errno = ENOTDIR;
+            check_error(-1);
         }
-        return path;
+
+        Listing tree;
+        Totals totals;
+        if (options.n_threads == 1) {
+            list(nullptr, root, tree, totals);
+        } else {
+            WorkStealingPool pool{options.n_threads};
+            pool.submit([&pool, &root, &tree, &totals] { list(&pool, root, tree, totals); });
+            pool.wait();
+        }
+        Snapshot snapshot;
+        snapshot.root_ = root;
+        snapshot.entries_.reserve(totals.entries.load());
+        snapshot.names_.reserve(totals.names.load());
+        lay_out(snapshot, tree, 0);
+        return snapshot;
     }
 
-    const PathImplUnix& mkdir_if_not_exists() const {
-        return Self::mkdir_if_not_exists(*this);
+private:
+    static void list(WorkStealingPool* pool, Path path, Listing& listing, Totals& totals) {
+        try {
+            for (FileIterImplUnix iter{path}; !iter.is_end(); ++iter) {
+                const auto& info = *iter;
+                FileStatus status;
+                if (stat_at(iter.dir_fd(), info.name_c_str(), Fields, StatSync::Default, false, &status) != 0) {
+                    continue; // Removed while listing
+                }
+                const size_t name_size = std::strlen(info.name_c_str());
+                if (listing.names.size() + name_size > std::numeric_limits<uint32_t>::max()) {
+                    throw RuntimeError("Tree is too big for a snapshot");
+                }
+                Snapshot::Entry entry;
+                entry.inode = status.inode;
+                entry.size = status.size;
+                entry.mtime = status.mtime;
+                entry.name = static_cast<uint32_t>(listing.names.size());
+                entry.end = 0;
+                entry.mode = status.mode;
+                entry.name_size = static_cast<uint16_t>(name_size);
+                entry.depth = 0;
+                listing.entries.push_back(entry);
+                listing.names.append(info.name_c_str(), name_size);
+            }
+        } catch (const NoSuchFileException&) {
+            // Removed before it was listed
+        } catch (const NotDirectoryException&) {
+        }
+        totals.entries.fetch_add(listing.entries.size(), std::memory_order_relaxed);
+        totals.names.fetch_add(listing.names.size(), std::memory_order_relaxed);
+        const String& names = listing.names;
+        std::sort(listing.entries.begin(), listing.entries.end(), [&names](const Snapshot::Entry& a, const Snapshot::Entry& b) {
+            return names.compare(a.name, a.name_size, names, b.name, b.name_size) < 0;
+        });
+        for (const auto& entry : listing.entries) {
+            if (entry.is_directory()) {
+                listing.dirs.emplace_back(new Listing);
+                Listing* dir = listing.dirs.back().get();
+                Path child_path{path, PathView{names.data() + entry.name, entry.name_size}};
+                if (pool) {
+                    pool->submit([pool, child_path, dir, &totals] { list(pool, child_path, *dir, totals); });
+                } else {
+                    list(nullptr, child_path, *dir, totals);
+                }
+            }
+        }
     }
 
-    static const PathImplUnix& mkdir_parents(const PathImplUnix& path) {
-        Self cur_path;
-        for (const auto& dir : path.split()) {
-            cur_path = join(cur_path, dir);
-            cur_path.mkdir_if_not_exists();
+    // Appends the listing depth-first and frees it on the way, so the
+    // listings and the snapshot don't both hold the whole tree
+    static void lay_out(Snapshot& snapshot, Listing& listing, size_t depth) {
+        if (depth > std::numeric_limits<uint16_t>::max()) {
+            throw RuntimeError("Tree is too deep for a snapshot");
         }
-        return path;
+        size_t dir = 0;
+        for (const auto& entry : listing.entries) {
+            if (snapshot.names_.size() + entry.name_size > std::numeric_limits<uint32_t>::max() ||
+                    snapshot.entries_.size() >= std::numeric_limits<uint32_t>::max()) {
+                throw RuntimeError("Tree is too big for a snapshot");
+            }
+            const size_t index = snapshot.entries_.size();
+            snapshot.entries_.push_back(entry);
+            snapshot.entries_[index].name = static_cast<uint32_t>(snapshot.names_.size());
+            snapshot.entries_[index].depth = static_cast<uint16_t>(depth);
+            snapshot.names_.append(listing.names.data() + entry.name, entry.name_size);
+            if (entry.is_directory()) {
+                lay_out(snapshot, *listing.dirs[dir], depth + 1);
+                listing.dirs[dir++].reset();
+            }
+            snapshot.entries_[index].end = static_cast<uint32_t>(snapshot.entries_.size());
+        }
+        listing = Listing{};
     }
+};
 
-    const PathImplUnix& mkdir_parents() const {
-        return Self::mkdir_parents(*this);
+// Merges the sibling lists of both snapshots level by level. Subtrees big
+// enough become pool tasks, every task writes its own chunk of changes
+// and chunks are ordered by where they start in the merge.
+class SnapshotDiffImpl {
+private:
+    static const size_t MinTaskEntries = 16 * 1024;
+
+    struct Chunk {
+        size_t position; // Sum of both entry indices where the chunk starts
+        std::vector<WatchEvent> changes;
+    };
+
+public:
+    SnapshotDiffImpl(const Snapshot& a, const Snapshot& b)
+    :   a_(a),
+        b_(b) {
     }
 
-    static const PathImplUnix& rm(const PathImplUnix& path) {
-        const auto res = ::remove(path.path_to_host());
-        check_error(res);
-        return path;
+    std::vector<WatchEvent> run(size_t n_threads) {
+        if (n_threads == 1) {
+            task(nullptr, 0, a_.size(), 0, b_.size(), Path{});
+        } else {
+            WorkStealingPool pool{n_threads};
+            pool.submit([this, &pool] { task(&pool, 0, a_.size(), 0, b_.size(), Path{}); });
+            pool.wait();
+        }
+        std::sort(chunks_.begin(), chunks_.end(), [](const Chunk& x, const Chunk& y) {
+            return x.position < y.position;
+        });
+        size_t size = 0;
+        for (const auto& chunk : chunks_) {
+            size += chunk.changes.size();
+        }
+        std::vector<WatchEvent> changes;
+        changes.reserve(size);
+        for (auto& chunk : chunks_) {
+            std::move(chunk.changes.begin(), chunk.changes.end(), std::back_inserter(changes));
+        }
+        return changes;
     }
 
-    const PathImplUnix& rm() const {
-        return Self::rm(*this);
+private:
+    void task(WorkStealingPool* pool, size_t ai, size_t a_end, size_t bi, size_t b_end, const Path& parent) {
+        Chunk chunk;
+        chunk.position = ai + bi;
+        merge(pool, chunk, ai, a_end, bi, b_end, parent);
+        flush(std::move(chunk));
     }
 
-    static const PathImplUnix& rmrf(const PathImplUnix& path) {
-        FileIterImplUnix iter{path.str()};
-        while (!iter.is_end()) {
-            if (iter.is_directory()) {
-                Self{iter.path()}.rmrf();
+    // Siblings a[ai, a_end) against b[bi, b_end), both under parent
+    void merge(WorkStealingPool* pool, Chunk& chunk, size_t ai, size_t a_end, size_t bi, size_t b_end, const Path& parent) {
+        while (ai < a_end || bi < b_end) {
+            int order = 0;
+            if (ai == a_end) {
+                order = 1;
+            } else if (bi == b_end) {
+                order = -1;
             } else {
-                Self{iter.path()}.rm();
+                order = compare_names(a_.name(ai), b_.name(bi));
             }
-            ++iter;
+
+            if (order < 0) {
+                report_subtree(chunk, a_, ai, parent, WatchEvent::Deleted);
+                ai = a_.entry(ai).end;
+                continue;
+            }
+            if (order > 0) {
+                report_subtree(chunk, b_, bi, parent, WatchEvent::Created);
+                bi = b_.entry(bi).end;
+                continue;
+            }
+
+            const auto& a = a_.entry(ai);
+            const auto& b = b_.entry(bi);
+            const Path path = child_path(parent, b_.name(bi));
+            if ((a.mode & S_IFMT) != (b.mode & S_IFMT)) {
+                report(chunk, path, WatchEvent::Deleted | WatchEvent::Created, b.is_directory());
+                report_children(chunk, a_, ai, path, WatchEvent::Deleted);
+                report_children(chunk, b_, bi, path, WatchEvent::Created);
+            } else if (b.is_directory()) {
+                if (a.mode != b.mode) {
+                    report(chunk, path, WatchEvent::Modified, true);
+                }
+                if (pool && (a.end - ai) + (b.end - bi) >= MinTaskEntries) {
+                    // This level goes on in a new chunk placed after the subtree
+                    flush(std::move(chunk));
+                    chunk = Chunk{};
+                    chunk.position = a.end + b.end;
+                    const size_t a_child = ai + 1, a_child_end = a.end;
+                    const size_t b_child = bi + 1, b_child_end = b.end;
+                    pool->submit([this, pool, a_child, a_child_end, b_child, b_child_end, path] {
+                        task(pool, a_child, a_child_end, b_child, b_child_end, path);
+                    });
+                } else {
+                    merge(pool, chunk, ai + 1, a.end, bi + 1, b.end, path);
+                }
+            } else if (a.mode != b.mode || a.size != b.size || a.mtime != b.mtime || a.inode != b.inode) {
+                report(chunk, path, WatchEvent::Modified, false);
+            }
+            ai = a.end;
+            bi = b.end;
         }
-        path.rm();
-        return path;
     }
 
-    const PathImplUnix& rmrf() const {
-        return Self::rmrf(*this);
+    static Path child_path(const Path& parent, PathView name) {
+        return parent.empty()? Path{name.str()} : Path{parent, name};
     }
 
-    static const PathImplUnix& rmrf_if_exists(const PathImplUnix& path) {
-        if (path.exists()) {
-            return path.rmrf();
+    static int compare_names(PathView a, PathView b) {
+        const int res = std::memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+        if (res != 0) {
+            return res;
         }
-        return path;
+        return a.size() < b.size()? -1 : (a.size() > b.size()? 1 : 0);
     }
 
-    const PathImplUnix& rmrf_if_exists() const {
-        return Self::rmrf_if_exists(*this);
+    static void report(Chunk& chunk, const Path& path, unsigned types, bool is_directory) {
+        chunk.changes.emplace_back();
+        chunk.changes.back().path = path;
+        chunk.changes.back().types = types;
+        chunk.changes.back().is_directory = is_directory;
     }
 
-    bool exists() const {
-        return Self::exists(*this);
+    static void report_subtree(Chunk& chunk, const Snapshot& snapshot, size_t i, const Path& parent, unsigned types) {
+        const Path path = child_path(parent, snapshot.name(i));
+        report(chunk, path, types, snapshot.entry(i).is_directory());
+        report_children(chunk, snapshot, i, path, types);
     }
 
-    static bool exists(const PathImplUnix& path) {
-        struct stat st;
-        const auto res = ::stat(path.path_to_host(), &st);
-        return res == 0;
+    static void report_children(Chunk& chunk, const Snapshot& snapshot, size_t i, const Path& path, unsigned types) {
+        for (size_t child = i + 1; child < snapshot.entry(i).end; child = snapshot.entry(child).end) {
+            report_subtree(chunk, snapshot, child, path, types);
+        }
     }
 
-    operator String&&() {
-        return std::move(str_move());
+    void flush(Chunk&& chunk) {
+        if (chunk.changes.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        chunks_.push_back(std::move(chunk));
     }
+
+    const Snapshot& a_;
+    const Snapshot& b_;
+    std::mutex mutex_;
+    std::vector<Chunk> chunks_;
 };
 
-typedef PathImplUnix Path;
+} // namespace priv {
 
-//PathImplUnix generate_tmp_filename(const PathImplUnix& path, const String& file_prefix) {
-//    String filename = file_prefix + "XXXXXX";
-//    //DO mkstemp
-//    //return path / mktemp(const_cast<char*>(&filename.front()));
-//}
+Snapshot Snapshot::capture(const Path& root, const SnapshotOptions& options) {
+    return priv::SnapshotCaptureImpl::run(root, options);
+}
 
-#undef CREFILE_UNIXERROR
-#undef CREFILE_UNIXCHECK
+// Changes that turn snapshot a into b, paths relative to the roots, in
+// snapshot order. A subtree that appeared or vanished is reported entry
+// by entry, an entry that changed type is Deleted | Created.
+std::vector<WatchEvent> diff(const Snapshot& a, const Snapshot& b, const SnapshotOptions& options = SnapshotOptions{}) {
+    return priv::SnapshotDiffImpl{a, b}.run(options.n_threads);
+}
+#endif
 
-#endif // #if CREFILE_PLATFORM == CREFILE_PLATFORM_UNIX
+#if defined(__linux__)
+struct WatcherOptions {
+    std::chrono::milliseconds debounce{50}; // Quiet time that ends a batch
+    std::chrono::milliseconds max_delay{1000}; // Longest a stream of events holds a batch back
+    size_t expected_directories = 64 * 1024; // Sizes the path table
+};
 
+// Recursive watcher on inotify(7). Every directory gets its own watch,
+// new subdirectories are watched as they appear and their contents are
+// reported as created. Paths of watched directories live in a PathTable,
+// a watch descriptor maps to a table id. Raw events are merged per path
+// into batches, poll() returns a batch once no event came for debounce.
+class Watcher {
+public:
+    explicit Watcher(const Path& root, const WatcherOptions& options = WatcherOptions{})
+    :   root_(root),
+        options_(options),
+        table_(options.expected_directories),
+        buffer_(new char[BufferSize]) {
+        inotify_fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        check_error(inotify_fd_ < 0 ? -1 : 0);
+        wake_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd_ < 0) {
+            const auto error = errno;
+            ::close(inotify_fd_);
+            errno = error;
+            check_error(-1);
+        }
+        try {
+            check_error(watch_tree(PathTable::Root, root_, false) < 0 ? -1 : 0);
+        } catch (...) {
+            ::close(inotify_fd_);
+            ::close(wake_fd_);
+            throw;
+        }
+    }
 
-bool operator == (const Path& path_a, const char* path_b) {
-    return path_a.str() == path_b;
-}
+    Watcher(const Watcher&) = delete;
+    Watcher& operator = (const Watcher&) = delete;
 
-bool operator == (const Path& path_a, const String& path_b) {
-    return path_a.str() == path_b;
-}
+    ~Watcher() {
+        ::close(inotify_fd_);
+        ::close(wake_fd_);
+    }
 
-//void path_join_append_one(String& to, const Path& append) {
-//    if (!to.empty() && !is_slash(to[to.size() - 1])) {
-//        to += DefaultSeparator;
-//    }
-//    to += append.path();
-//}
+    // Waits up to timeout (forever when negative) for events and returns
+    // them merged per path in order of first appearance. Empty on timeout
+    // or after stop().
+    std::vector<WatchEvent> poll(std::chrono::milliseconds timeout) {
+        batch_.clear();
+        batch_index_.clear();
+        if (!wait(timeout)) {
+            return {};
+        }
+        const auto deadline = std::chrono::steady_clock::now() + options_.max_delay;
+        for (;;) {
+            read_events();
+            const auto left = std::min<std::chrono::steady_clock::duration>(options_.debounce,
+                deadline - std::chrono::steady_clock::now());
+            if (left <= std::chrono::steady_clock::duration::zero() ||
+                    !wait(std::chrono::duration_cast<std::chrono::milliseconds>(left))) {
+                break;
+            }
+        }
+        return std::move(batch_);
+    }
 
-Path operator / (const Path& to, const char* add) {
-    return Path{to, add};
-}
+    // Calls callback with every batch until stop()
+    template <typename Callback>
+    void run(Callback&& callback) {
+        while (!stopped_.load(std::memory_order_acquire)) {
+            const auto batch = poll(std::chrono::milliseconds{-1});
+            if (!batch.empty()) {
+                callback(batch);
+            }
+        }
+    }
 
-Path operator / (const Path& to, const String& add) {
-    return Path{to, add};
-}
+    // Wakes poll() and ends run(), callable from any thread
+    void stop() {
+        stopped_.store(true, std::memory_order_release);
+        const uint64_t one = 1;
+        const auto res = ::write(wake_fd_, &one, sizeof(one));
+        (void)res;
+    }
 
-class IterPath {
-public:
-    typedef FileIter const_iterator;
+    // Readable when events are waiting, for event loops
+    int fd() const {
+        return inotify_fd_;
+    }
 
-    IterPath(Path path)
-    :   path_{path} {
+    size_t watch_count() const {
+        return dirs_.size();
     }
 
-    const String& str() const { return path_.str();  }
+    size_t memory_usage() const {
+        return sizeof(*this) + table_.memory_usage() + dirs_.bucket_count() * sizeof(void*) +
+            dirs_.size() * (sizeof(std::pair<const int, PathTable::Id>) + sizeof(void*));
+    }
 
 private:
-    Path path_;
-};
+    static const uint32_t Mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+        IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+    static const size_t BufferSize = 64 * 1024;
 
-static const IterPath iter_dir(const Path& path) {
-    return IterPath{path};
-}
+    // True when the inotify descriptor is readable
+    bool wait(std::chrono::milliseconds timeout) {
+        if (stopped_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+        const int timeout_ms = timeout.count() < 0? -1 : static_cast<int>(std::min<int64_t>(timeout.count(), INT32_MAX));
+        for (;;) {
+            const int res = ::poll(fds, 2, timeout_ms);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            check_error(res < 0 ? -1 : 0);
+            if (fds[1].revents) {
+                uint64_t value;
+                const auto drained = ::read(wake_fd_, &value, sizeof(value));
+                (void)drained;
+                return false;
+            }
+            return res > 0;
+        }
+    }
 
-IterPath::const_iterator begin(const IterPath& path) {
-    return IterPath::const_iterator{path.str()};
-}
+    void read_events() {
+        for (;;) {
+            const auto size = ::read(inotify_fd_, buffer_.get(), BufferSize);
+            if (size < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    return;
+                }
+                check_error(-1);
+            }
+            for (ssize_t pos = 0; pos < size;) {
+                const auto event = reinterpret_cast<const inotify_event*>(buffer_.get() + pos);
+                handle(*event);
+                pos += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
 
-IterPath::const_iterator end(const IterPath& path) {
-    return IterPath::const_iterator{};
-}
+    void handle(const inotify_event& event) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            // Lost events may have made directories, watch the missing ones.
+            // Events before the overflow are handled, so no IN_MOVE_SELF
+            // is on its way for the moved directories.
+            add(root_, WatchEvent::Overflow, true);
+            moved_.clear();
+            watch_tree(PathTable::Root, root_, false);
+            return;
+        }
+        const auto found = dirs_.find(event.wd);
+        if (found == dirs_.end()) {
+            return;
+        }
+        const PathTable::Id dir = found->second;
+        if (event.mask & IN_IGNORED) {
+            dirs_.erase(found);
+            moved_.erase(event.wd);
+            return;
+        }
+        if (event.mask & IN_DELETE_SELF) {
+            if (dir == PathTable::Root) {
+                add(root_, WatchEvent::Deleted, true);
+            }
+            return;
+        }
+        if (event.mask & IN_MOVE_SELF) {
+            // Directories moved within the tree got their watches back from
+            // the IN_MOVED_TO rescan, which comes first and maybe in an
+            // earlier batch. The rest left the tree.
+            if (moved_.erase(event.wd) == 0 && dir != PathTable::Root) {
+                unwatch_subtree(dir);
+            }
+            return;
+        }
+        if (event.len == 0) {
+            return;
+        }
 
-bool is_abspath(const String& path) {
-    return Path::is_abspath(path);
-}
+        unsigned types = 0;
+        if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+            types |= WatchEvent::Created;
+        }
+        if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+            types |= WatchEvent::Deleted;
+        }
+        if (event.mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)) {
+            types |= WatchEvent::Modified;
+        }
+        const bool is_directory = event.mask & IN_ISDIR;
+        const Path path{dir_path(dir), event.name};
+        add(path, types, is_directory);
+        if (is_directory && (event.mask & (IN_CREATE | IN_MOVED_TO))) {
+            // Entries may have been created before the watch was added
+            bool existed = false;
+            const int wd = watch_tree(table_.insert(dir, event.name), path, true, &existed);
+            if (wd >= 0 && existed && (event.mask & IN_MOVED_TO)) {
+                moved_.insert(wd);
+            }
+        }
+    }
 
-Path cwd() {
-    return Path::cwd();
-}
+    void add(const Path& path, unsigned types, bool is_directory) {
+        const auto found = batch_index_.find(path.str());
+        if (found != batch_index_.end()) {
+            batch_[found->second].types |= types;
+            return;
+        }
+        batch_index_.emplace(path.str(), batch_.size());
+        batch_.emplace_back();
+        batch_.back().path = path;
+        batch_.back().types = types;
+        batch_.back().is_directory = is_directory;
+    }
 
-Path cd(const Path& path) {
-    throw NotImplementedException();
-    // return Path::cd(path);
-}
+    Path dir_path(PathTable::Id dir) const {
+        if (dir == PathTable::Root) {
+            return root_;
+        }
+        return Path{root_, table_.path(dir)};
+    }
 
-Path tmp_dir() {
-    return Path::tmp_dir();
-}
+    // Watch descriptor or -1 with errno set, throws when out of watches.
+    // existed tells whether the directory was watched already.
+    int watch(PathTable::Id dir, const char* path, bool* existed = nullptr) {
+        const int wd = ::inotify_add_watch(inotify_fd_, path, Mask);
+        if (wd < 0) {
+            if (errno == ENOSPC) {
+                throw RuntimeError("Out of inotify watches, raise fs.inotify.max_user_watches");
+            }
+            return -1;
+        }
+        // Watching a directory again gives its old descriptor back
+        const auto inserted = dirs_.emplace(wd, dir);
+        inserted.first->second = dir;
+        if (existed) {
+            *existed = !inserted.second;
+        }
+        return wd;
+    }
 
-Path user_dir() {
-    throw NotImplementedException();
-    // return Path::user_dir();
-}
+    // Watches dir and everything below it, reports the contents as created
+    // if asked. Directories which vanish or can't be read meanwhile are
+    // left out. Returns what watch() gives for dir itself.
+    int watch_tree(PathTable::Id dir, const Path& path, bool report, bool* existed = nullptr) {
+        const int wd = watch(dir, path.c_str(), existed);
+        if (wd < 0) {
+            return wd;
+        }
+        WalkOptions options;
+        options.on_error = WalkErrors::Skip;
+        std::vector<PathTable::Id> parents{dir};
+        try {
+            for (const auto& entry : walk(path, options)) {
+                if (report) {
+                    add(Path{entry.path()}, WatchEvent::Created, entry.is_directory());
+                }
+                if (entry.is_directory()) {
+                    parents.resize(entry.depth() + 1);
+                    const PathTable::Id child = table_.insert(parents[entry.depth()], entry.name_c_str());
+                    parents.push_back(child);
+                    watch(child, entry.path().c_str());
+                }
+            }
+        } catch (const Exception&) {
+            // The directory went away before it could be listed
+        }
+        return wd;
+    }
 
-template<typename ... Types>
-String join(Types... args) {
-    return Path::join(args...).str();
-}
+    void unwatch_subtree(PathTable::Id dir) {
+        for (const auto& watched : dirs_) {
+            for (PathTable::Id id = watched.second; id != PathTable::Root; id = table_.parent(id)) {
+                if (id == dir) {
+                    // IN_IGNORED follows and forgets the descriptor
+                    ::inotify_rm_watch(inotify_fd_, watched.first);
+                    break;
+                }
+            }
+        }
+    }
+
+    const Path root_;
+    const WatcherOptions options_;
+    int inotify_fd_ = -1;
+    int wake_fd_ = -1;
+    PathTable table_;
+    std::unordered_map<int, PathTable::Id> dirs_; // Table id of every watch descriptor
+    std::atomic<bool> stopped_{false};
+    std::unique_ptr<char[]> buffer_;
+    std::vector<WatchEvent> batch_;
+    std::unordered_map<String, size_t> batch_index_;
+    std::unordered_set<int> moved_; // Moved within the tree, IN_MOVE_SELF to come
+};
+#endif
 
 } // namespace crefile {
\ No newline at end of file
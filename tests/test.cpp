@@ -2,6 +2,20 @@
 #include <gtest/gtest.h>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <thread>
+#include <future>
+#if CREFILE_PLATFORM != CREFILE_PLATFORM_WIN32
+#include <sys/resource.h>
+#endif
+#if CREFILE_HAVE_IO_URING && defined(__x86_64__)
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#endif
 
 crefile::Path TestsDir;
 
@@ -30,6 +44,334 @@ TEST(common, dirname) {
     ASSERT_EQ("C:/a/b", crefile::WinPath("C:/a/b/c.txt").dirname());
 }
 
+TEST(common, long_path) {
+    const std::string long_name(300, 'x');
+    crefile::PosixPath path{"a", long_name, "b"};
+    ASSERT_EQ("a/" + long_name + "/b", path.str());
+    ASSERT_EQ(path.size(), std::strlen(path.c_str()));
+
+    crefile::PosixPath copy = path;
+    crefile::PosixPath moved = std::move(path);
+    ASSERT_EQ(copy, moved);
+    ASSERT_TRUE(crefile::PosixPath("a") < crefile::PosixPath("a/b"));
+}
+
+TEST(common, storage_append_self) {
+    // The appended characters live in the buffer that growing releases,
+    // first the inline one, then a heap one
+    crefile::priv::PathStorage<16> storage{"dir/basename"};
+    std::string expected = storage.str();
+    while (storage.is_inline() || storage.size() < 100) {
+        storage.append(storage.data() + 4, 8);
+        expected += "basename";
+        ASSERT_EQ(expected, storage.str());
+    }
+}
+
+TEST(common, join_expression) {
+    const crefile::Path root{"/srv"};
+    const crefile::Path file{"c.txt"};
+    const crefile::Path joined = root / "a" / std::string("b/") / file;
+    ASSERT_EQ(crefile::Path("/srv/a/b/c.txt"), joined);
+    ASSERT_EQ("/srv/a", (root / "a").str());
+    ASSERT_STREQ("/srv/a/b", (root / "a" / "b").c_str());
+    ASSERT_EQ(crefile::Path("/srv/a/b"), crefile::Path::join(root, "a", crefile::PathView("b")));
+
+    // An expression kept in a variable would refer to destroyed pieces
+    typedef decltype(root / std::string("a")) Expr;
+    static_assert(!std::is_convertible<Expr&, crefile::Path>::value, "Expression lvalues must not convert");
+    static_assert(std::is_convertible<Expr&&, crefile::Path>::value, "Expression rvalues convert");
+
+    const auto dir = crefile::Path{TestsDir, "join_expression"};
+    ASSERT_FALSE((dir / "a").exists());
+    ASSERT_TRUE((dir / "a").mkdir_parents().is_directory());
+    ASSERT_TRUE((dir / "a").is_directory());
+    (dir / "a").rmrf();
+
+    crefile::Path long_path{std::string(300, 'x')};
+    const char* data = long_path.data();
+    const crefile::Path moved = std::move(long_path) / "y" / "z";
+    ASSERT_EQ(data, moved.data());
+    ASSERT_EQ(304u, moved.size());
+
+    // Pieces pointing into the path being grown, inline and on the heap
+    const std::string name(200, 'n');
+    crefile::Path self{"dir", name};
+    self.append(self.basename());
+    ASSERT_EQ("dir/" + name + "/" + name, self.str());
+    self.append(self.basename(), "x");
+    ASSERT_EQ("dir/" + name + "/" + name + "/" + name + "/x", self.str());
+    crefile::Path head{"dir", name};
+    const crefile::Path joined_self = std::move(head) / head.basename() / "x";
+    ASSERT_EQ("dir/" + name + "/" + name + "/x", joined_self.str());
+}
+
+TEST(common, static_path) {
+    using namespace crefile::literals;
+    constexpr auto spool = "/var/spool"_path / "incoming" / crefile::static_path("mail/");
+    static_assert(spool.size() == 25, "joined at compile time");
+    static_assert(spool.depth() == 5, "components indexed at compile time");
+    static_assert(spool.component(3).size() == 8, "incoming");
+    static_assert(spool.is_abspath(), "");
+    ASSERT_STREQ("/var/spool/incoming/mail/", spool.c_str());
+    ASSERT_EQ("mail", spool.basename());
+
+    const crefile::Path path = spool;
+    ASSERT_EQ(crefile::Path("/var/spool/incoming/mail/"), path);
+    ASSERT_EQ(crefile::Path("/var/spool/incoming/mail/x"), crefile::Path(path / "x"));
+
+    constexpr auto win = crefile::WinStaticPath<4>{"C:\\a"} / "b";
+    static_assert(win.is_abspath() && win.depth() == 3, "");
+    ASSERT_STREQ("C:\\a\\b", win.c_str());
+}
+
+TEST(common, arena_path) {
+    crefile::PathArena arena{1024};
+    const auto mark = arena.mark();
+    const std::string long_name(300, 'x');
+    crefile::ArenaPath path{arena};
+    path.append("a", long_name, "b");
+    ASSERT_EQ("a/" + long_name + "/b", crefile::PathView(path).str());
+    ASSERT_EQ(path.size(), std::strlen(path.c_str()));
+    ASSERT_TRUE(path == crefile::PosixPath("a", long_name, "b"));
+
+    crefile::ArenaPath moved{arena};
+    moved = std::move(path);
+    ASSERT_EQ(long_name.size() + 4, moved.size());
+    ASSERT_TRUE(path.empty());
+
+    // Paths from different arenas copy on move
+    crefile::PathArena other;
+    crefile::ArenaPath copied{other};
+    copied = std::move(moved);
+    ASSERT_EQ(long_name.size() + 4, copied.size());
+    ASSERT_EQ(&other, copied.get_allocator().arena());
+
+    const size_t capacity = arena.capacity();
+    arena.rewind(mark);
+    ASSERT_STREQ("abc", arena.copy("abc", 3));
+    ASSERT_EQ(capacity, arena.capacity());
+}
+
+TEST(common, path_table) {
+    crefile::PathTable table{1024};
+    const auto id = table.insert("/var/log/app.log");
+    ASSERT_EQ(id, table.insert("/var//log/app.log/"));
+    ASSERT_EQ(id, table.find("/var/log/app.log"));
+    ASSERT_EQ(crefile::PathTable::Invalid, table.find("/var/log/other.log"));
+    ASSERT_NE(table.insert("var/log/app.log"), id);
+    ASSERT_EQ("app.log", table.name(id));
+    ASSERT_EQ(4u, table.depth(id));
+    ASSERT_EQ(crefile::Path("/var/log/app.log"), table.path(id));
+    ASSERT_EQ(table.find("/var/log"), table.parent(id));
+    ASSERT_EQ(crefile::Path(""), table.path(crefile::PathTable::Root));
+
+    const std::string long_name(300, 'x');
+    ASSERT_EQ(crefile::Path("a", long_name, "b"), table.path(table.insert(crefile::PosixPath("a", long_name, "b"))));
+}
+
+TEST(common, path_table_concurrent) {
+    crefile::PathTable table{16};
+    const size_t n_threads = 4;
+    std::vector<std::vector<crefile::PathTable::Id>> ids(n_threads);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&table, &ids, t] {
+            for (int i = 0; i < 2000; ++i) {
+                const auto name = std::to_string(i % 50) + "/" + std::to_string(i);
+                ids[t].push_back(table.insert(crefile::PathView(name)));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    ASSERT_EQ(1u + 50u + 2000u, table.size());
+    for (size_t t = 1; t < n_threads; ++t) {
+        ASSERT_EQ(ids[0], ids[t]);
+    }
+    ASSERT_EQ(crefile::Path("7/1007"), table.path(ids[2][1007]));
+}
+
+TEST(common, path_view) {
+    const crefile::PosixPath path{"/var/log/app.tar.gz"};
+    const crefile::PathView view = path;
+    ASSERT_EQ(path.data(), view.data());
+    ASSERT_EQ("/var/log", view.dirname());
+    ASSERT_EQ("/var/log", view.parent());
+    ASSERT_EQ("app.tar.gz", view.basename());
+    ASSERT_EQ("app.tar", view.stem());
+    ASSERT_EQ("gz", view.extension());
+    ASSERT_EQ(path.data() + path.size() - 2, view.extension().data());
+
+    ASSERT_EQ("", crefile::PathView(".bashrc").extension());
+    ASSERT_EQ(".bashrc", crefile::PathView("a/.bashrc").stem());
+    ASSERT_EQ("/", crefile::PathView("/a").parent());
+    ASSERT_EQ("a", crefile::PathView("a//b/").parent());
+    ASSERT_EQ("", crefile::PathView("a").parent());
+    ASSERT_EQ("C:\\a", crefile::WinPath("C:\\a\\b.txt").view().parent());
+    ASSERT_EQ("txt", crefile::WinPath("C:\\a.d\\b.txt").extension());
+    ASSERT_EQ("d\\b", crefile::PosixPath("a.d\\b").extension());
+    ASSERT_EQ("a\\b", crefile::PosixPathView("a\\b").basename());
+    ASSERT_EQ("", crefile::PosixPathView("a\\b").parent());
+    ASSERT_EQ("a", crefile::WinPathView("a\\b").parent());
+#if CREFILE_PLATFORM != CREFILE_PLATFORM_WIN32
+    ASSERT_EQ((std::vector<std::string>{"a\\b"}), crefile::split("a\\b"));
+    ASSERT_EQ("a\\b", crefile::dirname("a\\b"));
+#endif
+
+    std::vector<std::string> components;
+    for (auto component : crefile::PathView("/a//b/c/")) {
+        components.push_back(component.str());
+    }
+    ASSERT_EQ((std::vector<std::string>{"/", "a", "b", "c"}), components);
+}
+
+TEST(common, split) {
+    ASSERT_EQ((std::vector<std::string>{"/", "a/", "/", "b"}), crefile::split("/a//b"));
+    ASSERT_EQ((std::vector<std::string>{"a/", "b/"}), crefile::PosixPath("a/b/").split());
+
+    const crefile::PathView view{"ab/c"};
+    std::vector<std::pair<size_t, size_t>> pieces;
+    for (const auto piece : view.pieces()) {
+        pieces.emplace_back(piece.offset, piece.length);
+    }
+    ASSERT_EQ((std::vector<std::pair<size_t, size_t>>{{0, 3}, {3, 1}}), pieces);
+}
+
+TEST(common, component_index) {
+    crefile::PosixPath path{"/srv//data/logs/"};
+    ASSERT_EQ(4u, path.depth());
+    ASSERT_EQ("/", path.component(0));
+    ASSERT_EQ("data", path.component(2));
+    ASSERT_EQ("/srv//data", path.parent());
+    ASSERT_EQ("", path.basename());
+    ASSERT_EQ("/srv", path.prefix(2));
+    ASSERT_EQ("/srv//data/logs/", path.prefix(10));
+
+    path.append("app.log");
+    ASSERT_EQ(5u, path.depth());
+    ASSERT_EQ("app.log", path.basename());
+    ASSERT_EQ("/srv//data/logs", path.parent());
+
+    ASSERT_TRUE(path.starts_with(crefile::PosixPath("/srv/data")));
+    ASSERT_TRUE(path.starts_with(crefile::PosixPath("/srv//data/")));
+    ASSERT_FALSE(path.starts_with(crefile::PosixPath("/srv/dat")));
+    ASSERT_FALSE(path.starts_with(crefile::PosixPath("srv")));
+    ASSERT_TRUE(crefile::WinPath("C:\\Data\\x").starts_with(crefile::WinPath("c:/data")));
+
+    ASSERT_EQ("/", crefile::PosixPath("/a").parent());
+    ASSERT_EQ("/", crefile::PosixPath("/").parent());
+    ASSERT_EQ("", crefile::PosixPath("a").parent());
+    ASSERT_EQ(0u, crefile::PosixPath("").depth());
+
+    crefile::Path root{"/tmp"};
+    ASSERT_EQ(2u, root.depth());
+    const crefile::Path file = std::move(root) / "a" / "b";
+    ASSERT_EQ(4u, file.depth());
+    ASSERT_EQ("b", file.basename());
+
+    // Past the inline offsets components are kept on the heap, an index
+    // built before appending is extended
+    crefile::PosixPath deep{"/"};
+    ASSERT_EQ(1u, deep.depth());
+    const size_t n = CREFILE_PATH_INDEX_CAPACITY + 4;
+    for (size_t i = 0; i < n; ++i) {
+        deep.append(std::to_string(i));
+    }
+    const crefile::PosixPath copy = deep;
+    ASSERT_EQ(n + 1, copy.depth());
+    ASSERT_EQ("0", copy.component(1));
+    ASSERT_EQ(std::to_string(n - 2), copy.component(n - 1).str());
+    ASSERT_EQ(std::to_string(n - 1), copy.basename().str());
+    ASSERT_EQ(copy.dirname(), copy.parent().str());
+    ASSERT_TRUE(copy.starts_with(crefile::PosixPath{copy.parent()}));
+
+    // The first query of a shared const path may come from many threads
+    const crefile::PosixPath shared{"/srv/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t"};
+    std::vector<std::thread> threads;
+    std::atomic<size_t> wrong{0};
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&shared, &wrong] {
+            if (shared.depth() != 22 || shared.component(21) != "t" || shared.parent().size() != 42) {
+                ++wrong;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    ASSERT_EQ(0u, wrong.load());
+}
+
+TEST(common, path_policies) {
+    ASSERT_EQ(crefile::PosixPath("a\\b/c"), crefile::PosixPath("a\\b", "c"));
+    ASSERT_EQ(crefile::PosixPath("a\\/c"), crefile::PosixPath("a\\", "c"));
+    ASSERT_EQ("a\\b", crefile::PosixPath("a\\b").dirname());
+    ASSERT_EQ("d\\e", crefile::PosixPath("a/x.d\\e").extension());
+    ASSERT_EQ((std::vector<std::string>{"a\\b/", "c"}), crefile::PosixPath("a\\b/c").split());
+    ASSERT_NE(crefile::PosixPath("A/b"), crefile::PosixPath("a/b"));
+
+    ASSERT_EQ(crefile::WinPath("C:\\Users"), crefile::WinPath("c:\\users"));
+    ASSERT_FALSE(crefile::WinPath("c:\\a") < crefile::WinPath("C:\\A"));
+    ASSERT_EQ("C:\\a/b", crefile::WinPath("C:\\a/b\\c.txt").dirname());
+    ASSERT_EQ((std::vector<std::string>{"a\\", "b/", "c"}), crefile::WinPath("a\\b/c").split());
+}
+
+TEST(common, slash_scan_kernels) {
+    std::vector<crefile::priv::SlashMaskFn> kernels{crefile::priv::slash_mask};
+    std::vector<crefile::priv::SlashMaskFn> posix_kernels{crefile::priv::slash_mask<false>};
+#if CREFILE_SIMD_SSE2
+    kernels.push_back(crefile::priv::slash_mask_sse2);
+    posix_kernels.push_back(crefile::priv::slash_mask_sse2<false>);
+#endif
+#if CREFILE_SIMD_AVX2
+    if (crefile::priv::cpu_has_avx2()) {
+        kernels.push_back(crefile::priv::slash_mask_avx2);
+        posix_kernels.push_back(crefile::priv::slash_mask_avx2<false>);
+    }
+#endif
+
+    std::srand(42);
+    for (size_t size = 0; size < 200; ++size) {
+        for (int round = 0; round < 20; ++round) {
+            std::string path(size, 'a');
+            for (auto& c : path) {
+                const int r = std::rand() % 32;
+                c = r == 0? '/' : (r == 1? '\\' : 'a');
+            }
+            for (size_t i = 0; i < size; i += 64) {
+                const auto block = std::min<size_t>(64, size - i);
+                const auto expected = crefile::priv::slash_mask_scalar(path.data() + i, block);
+                for (auto kernel : kernels) {
+                    ASSERT_EQ(expected, kernel(path.data() + i, block)) << path;
+                }
+                const auto posix_expected = crefile::priv::slash_mask_scalar<false>(path.data() + i, block);
+                for (auto kernel : posix_kernels) {
+                    ASSERT_EQ(posix_expected, kernel(path.data() + i, block)) << path;
+                }
+            }
+
+            const auto first = path.find_first_of("/\\");
+            const auto last = path.find_last_of("/\\");
+            ASSERT_EQ(first == std::string::npos? size : first, crefile::priv::find_slash(path.data(), size));
+            ASSERT_EQ(last == std::string::npos? size : last, crefile::priv::rfind_slash(path.data(), size));
+            std::vector<std::string> pieces;
+            size_t start = 0;
+            for (size_t i = 0; i < size; ++i) {
+                if (path[i] == '/' || path[i] == '\\') {
+                    pieces.push_back(path.substr(start, i + 1 - start));
+                    start = i + 1;
+                }
+            }
+            if (start < size) {
+                pieces.push_back(path.substr(start));
+            }
+            ASSERT_EQ(pieces, crefile::priv::split_impl(path.data(), size));
+        }
+    }
+}
+
 TEST(dir, cwd) {
     std::cout << "CWD: " << crefile::cwd().str() << std::endl;
     // FIXME: How to test this?
@@ -109,6 +451,161 @@ TEST(dir, children) {
 }
 
 
+#if CREFILE_PLATFORM != CREFILE_PLATFORM_WIN32
+TEST(dir, mkdir_parents) {
+    const auto root = crefile::Path{TestsDir, "mkdir_parents"};
+    root.rmrf_if_exists();
+    crefile::Path{root, "a"}.mkdir_parents();
+
+    const crefile::Path deep{root, "a", "b//c", "d/"};
+    deep.mkdir_parents();
+    ASSERT_TRUE(crefile::Path(root, "a", "b", "c", "d").exists());
+    deep.mkdir_parents(); // Leaf exists
+    crefile::Path{root, "a", "b", "x"}.mkdir_parents(); // Only the leaf is missing
+    ASSERT_TRUE(crefile::Path(root, "a", "b", "x").exists());
+
+    std::ofstream{crefile::Path{root, "file"}.c_str()};
+    const crefile::Path under_file{root, "file", "a", "b"};
+    ASSERT_THROW(under_file.mkdir_parents(), crefile::NotDirectoryException);
+    root.rmrf();
+}
+#endif
+
+#if CREFILE_PLATFORM != CREFILE_PLATFORM_WIN32
+TEST(stat_many, input_order) {
+    const auto root = crefile::Path{TestsDir, "stat_many"};
+    root.rmrf_if_exists();
+    std::vector<crefile::Path> paths;
+    for (int d = 0; d < 4; ++d) {
+        const crefile::Path dir{root, std::to_string(d)};
+        dir.mkdir_parents();
+        for (int f = 0; f < 300; ++f) {
+            paths.emplace_back(dir, std::to_string(f));
+            std::ofstream{paths.back().c_str()} << std::string(f, 'x');
+        }
+    }
+    std::reverse(paths.begin(), paths.end());
+    paths.emplace_back(root, "missing", "a");
+    paths.emplace_back(root, "0", "1", "a");
+    paths.emplace_back(root, "0/");
+    paths.emplace_back("/");
+
+    crefile::StatManyOptions options;
+    options.fields = crefile::StatFields::Type | crefile::StatFields::Size;
+    options.n_threads = 4;
+    const auto results = crefile::stat_many(paths, options);
+    ASSERT_EQ(paths.size(), results.size());
+    for (size_t i = 0; i < 1200; ++i) {
+        ASSERT_TRUE(results[i].ok());
+        ASSERT_TRUE(results[i].status.is_file());
+        ASSERT_EQ(paths[i].basename().str(), std::to_string(results[i].status.size));
+    }
+    ASSERT_EQ(ENOENT, results[1200].error);
+    ASSERT_THROW(results[1200].check(), crefile::NoSuchFileException);
+    ASSERT_EQ(ENOTDIR, results[1201].error);
+    ASSERT_TRUE(results[1202].status.is_directory());
+    ASSERT_TRUE(results[1203].status.is_directory());
+    root.rmrf();
+}
+
+TEST(stat_cache, invalidation) {
+    const auto root = crefile::Path{TestsDir, "stat_cache"};
+    root.rmrf_if_exists();
+    crefile::StatCacheOptions options;
+    options.ttl = std::chrono::hours{1};
+    crefile::StatCache cache{options};
+    const crefile::Path dir{root, "a"};
+    {
+        const crefile::StatCache::ScopedInstall installed{&cache};
+        ASSERT_FALSE(dir.exists());
+        ASSERT_FALSE(dir.exists());
+        ASSERT_EQ(1u, cache.hits());
+
+        // Changes made behind crefile's back stay unseen until invalidated
+        ASSERT_EQ(0, ::mkdir(root.c_str(), 0777));
+        ASSERT_EQ(0, ::mkdir(dir.c_str(), 0777));
+        ASSERT_FALSE(dir.exists());
+        const auto generation = cache.generation();
+        cache.invalidate(dir.c_str());
+        ASSERT_LT(generation, cache.generation());
+        ASSERT_TRUE(dir.is_directory());
+
+        // Own calls invalidate
+        const crefile::Path sub{dir, "b", "c"};
+        ASSERT_FALSE(sub.exists());
+        sub.mkdir_parents();
+        ASSERT_TRUE(sub.exists());
+        root.rmrf();
+        ASSERT_FALSE(sub.exists());
+        ASSERT_FALSE(dir.exists());
+
+        // Existing directories aren't invalidated again
+        sub.mkdir_parents();
+        const auto unchanged = cache.generation();
+        sub.mkdir_parents();
+        ASSERT_EQ(unchanged, cache.generation());
+
+        // Removing a subtree leaves entries outside it cached
+        const crefile::Path other{root, "other"};
+        other.mkdir_parents();
+        ASSERT_TRUE(other.exists());
+        const auto hits = cache.hits();
+        crefile::Path{root, "a"}.rmrf();
+        ASSERT_FALSE(sub.exists());
+        ASSERT_TRUE(other.exists());
+        ASSERT_EQ(hits + 1, cache.hits());
+
+        // Entries under a subtree stay dropped after the subtrees get swept
+        ASSERT_EQ(0, ::rmdir(other.c_str()));
+        cache.invalidate_subtree(root.c_str());
+        for (int i = 0; i < 100; ++i) {
+            cache.invalidate_subtree(crefile::Path{root, std::to_string(i)}.c_str());
+        }
+        ASSERT_FALSE(other.exists());
+        root.rmrf();
+    }
+    ASSERT_EQ(nullptr, crefile::StatCache::installed());
+    const auto misses = cache.misses();
+    ASSERT_FALSE(dir.exists());
+    ASSERT_EQ(misses, cache.misses());
+}
+
+TEST(stat_cache, ttl_and_threads) {
+    const auto root = crefile::Path{TestsDir, "stat_cache_ttl"};
+    root.rmrf_if_exists();
+    crefile::StatCacheOptions options;
+    options.ttl = std::chrono::milliseconds{1};
+    options.n_shards = 4;
+    crefile::StatCache cache{options};
+
+    struct stat st;
+    ASSERT_EQ(ENOENT, cache.stat(root.c_str(), &st));
+    ASSERT_EQ(0, ::mkdir(root.c_str(), 0777));
+    std::this_thread::sleep_for(std::chrono::milliseconds{5});
+    ASSERT_EQ(0, cache.stat(root.c_str(), &st));
+    ASSERT_TRUE(S_ISDIR(st.st_mode));
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cache, &root, t] {
+            for (int i = 0; i < 500; ++i) {
+                const crefile::Path path{root, std::to_string(i % 20)};
+                struct stat st;
+                cache.lstat(path.c_str(), &st);
+                if (t == 0 && i % 50 == 0) {
+                    cache.invalidate_subtree(root.c_str());
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    ASSERT_LE(cache.size(), 21u);
+    root.rmrf();
+}
+#endif
+
 TEST(iter_dir, dir0) {
     const auto dir = crefile::Path{TestsDir, "iter_dir"};
     crefile::Path{dir, "a"}.mkdir_parents();
@@ -121,6 +618,729 @@ TEST(iter_dir, dir0) {
     ASSERT_EQ(files, filenames);
 }
 
+TEST(iter_dir, small_buffer) {
+    const auto dir = crefile::Path{TestsDir, "iter_dir_small_buffer"};
+    dir.mkdir();
+    std::set<std::string> expected;
+    for (int i = 0; i < 300; ++i) {
+        const auto name = "file_with_a_rather_long_name_" + std::to_string(i);
+        std::ofstream{crefile::Path{dir, name}.c_str()};
+        expected.insert(name);
+    }
+    std::set<std::string> filenames;
+    for (auto file : crefile::iter_dir(dir, 1024)) {
+        filenames.insert(file.name());
+    }
+    ASSERT_EQ(expected, filenames);
+}
+
+#if CREFILE_PLATFORM != CREFILE_PLATFORM_WIN32
+TEST(iter_dir, file_types) {
+    const auto dir = crefile::Path{TestsDir, "iter_dir_file_types"};
+    crefile::Path{dir, "d"}.mkdir_parents();
+    std::ofstream{crefile::Path{dir, "f"}.c_str()};
+    ASSERT_EQ(0, ::symlink("f", crefile::Path{dir, "l"}.c_str()));
+    for (auto file : crefile::iter_dir(dir)) {
+        struct stat st;
+        ASSERT_EQ(0, ::lstat(crefile::Path{dir, file.name()}.c_str(), &st));
+        ASSERT_EQ(st.st_ino, file.inode());
+        ASSERT_EQ(file.name() == "d", file.is_directory());
+        ASSERT_EQ(file.name() == "f", file.is_file());
+        ASSERT_EQ(file.name() == "l", file.is_symlink());
+    }
+}
+
+TEST(iter_dir, file_status) {
+    const auto dir = crefile::Path{TestsDir, "iter_dir_file_status"};
+    dir.mkdir_parents();
+    std::ofstream{crefile::Path{dir, "f"}.c_str()} << "12345";
+    ASSERT_EQ(0, ::symlink("f", crefile::Path{dir, "l"}.c_str()));
+    for (auto file : crefile::iter_dir(dir)) {
+        struct stat st;
+        ASSERT_EQ(0, ::lstat(crefile::Path{dir, file.name()}.c_str(), &st));
+        const auto& status = file.status(crefile::StatFields::Size | crefile::StatFields::Mtime, crefile::StatSync::DontSync);
+        ASSERT_TRUE(status.has(crefile::StatFields::Size | crefile::StatFields::Mtime));
+        ASSERT_EQ(uint64_t(st.st_size), file.size());
+        ASSERT_EQ(st.st_mode, file.mode());
+        ASSERT_EQ(uint64_t(st.st_dev), file.device());
+        ASSERT_EQ(uint64_t(st.st_nlink), file.nlink());
+        ASSERT_EQ(std::chrono::seconds{st.st_mtime}, std::chrono::duration_cast<std::chrono::seconds>(file.mtime().time_since_epoch()));
+        ASSERT_EQ(std::chrono::seconds{st.st_ctime}, std::chrono::duration_cast<std::chrono::seconds>(file.ctime().time_since_epoch()));
+        ASSERT_EQ(file.name() == "l", file.status().is_symlink());
+
+        // Birth time comes without throwing, has() tells whether it's there
+        const auto btime = file.btime();
+        if (!file.status(crefile::StatFields::Btime).has(crefile::StatFields::Btime)) {
+            ASSERT_EQ(crefile::FileTime{}, btime);
+        }
+
+        // A synced result is kept for later ForceSync calls
+        const auto& synced = file.status(crefile::StatFields::Size, crefile::StatSync::ForceSync);
+        if (file.name() == "f") {
+            std::ofstream{crefile::Path{dir, "f"}.c_str(), std::ios::app} << "678";
+            ASSERT_EQ(5u, file.status(crefile::StatFields::Size, crefile::StatSync::ForceSync).size);
+        }
+        ASSERT_EQ(&synced, &file.status(crefile::StatFields::Size, crefile::StatSync::ForceSync));
+    }
+
+    const auto target = crefile::Path{dir, "l"}.status(crefile::StatFields::Type | crefile::StatFields::Size);
+    ASSERT_TRUE(target.is_file());
+    ASSERT_EQ(8u, target.size);
+    ASSERT_THROW((crefile::Path{dir, "missing"}.status()), crefile::NoSuchFileException);
+}
+#endif
+
+TEST(iter_dir, not_existing) {
+    const auto dir = crefile::Path{TestsDir, "iter_dir_not_existing"};
+    ASSERT_THROW(crefile::FileIter{dir}, crefile::NoSuchFileException);
+}
+
+#if CREFILE_PLATFORM != CREFILE_PLATFORM_WIN32
+TEST(rmrf, deep_tree) {
+    const auto root = crefile::Path{TestsDir, "rmrf_deep"};
+    const auto outside = crefile::Path{TestsDir, "rmrf_outside"}.mkdir();
+    std::ofstream{crefile::Path{outside, "keep"}.c_str()};
+
+    auto cur = root;
+    for (int i = 0; i < 200; ++i) {
+        cur = crefile::Path{cur, "d"};
+    }
+    cur.mkdir_parents();
+    // Going down again after a sibling was removed finds far frames closed
+    crefile::Path{cur, "x"}.mkdir();
+    crefile::Path{cur, "y"}.mkdir();
+    cur = root;
+    for (int i = 0; i < 200; ++i) {
+        std::ofstream{crefile::Path{cur, "f"}.c_str()};
+        ASSERT_EQ(0, ::symlink(outside.c_str(), crefile::Path{cur, "l"}.c_str()));
+        cur = crefile::Path{cur, "d"};
+    }
+
+    root.rmrf();
+    ASSERT_FALSE(root.exists());
+    ASSERT_TRUE(crefile::Path(outside, "keep").exists());
+}
+
+TEST(rmrf, parallel) {
+    const auto root = crefile::Path{TestsDir, "rmrf_parallel"};
+    for (int i = 0; i < 20; ++i) {
+        const auto dir = crefile::Path{root, std::to_string(i), "a", "b"}.mkdir_parents();
+        for (int j = 0; j < 20; ++j) {
+            std::ofstream{crefile::Path{dir, std::to_string(j)}.c_str()};
+            std::ofstream{crefile::Path{root, std::to_string(i), std::to_string(j)}.c_str()};
+        }
+    }
+
+    root.rmrf_parallel(4);
+    ASSERT_FALSE(root.exists());
+    ASSERT_THROW(root.rmrf_parallel(4), crefile::NoSuchFileException);
+
+    // Deeper than the descriptors the process may open
+    auto cur = root;
+    for (int i = 0; i < 1000; ++i) {
+        cur = crefile::Path{cur, "d"};
+    }
+    cur.mkdir_parents();
+    struct rlimit limit;
+    ASSERT_EQ(0, ::getrlimit(RLIMIT_NOFILE, &limit));
+    auto lowered = limit;
+    lowered.rlim_cur = 512;
+    ASSERT_EQ(0, ::setrlimit(RLIMIT_NOFILE, &lowered));
+    std::exception_ptr error;
+    try {
+        root.rmrf_parallel(4);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    ASSERT_EQ(0, ::setrlimit(RLIMIT_NOFILE, &limit));
+    ASSERT_FALSE(error);
+    ASSERT_FALSE(root.exists());
+}
+
+TEST(rmrf, batched) {
+    for (const bool io_uring : {true, false}) {
+        crefile::BatchOptions options;
+        options.queue_depth = 4;
+        options.io_uring = io_uring;
+        crefile::BatchEngine engine{options};
+        ASSERT_FALSE(!io_uring && engine.uses_io_uring());
+
+        const auto root = crefile::Path{TestsDir, "rmrf_batched"};
+        for (int i = 0; i < 5; ++i) {
+            const auto dir = crefile::Path{root, std::to_string(i), "a"}.mkdir_parents();
+            for (int j = 0; j < 10; ++j) {
+                std::ofstream{crefile::Path{dir, std::to_string(j)}.c_str()};
+                std::ofstream{crefile::Path{root, std::to_string(i), std::to_string(j)}.c_str()};
+            }
+        }
+        root.rmrf(engine);
+        ASSERT_FALSE(root.exists());
+    }
+}
+
+TEST(batch, path_lists) {
+    for (const bool io_uring : {true, false}) {
+        crefile::BatchOptions options;
+        options.queue_depth = 8;
+        options.io_uring = io_uring;
+        crefile::BatchEngine engine{options};
+
+        const auto root = crefile::Path{TestsDir, "batch_path_lists"};
+        root.rmrf_if_exists();
+        root.mkdir();
+        std::vector<crefile::Path> dirs, files, moved;
+        for (int i = 0; i < 20; ++i) {
+            dirs.emplace_back(root, "d" + std::to_string(i));
+            files.emplace_back(root, "f" + std::to_string(i));
+            moved.emplace_back(root, "m" + std::to_string(i));
+            std::ofstream{files.back().c_str()} << std::string(i, 'x');
+        }
+        dirs.emplace_back(root, "missing", "d");
+
+        const auto made = engine.mkdir(dirs);
+        for (int i = 0; i < 20; ++i) {
+            ASSERT_EQ(0, made[i]);
+        }
+        ASSERT_EQ(ENOENT, made[20]);
+        ASSERT_EQ(EEXIST, engine.mkdir(dirs)[0]);
+
+        const auto stats = engine.stat(files, crefile::StatFields::Type | crefile::StatFields::Size);
+        for (int i = 0; i < 20; ++i) {
+            ASSERT_TRUE(stats[i].ok());
+            ASSERT_TRUE(stats[i].status.is_file());
+            ASSERT_EQ(uint64_t(i), stats[i].status.size);
+        }
+
+        for (const int error : engine.rename(files, moved)) {
+            ASSERT_EQ(0, error);
+        }
+        ASSERT_FALSE(files[0].exists());
+        for (const int error : engine.unlink(moved)) {
+            ASSERT_EQ(0, error);
+        }
+        dirs.pop_back();
+        for (const int error : engine.rmdir(dirs)) {
+            ASSERT_EQ(0, error);
+        }
+        ASSERT_EQ(ENOENT, engine.stat(dirs)[3].error);
+        root.rm();
+    }
+}
+
+#if CREFILE_HAVE_IO_URING && defined(__x86_64__)
+// Runs fn in a child process under ptrace. Every n-th io_uring_enter
+// that submits entries runs in the kernel, then returns error. Gives the
+// exit code of fn.
+int run_with_failed_io_uring_enter(int n, int error, const std::function<int()>& fn) {
+    const pid_t child = ::fork();
+    if (child == 0) {
+        ::ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        ::raise(SIGSTOP);
+        ::_exit(fn());
+    }
+    int status = 0;
+    ::waitpid(child, &status, 0);
+    ::ptrace(PTRACE_SETOPTIONS, child, nullptr, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+    bool entry = true;
+    int enters = 0;
+    int signal = 0;
+    for (;;) {
+        ::ptrace(PTRACE_SYSCALL, child, nullptr, signal);
+        ::waitpid(child, &status, 0);
+        if (!WIFSTOPPED(status)) {
+            break;
+        }
+        signal = 0;
+        if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+            signal = WSTOPSIG(status);
+            continue;
+        }
+        user_regs_struct regs;
+        ::ptrace(PTRACE_GETREGS, child, nullptr, &regs);
+        // Second argument is the number of entries to submit
+        if (!entry && regs.orig_rax == __NR_io_uring_enter && regs.rsi > 0 && ++enters % n == 0) {
+            regs.rax = static_cast<unsigned long long>(-error);
+            ::ptrace(PTRACE_SETREGS, child, nullptr, &regs);
+        }
+        entry = !entry;
+    }
+    return WIFEXITED(status)? WEXITSTATUS(status) : -1;
+}
+
+TEST(batch, io_uring_enter_fails) {
+    // Long walks keep ops in the kernel while the failure is handled
+    crefile::Path deep{TestsDir, "batch_enter_fails"};
+    for (int i = 0; i < 1500; ++i) {
+        deep.append("a");
+    }
+    deep.mkdir_parents();
+    // Ops the kernel took before the failure must not run again and
+    // report EEXIST. Every engine gets one failure and closes its ring.
+    const int res = run_with_failed_io_uring_enter(2, EIO, [&deep] {
+        for (int round = 0; round < 20; ++round) {
+            crefile::BatchOptions options;
+            options.queue_depth = 8;
+            crefile::BatchEngine engine{options};
+            if (!engine.uses_io_uring()) {
+                return 2;
+            }
+            std::vector<crefile::Path> dirs;
+            for (int i = 0; i < 40; ++i) {
+                dirs.emplace_back(deep, std::to_string(round) + "_" + std::to_string(i));
+            }
+            for (const int error : engine.mkdir(dirs)) {
+                if (error != 0) {
+                    return 1;
+                }
+            }
+            if (engine.uses_io_uring()) {
+                return 3;
+            }
+        }
+        return 0;
+    });
+    if (res != 2) {
+        ASSERT_EQ(0, res);
+        ASSERT_TRUE(crefile::Path(deep, "19_39").is_directory());
+    }
+    crefile::Path{TestsDir, "batch_enter_fails"}.rmrf();
+}
+#endif
+
+TEST(async, executor_survives_throwing_task) {
+    crefile::ThreadPoolExecutor executor{1};
+    executor.post([] { throw std::runtime_error{"task failed"}; });
+    std::promise<void> done;
+    executor.post([&done] { done.set_value(); });
+    ASSERT_EQ(std::future_status::ready, done.get_future().wait_for(std::chrono::seconds{10}));
+}
+
+#if CREFILE_HAVE_COROUTINES
+// Coroutine started right away, run() waits for it to finish
+struct TestTask {
+    struct promise_type {
+        std::promise<void> done;
+
+        TestTask get_return_object() { return TestTask{done.get_future()}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { done.set_value(); }
+        void unhandled_exception() { done.set_exception(std::current_exception()); }
+    };
+
+    void run() { result.get(); }
+
+    std::future<void> result;
+};
+
+TestTask async_tree(crefile::Executor& executor, const crefile::Path& root, std::set<std::string>& names, bool& missing) {
+    co_await crefile::Path{root, "a", "b"}.async_mkdir_parents(executor);
+    for (int i = 0; i < 5; ++i) {
+        std::ofstream{crefile::Path{root, "a", std::to_string(i)}.c_str()};
+    }
+    auto dir = crefile::async_iter_dir(crefile::Path{root, "a"}, executor, 2);
+    while (co_await dir.next()) {
+        names.insert(dir.entry().name + (dir.entry().is_directory()? "/" : ""));
+    }
+    const auto status = co_await crefile::Path{root, "a", "0"}.async_status(crefile::StatFields::Type, executor);
+    EXPECT_TRUE(status.is_file());
+    co_await root.async_rmrf(executor);
+    missing = !co_await root.async_exists(executor);
+    co_await root.async_rm(executor);
+}
+
+TEST(async, coroutines) {
+    crefile::ThreadPoolExecutor executor{2};
+    const auto root = crefile::Path{TestsDir, "async_coroutines"};
+    root.rmrf_if_exists();
+    std::set<std::string> names;
+    bool missing = false;
+    ASSERT_THROW(async_tree(executor, root, names, missing).run(), crefile::NoSuchFileException);
+    ASSERT_EQ((std::set<std::string>{"0", "1", "2", "3", "4", "b/"}), names);
+    ASSERT_TRUE(missing);
+}
+#endif
+
+TEST(rmrf, file) {
+    const auto file = crefile::Path{TestsDir, "rmrf_file"};
+    std::ofstream{file.c_str()};
+    file.rmrf();
+    ASSERT_FALSE(file.exists());
+}
+#endif
+
+#if CREFILE_PLATFORM != CREFILE_PLATFORM_WIN32
+TEST(walk, orders) {
+    const auto root = crefile::Path{TestsDir, "walk_orders"};
+    crefile::Path{root, "a", "b"}.mkdir_parents();
+    std::ofstream{crefile::Path{root, "a", "b", "f"}.c_str()};
+    std::ofstream{crefile::Path{root, "a", "c"}.c_str()};
+
+    std::vector<std::string> pre;
+    for (const auto& entry : crefile::walk(root)) {
+        pre.push_back(entry.path() + ":" + std::to_string(entry.depth()));
+    }
+    std::sort(pre.begin() + 1, pre.end());
+    const auto root_prefix = root.str() + "/";
+    ASSERT_EQ((std::vector<std::string>{
+        root_prefix + "a:0",
+        root_prefix + "a/b/f:2",
+        root_prefix + "a/b:1",
+        root_prefix + "a/c:1"}), pre);
+
+    crefile::WalkOptions options;
+    options.order = crefile::WalkOrder::PostOrder;
+    std::vector<std::string> post;
+    for (const auto& entry : crefile::walk(root, options)) {
+        post.push_back(entry.name());
+    }
+    ASSERT_EQ(4u, post.size());
+    ASSERT_EQ("a", post.back());
+    ASSERT_LT(std::find(post.begin(), post.end(), "f"), std::find(post.begin(), post.end(), "b"));
+}
+
+TEST(walk, prune_and_symlinks) {
+    const auto root = crefile::Path{TestsDir, "walk_prune"};
+    crefile::Path{root, "skip", "inner"}.mkdir_parents();
+    crefile::Path{root, "keep", "inner"}.mkdir_parents();
+    ASSERT_EQ(0, ::symlink("..", crefile::Path{root, "keep", "loop"}.c_str()));
+
+    std::set<std::string> names;
+    for (const auto& entry : crefile::walk(root)) {
+        names.insert(entry.path().substr(root.str().size() + 1));
+        if (entry.name() == "skip") {
+            entry.prune();
+        }
+    }
+    ASSERT_EQ((std::set<std::string>{"skip", "keep", "keep/inner", "keep/loop"}), names);
+
+    crefile::WalkOptions options;
+    options.follow_symlinks = true;
+    size_t count = 0;
+    for (const auto& entry : crefile::walk(root, options)) {
+        (void)entry;
+        ++count;
+    }
+    // keep/loop points to the walked root, which is on the stack already
+    ASSERT_EQ(5u, count);
+}
+
+TEST(walk, errors) {
+    const auto root = crefile::Path{TestsDir, "walk_errors"};
+    const auto make_tree = [&root] {
+        crefile::Path{root, "gone", "inner"}.mkdir_parents();
+        crefile::Path{root, "keep", "inner"}.mkdir_parents();
+    };
+    // Removing a directory before the walk descends into it fails to open it
+    const auto walk_removing = [&root](const crefile::WalkOptions& options) {
+        std::set<std::string> names;
+        for (const auto& entry : crefile::walk(root, options)) {
+            names.insert(entry.path().substr(root.str().size() + 1));
+            if (entry.name() == "gone") {
+                crefile::Path{entry.path()}.rmrf();
+            }
+        }
+        return names;
+    };
+
+    make_tree();
+    ASSERT_THROW(walk_removing(crefile::WalkOptions{}), crefile::NoSuchFileException);
+
+    make_tree();
+    crefile::WalkOptions options;
+    options.on_error = crefile::WalkErrors::Skip;
+    ASSERT_EQ((std::set<std::string>{"gone", "keep", "keep/inner"}), walk_removing(options));
+    ASSERT_THROW(begin(crefile::walk(crefile::Path{root, "missing"}, options)), crefile::NoSuchFileException);
+}
+
+TEST(walk, parallel) {
+    const auto root = crefile::Path{TestsDir, "walk_parallel"};
+    std::set<std::string> expected;
+    for (int i = 0; i < 10; ++i) {
+        const auto dir = crefile::Path{root, std::to_string(i), "sub"}.mkdir_parents();
+        expected.insert(crefile::Path{root, std::to_string(i)}.str());
+        expected.insert(dir.str());
+        for (int j = 0; j < 10; ++j) {
+            const auto file = crefile::Path{dir, std::to_string(j)};
+            std::ofstream{file.c_str()};
+            expected.insert(file.str());
+        }
+    }
+
+    for (auto order : {crefile::ScheduleOrder::DepthFirst, crefile::ScheduleOrder::BreadthFirst}) {
+        crefile::ParallelWalkOptions options;
+        options.n_threads = 4;
+        options.order = order;
+        std::mutex mutex;
+        std::set<std::string> visited;
+        crefile::parallel_walk(root, [&](const crefile::WalkEntry& entry) {
+            std::lock_guard<std::mutex> lock(mutex);
+            visited.insert(entry.path());
+        }, options);
+        ASSERT_EQ(expected, visited);
+    }
+
+    ASSERT_THROW(crefile::parallel_walk(root, [](const crefile::WalkEntry&) {
+        throw crefile::RuntimeError("visitor failed");
+    }), crefile::RuntimeError);
+
+    // Directories removed before their task opens them
+    crefile::ParallelWalkOptions options;
+    options.n_threads = 1;
+    const auto remove_dir = [](const crefile::WalkEntry& entry) {
+        crefile::Path{entry.path()}.rmrf();
+    };
+    ASSERT_THROW(crefile::parallel_walk(root, remove_dir, options), crefile::NoSuchFileException);
+    for (int i = 0; i < 10; ++i) {
+        crefile::Path{root, std::to_string(i), "sub"}.mkdir_parents();
+    }
+    options.on_error = crefile::WalkErrors::Skip;
+    std::atomic<size_t> visited{0};
+    crefile::parallel_walk(root, [&](const crefile::WalkEntry& entry) {
+        remove_dir(entry);
+        visited.fetch_add(1);
+    }, options);
+    ASSERT_EQ(10u, visited.load());
+}
+#endif
+
+#if CREFILE_PLATFORM != CREFILE_PLATFORM_WIN32
+std::map<std::string, unsigned> relative_events(const std::vector<crefile::WatchEvent>& batch, const crefile::Path& root) {
+    std::map<std::string, unsigned> events;
+    for (const auto& event : batch) {
+        events[event.path.str().substr(root.size() + 1)] |= event.types;
+    }
+    return events;
+}
+
+TEST(poll_watcher, snapshot_diff) {
+    const auto root = crefile::Path{TestsDir, "poll_watcher"};
+    crefile::Path{root, "a"}.mkdir_parents();
+    crefile::Path{root, "b", "c"}.mkdir_parents();
+    std::ofstream{crefile::Path{root, "a", "f"}.c_str()};
+    std::ofstream{crefile::Path{root, "b", "c", "x"}.c_str()};
+    std::ofstream{crefile::Path{root, "t"}.c_str()};
+
+    crefile::PollWatcher watcher{root};
+    ASSERT_EQ(7u, watcher.size());
+    ASSERT_TRUE(watcher.poll().empty());
+
+    std::ofstream{crefile::Path{root, "a", "f"}.c_str()} << "more";
+    std::ofstream{crefile::Path{root, "a", "g"}.c_str()};
+    crefile::Path{root, "b"}.rmrf();
+    crefile::Path{root, "t"}.rm();
+    crefile::Path{root, "t", "d"}.mkdir_parents();
+    std::ofstream{crefile::Path{root, "t", "d", "y"}.c_str()};
+    auto events = relative_events(watcher.poll(), root);
+    ASSERT_EQ((std::map<std::string, unsigned>{
+        {"a/f", crefile::WatchEvent::Modified},
+        {"a/g", crefile::WatchEvent::Created},
+        {"b", crefile::WatchEvent::Deleted},
+        {"b/c", crefile::WatchEvent::Deleted},
+        {"b/c/x", crefile::WatchEvent::Deleted},
+        {"t", crefile::WatchEvent::Deleted | crefile::WatchEvent::Created},
+        {"t/d", crefile::WatchEvent::Created},
+        {"t/d/y", crefile::WatchEvent::Created},
+    }), events);
+    ASSERT_EQ(7u, watcher.size());
+    ASSERT_TRUE(watcher.poll().empty());
+
+    crefile::PollWatcherOptions options;
+    options.check_files = true;
+    crefile::PollWatcher file_watcher{root, options};
+    std::ofstream{crefile::Path{root, "t", "d", "y"}.c_str()} << "changed";
+    events = relative_events(file_watcher.poll(), root);
+    ASSERT_EQ(crefile::WatchEvent::Modified, events["t/d/y"]);
+    root.rmrf();
+}
+
+TEST(poll_watcher, churn) {
+    const auto root = crefile::Path{TestsDir, "poll_watcher_churn"};
+    root.rmrf_if_exists();
+    crefile::Path{root, "d"}.mkdir_parents();
+    crefile::PollWatcherOptions options;
+    options.expected_paths = 16;
+    crefile::PollWatcher watcher{root, options};
+    std::ofstream{crefile::Path{root, "d", "kept"}.c_str()};
+    ASSERT_EQ(1u, watcher.poll().size());
+
+    // Names of removed files don't pile up in the snapshot
+    size_t first_memory = 0;
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 500; ++i) {
+            std::ofstream{crefile::Path{root, "d", std::to_string(round * 500 + i)}.c_str()};
+        }
+        ASSERT_EQ(500u, watcher.poll().size());
+        crefile::Path{root, "d"}.rmrf();
+        crefile::Path{root, "d"}.mkdir();
+        std::ofstream{crefile::Path{root, "d", "kept"}.c_str()};
+        watcher.poll();
+        ASSERT_EQ(3u, watcher.size());
+        if (round == 0) {
+            first_memory = watcher.memory_usage();
+        }
+    }
+    ASSERT_GT(2 * first_memory, watcher.memory_usage());
+    std::ofstream{crefile::Path{root, "d", "kept"}.c_str()} << "x";
+    const auto events = relative_events(watcher.poll(), root);
+    ASSERT_EQ(crefile::WatchEvent::Modified, events.at("d/kept"));
+    root.rmrf();
+}
+
+TEST(snapshot, capture_and_diff) {
+    const auto root = crefile::Path{TestsDir, "snapshot"};
+    for (const char* dir : {"d0", "d1"}) {
+        crefile::Path{root, dir}.mkdir_parents();
+        // Big enough for a diff task of its own
+        for (int i = 0; i < 8200; ++i) {
+            std::ofstream{crefile::Path{root, dir, std::to_string(i)}.c_str()};
+        }
+    }
+    crefile::Path{root, "gone"}.mkdir();
+    std::ofstream{crefile::Path{root, "gone", "x"}.c_str()};
+    std::ofstream{crefile::Path{root, "keep"}.c_str()};
+    std::ofstream{crefile::Path{root, "t"}.c_str()};
+
+    const auto before = crefile::Snapshot::capture(root);
+    ASSERT_EQ(16406u, before.size());
+    std::vector<std::string> paths;
+    before.for_each([&paths](crefile::PathView path, const crefile::Snapshot::Entry&) {
+        paths.push_back(path.str());
+    });
+    ASSERT_EQ("d0", paths[0]);
+    ASSERT_EQ("d0/0", paths[1]);
+    ASSERT_EQ("d0/1", paths[2]);
+    ASSERT_EQ("gone/x", paths[16403]);
+    ASSERT_EQ("t", paths.back());
+
+    std::ofstream{crefile::Path{root, "d1", "5"}.c_str()} << "changed";
+    std::ofstream{crefile::Path{root, "d0", "new"}.c_str()};
+    crefile::Path{root, "gone"}.rmrf();
+    ASSERT_EQ(0, ::chmod(crefile::Path{root, "keep"}.c_str(), 0600));
+    crefile::Path{root, "t"}.rm();
+    crefile::Path{root, "t"}.mkdir();
+    std::ofstream{crefile::Path{root, "t", "y"}.c_str()};
+
+    crefile::SnapshotOptions options;
+    options.n_threads = 4;
+    const auto after = crefile::Snapshot::capture(root, options);
+    const std::vector<std::pair<std::string, unsigned>> expected = {
+        {"d0/new", crefile::WatchEvent::Created},
+        {"d1/5", crefile::WatchEvent::Modified},
+        {"gone", crefile::WatchEvent::Deleted},
+        {"gone/x", crefile::WatchEvent::Deleted},
+        {"keep", crefile::WatchEvent::Modified},
+        {"t", crefile::WatchEvent::Deleted | crefile::WatchEvent::Created},
+        {"t/y", crefile::WatchEvent::Created},
+    };
+    for (const size_t n_threads : {1, 4}) {
+        options.n_threads = n_threads;
+        std::vector<std::pair<std::string, unsigned>> changes;
+        for (const auto& change : crefile::diff(before, after, options)) {
+            changes.emplace_back(change.path.str(), change.types);
+        }
+        ASSERT_EQ(expected, changes);
+    }
+    ASSERT_TRUE(crefile::diff(after, after).empty());
+
+    // Only entries below the root may vanish on the way
+    ASSERT_THROW(crefile::Snapshot::capture(crefile::Path{root, "missing"}), crefile::NoSuchFileException);
+    ASSERT_THROW(crefile::Snapshot::capture(crefile::Path{root, "keep"}), crefile::NotDirectoryException);
+    root.rmrf();
+}
+#endif
+
+#if defined(__linux__)
+// Events of a batch by path relative to root
+std::map<std::string, unsigned> watch_events(crefile::Watcher& watcher, const crefile::Path& root) {
+    return relative_events(watcher.poll(std::chrono::milliseconds{1000}), root);
+}
+
+TEST(watcher, recursive) {
+    const auto root = crefile::Path{TestsDir, "watcher"};
+    const auto outside = crefile::Path{TestsDir, "watcher_outside"};
+    crefile::Path{root, "a"}.mkdir_parents();
+    outside.mkdir_if_not_exists();
+    crefile::WatcherOptions options;
+    options.debounce = std::chrono::milliseconds{20};
+    crefile::Watcher watcher{root, options};
+    ASSERT_EQ(2u, watcher.watch_count());
+
+    {
+        std::ofstream file{crefile::Path{root, "a", "f"}.c_str()};
+        file << "one";
+        file.flush();
+        file << "two";
+    }
+    crefile::Path{root, "a", "b", "c"}.mkdir_parents();
+    auto events = watch_events(watcher, root);
+    ASSERT_EQ(crefile::WatchEvent::Created | crefile::WatchEvent::Modified, events["a/f"]);
+    ASSERT_TRUE(events["a/b"] & crefile::WatchEvent::Created);
+    ASSERT_TRUE(events["a/b/c"] & crefile::WatchEvent::Created);
+    ASSERT_EQ(4u, watcher.watch_count());
+
+    ASSERT_EQ(0, ::rename(crefile::Path{root, "a"}.c_str(), crefile::Path{root, "z"}.c_str()));
+    events = watch_events(watcher, root);
+    ASSERT_EQ(crefile::WatchEvent::Deleted, events["a"]);
+    ASSERT_EQ(crefile::WatchEvent::Created, events["z"]);
+    std::ofstream{crefile::Path{root, "z", "b", "c", "x"}.c_str()};
+    events = watch_events(watcher, root);
+    ASSERT_EQ(1u, events.size());
+    ASSERT_TRUE(events["z/b/c/x"] & crefile::WatchEvent::Created);
+
+    ASSERT_EQ(0, ::rename(crefile::Path{root, "z"}.c_str(), crefile::Path{outside, "z"}.c_str()));
+    events = watch_events(watcher, root);
+    ASSERT_EQ(crefile::WatchEvent::Deleted, events["z"]);
+    std::ofstream{crefile::Path{outside, "z", "b", "y"}.c_str()};
+    ASSERT_TRUE(watch_events(watcher, root).empty());
+    ASSERT_EQ(1u, watcher.watch_count());
+
+    std::thread stopper{[&watcher] {
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        watcher.stop();
+    }};
+    watcher.run([](const std::vector<crefile::WatchEvent>&) {});
+    stopper.join();
+    root.rmrf();
+    outside.rmrf();
+}
+
+TEST(watcher, overflow_rescan) {
+    const auto root = crefile::Path{TestsDir, "watcher_overflow"};
+    root.rmrf_if_exists();
+    root.mkdir_parents();
+    size_t max_queued = 0;
+    std::ifstream{"/proc/sys/fs/inotify/max_queued_events"} >> max_queued;
+    if (max_queued == 0 || max_queued > 100000) {
+        root.rmrf();
+        return;
+    }
+    crefile::WatcherOptions options;
+    options.debounce = std::chrono::milliseconds{20};
+    crefile::Watcher watcher{root, options};
+
+    // Every file gives IN_CREATE and IN_CLOSE_WRITE, the queue overflows
+    // before the directory made last is reported
+    for (size_t i = 0; i < max_queued / 2 + 100; ++i) {
+        const int fd = ::open(crefile::Path{root, std::to_string(i)}.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+        ASSERT_LE(0, fd);
+        ::close(fd);
+    }
+    crefile::Path{root, "late"}.mkdir();
+    bool overflow = false;
+    for (const auto& event : watcher.poll(std::chrono::milliseconds{1000})) {
+        overflow = overflow || (event.types & crefile::WatchEvent::Overflow);
+    }
+    ASSERT_TRUE(overflow);
+    ASSERT_EQ(2u, watcher.watch_count());
+
+    std::ofstream{crefile::Path{root, "late", "x"}.c_str()};
+    auto events = watch_events(watcher, root);
+    ASSERT_TRUE(events["late/x"] & crefile::WatchEvent::Created);
+    root.rmrf();
+}
+#endif
+
 //TEST(iter_dir, tmp) {
 //    const auto dir = crefile::Path{"/tmp"};
 //    for (auto file : crefile::iter_dir(dir)) {